@@ -38,3 +38,12 @@ option(HUSTLE_UBSAN "Build with undefined behavior sanitizer" OFF)
 option(HUSTLE_CODE_COVERAGE "Enable generating code coverage info" OFF)
 option(HUSTLE_ENABLE_WARNINGS "Enable compiler warnings." ON)
 option(HUSTLE_WARNINGS_AS_ERRORS "Treat compiler warnings as errors." OFF)
+
+# Throwing from a fault handler relies on unwinding through the signal frame,
+# which is only known to work with GCC and Clang under Linux
+if(HUSTLE_GNU_COMPILER AND CMAKE_SYSTEM_NAME STREQUAL "Linux")
+	set(HUSTLE_GUARD_PAGES_DEFAULT ON)
+else()
+	set(HUSTLE_GUARD_PAGES_DEFAULT OFF)
+endif()
+option(HUSTLE_GUARD_PAGES "Detect stack overflow with guard pages instead of bounds checks" ${HUSTLE_GUARD_PAGES_DEFAULT})
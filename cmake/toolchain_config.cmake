@@ -41,3 +41,9 @@ if(CMAKE_CXX_COMPILER_ID MATCHES "GNU")
     set(CMAKE_CXX_FLAGS "-Wno-class-memaccess ${CMAKE_CXX_FLAGS}")
 endif()
 
+
+if(HUSTLE_GUARD_PAGES)
+    # Stack overflows are thrown from a signal handler, so pushes need to be
+    # able to throw
+    set(CMAKE_CXX_FLAGS "-fnon-call-exceptions ${CMAKE_CXX_FLAGS}")
+endif()
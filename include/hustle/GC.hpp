@@ -7,12 +7,18 @@
 #ifndef HUSTLE_GC_HPP
 #define HUSTLE_GC_HPP
 
+#include <atomic>
 #include <functional>
+#include <map>
+#include <memory>
 #include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
 #include <hustle/Core.hpp>
+#include <hustle/Object.hpp>
 #include <hustle/Support/Assert.hpp>
+#include <hustle/Support/Memory.hpp>
 #include <hustle/cell.hpp>
 
 namespace hustle {
@@ -27,43 +33,255 @@ class HeapRegion {
   static constexpr size_t REGION_SIZE = 16 * 1024 * 1024;
 
 public:
-  HeapRegion(Heap* heap);
-  ~HeapRegion();
+  /**
+   * \param size bytes usable at first
+   * \param max_size bytes of address space to reserve, up to which the region
+   * can grow. Defaults to size.
+   */
+  HeapRegion(Heap* heap, size_t size = REGION_SIZE, size_t max_size = 0);
+  ~HeapRegion() = default;
   Object* allocate(size_t sz);
 
   size_t bytes_free() { return end_ - allocate_ptr_; }
+  size_t bytes_used() const { return allocate_ptr_ - start_; }
+  size_t capacity() const { return end_ - start_; }
+  /// Bytes of address space reserved, which capacity() can grow to
+  size_t reserved() const { return memory_.size(); }
 
-  bool contains(void* ptr) const noexcept {
+  bool contains(const void* ptr) const noexcept {
     return ptr >= start_ && ptr < end_;
   }
 
 private:
   void reset();
+
+  /**
+   * Change the usable size, rounded up to whole pages. Pages past the new
+   * size are returned to the OS.
+   */
+  void resize(size_t size);
+
   Heap* const heap_;
+  MemorySegment memory_;
   uint8_t* start_;
   uint8_t* allocate_ptr_;
   uint8_t* end_;
 };
 
+/**
+ * Generational copying collector.
+ *
+ * Objects are bump allocated in the nursery. A minor collection copies the
+ * live ones to a survivor space, and those which have already survived
+ * TENURE_AGE - 1 collections are promoted to the old generation instead. Only
+ * young objects are traced, so a minor collection costs time proportional to
+ * the live young objects, plus the roots.
+ *
+ * Old objects pointing at young ones are found through a card table: the old
+ * generation is split into cards of CARD_SIZE bytes, and write_barrier() marks
+ * the cards written to. Any store of a cell into an object which may have
+ * been promoted, that is one which has been live across an allocation, must
+ * be followed by a call to write_barrier(). Objects being initialised right
+ * after their allocation don't need one.
+ *
+ * When the old generation can't take everything the nursery might promote, a
+ * major collection copies all live objects to the other old semi-space. Each
+ * semi-space reserves enough address space to take the maximum size plus a
+ * full promotion, so a copy which has started always fits. If a major
+ * collection leaves the old generation without room for a full promotion
+ * under the maximum size, the allocation which triggered it throws "Heap
+ * exhausted", rather than every later minor collection turning into a major
+ * one.
+ *
+ * The old generation starts out with the initial size given to the
+ * constructor. After a major collection it grows, up to the maximum size, if
+ * more than half of it survived. After SHRINK_AFTER major collections in a
+ * row which left less than a quarter of it in use, it shrinks back towards
+ * the initial size. Semi-space pages which aren't in use are returned to the
+ * OS, including the whole of the semi-space being copied to, between major
+ * collections.
+ *
+ * Objects of LARGE_OBJECT_SIZE bytes or more are never copied. Each one gets
+ * its own mapping, and belongs to the old generation from the start. They
+ * have cards of their own, which start out marked so the object can be
+ * filled in. A major collection marks the ones which are reachable and frees
+ * the rest. Allocating as many bytes of them as the old generation holds
+ * triggers a major collection, and together with the old generation they
+ * can't take more than the maximum size.
+ *
+ * Major collections can copy with several threads. Each copies into its own
+ * local allocation buffer, carved out of the semi-space being copied to, and
+ * claims an object by installing the forwarding pointer in its header with a
+ * compare and swap. Objects copied but not scanned yet go on the thread's
+ * work stealing deque, which the other threads take from when they run out
+ * of work. The helper threads are started along with the heap, and wait
+ * between collections. The semi-spaces reserve room for what the buffers may
+ * leave unused on top of everything else, and a collection falls back to a
+ * single thread when the heap has grown past that. Minor collections always
+ * run on a single thread.
+ */
 class Heap {
 public:
   using MarkFunction = std::function<void(cell_t*)>;
   using MarkRootsFunction = std::function<void(MarkFunction)>;
   struct FreeObject;
-  Heap(MarkRootsFunction);
-  ~Heap() = default;
-  // TODO: this should be inlined for perf, but for the moment we leave it this
-  // way for flexibility
+
+  static constexpr size_t NURSERY_SIZE = 2 * 1024 * 1024;
+  static constexpr size_t SURVIVOR_SIZE = 1024 * 1024;
+  /// Objects at least this big are allocated in the large object space
+  static constexpr size_t LARGE_OBJECT_SIZE = 128 * 1024;
+  /// Number of minor collections an object survives before being promoted
+  static constexpr unsigned TENURE_AGE = 2;
+  static constexpr unsigned CARD_BITS = 9;
+  static constexpr size_t CARD_SIZE = size_t(1) << CARD_BITS;
+  static constexpr size_t DEFAULT_INITIAL_SIZE = 4 * 1024 * 1024;
+  static constexpr size_t DEFAULT_MAX_SIZE = size_t(1) << 30;
+  static constexpr unsigned SHRINK_AFTER = 4;
+
+  /**
+   * \param initial_size,max_size bytes usable by the old generation. The
+   * nursery and survivor spaces come on top of these.
+   * \param gc_threads threads copying objects in a major collection, counting
+   * the one which started it
+   */
+  Heap(MarkRootsFunction, size_t initial_size = DEFAULT_INITIAL_SIZE,
+       size_t max_size = DEFAULT_MAX_SIZE, unsigned gc_threads = 1);
+  ~Heap();
+  /// Run a minor collection before every allocation, for testing
   bool debug_alloc = false;
+  /// Make debug_alloc run major collections instead
+  bool debug_alloc_major = false;
   Object* allocate(size_t size) HUSTLE_MAY_ALLOCATE;
+
+  /// Collect everything, moving all live objects
   void gc();
 
+  /**
+   * Collect the young generation, or everything if the old generation might
+   * not have room for the objects which would be promoted.
+   */
+  void minor_gc();
+
+  /// Record a store into any of the cells of obj
+  void write_barrier(Object* obj) noexcept {
+    if (current_heap_->contains(obj)) {
+      mark_cards(obj, obj->size());
+    } else if (!is_young(obj)) {
+      mark_large_cards(obj, obj->size());
+    }
+  }
+
+  /// Record a store into the cell at slot
+  void write_barrier_slot(const void* slot) noexcept {
+    uintptr_t offset = (const uint8_t*)slot - current_heap_->start_;
+    if (offset < (uintptr_t)(current_heap_->end_ - current_heap_->start_)) {
+      cards_[offset >> CARD_BITS] = CARD_DIRTY;
+    } else if (!is_young(slot)) {
+      mark_large_cards(slot, sizeof(Cell));
+    }
+  }
+
+  bool is_young(const void* ptr) const noexcept {
+    return nursery_.contains(ptr) || survivor_->contains(ptr);
+  }
+
+  bool is_old(const void* ptr) const noexcept {
+    return current_heap_->contains(ptr);
+  }
+
+  /// Check if obj is the start of an object in the large object space
+  bool is_large(const void* obj) const noexcept {
+    return large_objects_.count(obj) != 0;
+  }
+
+  size_t large_object_count() const noexcept { return large_objects_.size(); }
+
+  /// Bytes usable by the old generation
+  size_t capacity() const noexcept { return capacity_; }
+
+  unsigned gc_threads() const noexcept { return gc_threads_; }
+
+  size_t minor_collections = 0;
+  size_t major_collections = 0;
+  /// Bytes copied into the old generation by minor collections
+  size_t bytes_promoted = 0;
+
 private:
+  static constexpr uint8_t CARD_CLEAN = 0;
+  static constexpr uint8_t CARD_DIRTY = 1;
+  /// Marks a card which no object starts before
+  static constexpr uint32_t NO_OBJECT = UINT32_MAX;
+
+  /// An object too big to be copied, in a mapping of its own
+  struct LargeObject {
+    LargeObject(MemorySegment&& memory, size_t size);
+    MemorySegment memory;
+    /// Size of the object, which the mapping is rounded up from
+    size_t size;
+    /// One entry per card of the object
+    std::vector<uint8_t> cards;
+    /// Reached by the major collection in progress
+    std::atomic<bool> marked{false};
+    /// Next to be scanned by the major collection in progress
+    LargeObject* next_marked = nullptr;
+    /// Set while in the list of objects with marked cards
+    bool remembered = false;
+    LargeObject* next_remembered = nullptr;
+  };
+
   void swap_heaps();
+  /// Throw if the last major collection left the heap all but full
+  void check_exhausted();
+  /// Copy everything reachable to backup_heap_, on this thread
+  void copy_live();
+  /// Copy everything reachable to backup_heap_, with gc_threads_ threads
+  void copy_live_parallel();
+  void collect_young();
+  Object* allocate_old(size_t sz);
+  Object* allocate_large(size_t sz);
+  /// Mark the cards of [begin, begin + size), if it's in a large object
+  void mark_large_cards(const void* begin, size_t size) noexcept;
+  /// Free large objects which the last major collection didn't reach
+  void sweep_large();
+  /// Capacity to give the old generation when live bytes survive
+  size_t target_capacity(size_t live) const noexcept;
+  /// Apply capacity_ to the current old region and its cards
+  void resize_old();
+  void mark_cards(const void* begin, size_t size) noexcept;
+  void record_object(const void* obj, size_t size) noexcept;
+  void clear_cards();
+
   MarkRootsFunction mark_roots_;
+  HeapRegion nursery_, survivor_a_, survivor_b_;
+  HeapRegion *survivor_, *backup_survivor_;
   HeapRegion region_a_, region_b_;
   HeapRegion *current_heap_, *backup_heap_;
+
+  const size_t initial_size_, max_size_;
+  size_t capacity_;
+  const unsigned gc_threads_;
+  class ThreadPool;
+  /// Helpers for major collections, when there are several gc_threads_
+  std::unique_ptr<ThreadPool> thread_pool_;
+  /// Major collections in a row which left the old generation mostly empty
+  unsigned sparse_collections_ = 0;
+
+  /// One entry per card of the current old region
+  std::vector<uint8_t> cards_;
+  /// For each card, the offset of the object covering its first byte
+  std::vector<uint32_t> object_starts_;
+
+  /// Large objects by address
+  std::map<const void*, LargeObject> large_objects_;
+  /// Large objects with marked cards
+  LargeObject* remembered_ = nullptr;
+  /// Bytes taken by large objects
+  size_t large_bytes_ = 0;
+  /// Bytes of large objects allocated since the last major collection
+  size_t large_bytes_allocated_ = 0;
   bool running_gc_ = false;
+  /// Set by a major collection which left no room for a full promotion
+  bool exhausted_ = false;
 };
 
 class HandleManager;
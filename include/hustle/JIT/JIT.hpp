@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * \file
+ * Baseline template JIT.
+ *
+ * Each cell of a quotation's definition is translated to a fixed sequence of
+ * x86-64 instructions:
+ *
+ *  - Fixnum literals (and wrapped fixnums) are pushed directly as immediates.
+ *  - Other literals are loaded from the definition and pushed.
+ *  - Stack shuffles the interpreter inlines (dup, drop, swap and over) are
+ *    done in place.
+ *  - Superinstructions and other primitives are called directly.
+ *  - Anything else (compound words, and primitives such as call which manage
+ *    the call stack themselves) is handed back to the interpreter loop, which
+ *    resumes the compiled code once the call returns. Calls from native code
+ *    therefore use call frames, not the C++ stack, and tail calls replace the
+ *    caller's frame, exactly as in the interpreter.
+ *
+ * Generated code never embeds heap pointers. Heap operands are reloaded
+ * through the quotation in the current call frame, which the GC traces and
+ * updates like any other frame, so a collection never needs to patch code.
+ * The code cache lives outside the heap and is never moved.
+ *
+ * Compiled code checks VM::code_epoch_ on entry. If code has been invalidated
+ * since it was generated, the native entry point is dropped and the quotation
+ * is run by the interpreter until it becomes hot again. The cache is flushed
+ * the next time something is compiled, or once it fills up.
+ */
+
+#ifndef HUSTLE_JIT_JIT_HPP
+#define HUSTLE_JIT_JIT_HPP
+
+#include "hustle/Object.hpp"
+#include "hustle/VM.hpp"
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+namespace hustle {
+
+namespace jit {
+class CodeCache;
+}
+
+class JIT : public NativeCompiler {
+public:
+  static constexpr size_t DEFAULT_CACHE_SIZE = 4 * 1024 * 1024;
+
+  explicit JIT(VM& vm, size_t cache_size = DEFAULT_CACHE_SIZE);
+  ~JIT() override;
+
+  /// Check if native code can be generated on this platform
+  static bool is_supported();
+
+  Quotation::FuncType compile(VM& vm, Quotation* quote) override;
+
+  void mark_roots(Heap::MarkFunction fn) override;
+
+  /// Check if fn is native code generated by this JIT
+  bool owns(Quotation::FuncType fn) const;
+
+  /// Drop all compiled code, sending the quotations using it back to the
+  /// interpreter. No compiled code may be running.
+  void flush();
+
+private:
+  /// Check if calls to a word can be made directly from native code
+  bool is_direct_call(Word* word) const;
+
+  /// Install generated code, flushing the cache if that makes room
+  Quotation::FuncType install(VM& vm, const std::vector<uint8_t>& code,
+                              const std::vector<uint8_t>& cfi);
+
+  std::unique_ptr<jit::CodeCache> cache_;
+
+  /// Quotations whose entry points are in the cache
+  std::vector<Cell> compiled_;
+
+  /// Value of VM::code_epoch_ when the oldest code in the cache was compiled
+  intptr_t epoch_;
+
+  /// Primitives which replace their own call frame, and so must be run by the
+  /// interpreter
+  std::unordered_set<Quotation::FuncType> frame_primitives_;
+};
+
+} // namespace hustle
+#endif
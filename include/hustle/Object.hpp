@@ -18,6 +18,7 @@
 
 namespace hustle {
 struct VM;
+struct Word;
 
 // TODO: split concept of object resolution from min object size
 constexpr size_t OBJECT_RESOLUTION = 8;
@@ -29,18 +30,30 @@ struct Object {
   // 0: forwarding bits;
   // 63:1 - forwarding ptr (if forwarding bit set)
   // TAG_BITS+1:1 - tag
-  // 63:TAG_BITS+2 - size;
+  // 59:TAG_BITS+2 - size;
+  // 63:60 - age, the number of collections survived while young
   Object(cell_tag tag, size_t size) noexcept {
     uintptr_t tmp_header = set_bits<CELL_TAG_BITS + 1, 1>(tag);
-    header = set_bits<63, CELL_TAG_BITS + 2>(size, tmp_header);
+    header = set_bits<59, CELL_TAG_BITS + 2>(size, tmp_header);
   }
   // constexpr Object(uint32_t head = 0, uint32_t sz = sizeof(Object)) noexcept:
   // header(head), size_(sz) {}
   template <typename T>
   constexpr Object(T* dummy, size_t extra = 0) noexcept
       : Object(T::TAG_VALUE, sizeof(T) + extra) {}
-  constexpr uint32_t size() const {
-    return gsl::narrow_cast<uint32_t>(get_bits<63, CELL_TAG_BITS + 2>(header));
+  constexpr uint32_t size() const { return header_size(header); }
+
+  /// Size recorded in a header word
+  static constexpr uint32_t header_size(uintptr_t header) {
+    return gsl::narrow_cast<uint32_t>(get_bits<59, CELL_TAG_BITS + 2>(header));
+  }
+
+  /// Largest age which can be stored in the header
+  static constexpr unsigned MAX_AGE = 15;
+  unsigned age() const noexcept { return get_bits<63, 60>(header); }
+  void set_age(unsigned age) noexcept {
+    HSTL_ASSERT(age <= MAX_AGE);
+    header = set_bits<63, 60>(age, header);
   }
   constexpr cell_tag tag() const noexcept {
     return (cell_tag)get_bits<CELL_TAG_BITS + 1, 1>(header);
@@ -64,6 +77,34 @@ struct Object {
     header = obj_raw | 1;
   }
 
+  /// The header word, read atomically, for collector threads
+  uintptr_t load_header() const noexcept {
+    return shared_header().load(std::memory_order_acquire);
+  }
+
+  /// Object a header word forwards to, or nullptr if it doesn't
+  static Object* forwarding_of(uintptr_t header) noexcept {
+    return (header & 1) ? (Object*)(header & ~uintptr_t(1)) : nullptr;
+  }
+
+  /**
+   * Forward to obj, unless another collector thread has changed the header
+   * since it was read as expected.
+   *
+   * \returns the object this is forwarded to
+   */
+  Object* try_forward_to(uintptr_t expected, Object* obj) noexcept {
+    uintptr_t obj_raw = (uintptr_t)obj;
+    HSTL_ASSERT((obj_raw & 1) == 0);
+    if (shared_header().compare_exchange_strong(expected, obj_raw | 1,
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+      return obj;
+    }
+    HSTL_ASSERT(forwarding_of(expected) != nullptr);
+    return forwarding_of(expected);
+  }
+
   Cell get_cell() const {
     HSTL_ASSERT(!is_forwarding());
     uintptr_t raw_ptr = (uintptr_t)this;
@@ -72,6 +113,14 @@ struct Object {
   }
 
 private:
+  std::atomic<uintptr_t>& shared_header() const noexcept {
+    static_assert(sizeof(std::atomic<uintptr_t>) == sizeof(uintptr_t) &&
+                      std::atomic<uintptr_t>::is_always_lock_free,
+                  "The header must be usable as an atomic");
+    return *reinterpret_cast<std::atomic<uintptr_t>*>(
+        const_cast<uintptr_t*>(&header));
+  }
+
   uintptr_t header = 0;
 
   // constexpr bool is_marked() const noexcept { return header.marked; }
@@ -211,6 +260,41 @@ inline size_t object_allocation_size(String*, const char*, size_t sz) {
   return sz + sizeof(String) + 1;
 }
 
+/**
+ * Number of cells a piece of code takes from and leaves on the data stack.
+ *
+ * \sa infer_effect()
+ */
+struct StackEffect {
+  /// Cells taken from the stack, or -1 if the effect is not known
+  int32_t in = -1;
+
+  /// Cells left in their place
+  int32_t out = 0;
+
+  /// Most cells in use above the starting depth at any point
+  int32_t growth = 0;
+
+  static constexpr StackEffect of(int32_t in, int32_t out) {
+    return {in, out, out > in ? out - in : 0};
+  }
+
+  constexpr bool known() const { return in >= 0; }
+
+  /// Change in the depth of the stack
+  constexpr int32_t net() const { return out - in; }
+
+  /// Effect of running this, followed by next
+  constexpr StackEffect then(StackEffect next) const {
+    if (!known() || !next.known()) {
+      return {};
+    }
+    int32_t total_in = std::max(in, next.in - net());
+    return {total_in, total_in + net() + next.net(),
+            std::max(growth, net() + next.growth)};
+  }
+};
+
 /**
  * Basic "code" block of the language.
  *
@@ -240,10 +324,74 @@ struct Quotation : public Object {
   /**
    * An optional native entry point for this quote.
    *
-   * Currently this is only provided for primitives, however this would
-   * also be set once we start jit compiling quotes
+   * This is provided for primitives, and is set by the JIT once a quote has
+   * been compiled to native code.
    */
   FuncType entry;
+
+  /**
+   * Pre-decoded instruction stream for the definition.
+   *
+   * Built lazily by the interpreter, and rebuilt if code_epoch does not match
+   * the VM's current epoch. \sa compile_quotation()
+   */
+  TypedCell<Array> code;
+
+  /// Value of VM::code_epoch_ when code was built
+  Cell code_epoch;
+
+  /// Number of times the interpreter has entered this quote
+  uintptr_t invocations = 0;
+
+  /// Number of backward jumps taken in the code of this quote
+  uintptr_t back_edges = 0;
+
+  /**
+   * Set for primitives which never touch the call stack.
+   *
+   * These are called without pushing a frame, and are passed a null quote.
+   */
+  bool is_leaf = false;
+
+  /**
+   * Set for primitives whose result depends only on their inputs.
+   *
+   * Calls with literal inputs are evaluated when a word is defined.
+   */
+  bool is_pure = false;
+
+  /**
+   * Set once the NativeCompiler has failed to compile this quote, so it is
+   * not tried again. Cleared along with the code when the quote changes.
+   */
+  bool native_failed = false;
+
+  /// Stack effect declared for a primitive. Unknown for other quotes.
+  StackEffect effect;
+
+  /**
+   * The definition as written, before it was optimized.
+   *
+   * Null until the quote is given to the Optimizer. \sa Optimizer::optimize()
+   */
+  TypedCell<Array> source;
+
+  /**
+   * The word this was last made the definition of, by VM::register_symbol().
+   *
+   * The word may have been redefined since, so check its definition before
+   * relying on this.
+   */
+  TypedCell<Word> word;
+
+  /**
+   * For a quotation literal in the body of a "::" word which uses its locals,
+   * the definition of that word.
+   *
+   * The literal may run in a frame of its own, so it finds the locals in the
+   * nearest frame running this. \sa VM::current_locals()
+   */
+  TypedCell<Quotation> scope;
 } HUSTLE_HEAP_ALLOCATED;
 
 /**
@@ -274,6 +422,14 @@ struct Word : public Object {
   TypedCell<Quotation> definition;
   Cell properties; // Hash table
 
+  /**
+   * Incremented whenever definition is replaced.
+   *
+   * Call sites which have been specialised for a particular definition check
+   * this before using it.
+   */
+  Cell version = Cell::from_int(0);
+
   /**
    * Indicate if this is a parseword (eg if it is evaluated immediately at parse
    * time).
@@ -7,25 +7,57 @@
 #define HUSTLE_STACK_HPP
 
 #include <hustle/Support/Error.hpp>
+#include <hustle/Support/Memory.hpp>
 #include <hustle/cell.hpp>
+#include <hustle/config.h>
 
 namespace hustle {
 
 /// Repesent stacks in the hustle language
 /// The data stack uses this class directly, while the call stack uses this as a
 /// base class
+///
+/// Address space for the largest allowed stack is reserved up front, but pages
+/// are only committed as the stack grows down into them, so base() moves.
+///
+/// With HUSTLE_GUARD_PAGES, the pages below base() are inaccessible, and
+/// pushing past the end of the stack faults into a handler which grows the
+/// stack, or throws the overflow error once it is at its limit. Pushes then
+/// don't need to compare against base().
 class Stack {
 public:
   /// Create stack with a given size
   /// \param sz Size of the stack in slots
-  Stack(size_t sz);
+  Stack(size_t sz) : Stack(sz, sz) {}
+
+  /// Create a stack which grows on demand
+  /// \param initial Number of slots usable before the stack first grows
+  /// \param limit Maximum size of the stack in slots
+  Stack(size_t initial, size_t limit);
   Stack(const Stack&) = delete;
   Stack& operator=(const Stack&) = delete;
   ~Stack();
-  void push(Cell cell);
-  void push(cell_t raw);
 
-  Cell pop();
+  void push(Cell cell) {
+#if HUSTLE_GUARD_PAGES
+    // Store before moving sp_, so a fault leaves the stack as it was
+    sp_[-1] = cell;
+    --sp_;
+#else
+    if (sp_ <= base_) {
+      grow(1);
+    }
+    *--sp_ = cell;
+#endif
+  }
+  void push(cell_t raw) { push(Cell::from_raw(raw)); }
+
+  Cell pop() {
+    if (sp_ >= top_) {
+      underflow();
+    }
+    return *sp_++;
+  }
   template <typename T>
   T* pop_obj() {
     return pop().cast<T>();
@@ -52,7 +84,56 @@ public:
 
   constexpr size_t depth() const { return top_ - sp_; }
 
-  Cell peek() const;
+  Cell peek() const {
+    if (sp_ >= top_) {
+      underflow();
+    }
+    return *sp_;
+  }
+
+  /**
+   * Throw unless the stack holds at least count cells.
+   *
+   * Afterwards the top count cells can be used with top() and drop(), which
+   * don't repeat the check. This lets primitives read their operands into
+   * locals and write their result in place, instead of popping and pushing
+   * one cell at a time.
+   */
+  void require(size_t count) const {
+    if (depth() < count) {
+      underflow();
+    }
+  }
+
+  /**
+   * Make room for count more cells, throwing if the stack can't grow that far.
+   *
+   * Afterwards up to count cells can be pushed with push_unchecked().
+   */
+  void reserve(size_t count) {
+    if ((size_t)(sp_ - base_) < count) {
+      grow(count);
+    }
+  }
+
+  /// Push a cell, without checking for overflow
+  void push_unchecked(Cell cell) {
+    HSTL_ASSERT(sp_ > base_);
+    *--sp_ = cell;
+  }
+
+  /// Get the cell idx below the top of the stack, without checking the depth
+  Cell& top(size_t idx = 0) {
+    HSTL_ASSERT(idx < depth());
+    return sp_[idx];
+  }
+
+  /// Remove count cells, without checking the depth
+  void drop(size_t count) {
+    HSTL_ASSERT(count <= depth());
+    sp_ += count;
+  }
+
   Cell* begin() { return sp_; }
   const Cell* cbegin() const { return sp_; }
   Cell* end() { return top_; }
@@ -61,26 +142,86 @@ public:
   const Cell* sp() const { return sp_; }
   void clear();
 
+  /// Location of the stack pointer, for use by generated code
+  Cell** sp_address() { return &sp_; }
+
+  /// Lowest usable address of the stack. Pushing when sp() is here grows the
+  /// stack, which moves the base.
+  const Cell* base() const { return base_; }
+
+  /// Location of the base, for use by generated code
+  Cell* const* base_address() const { return &base_; }
+
+  /// Number of cells which can be pushed before the stack next grows
+  size_t capacity() const { return top_ - base_; }
+
+  /// Largest capacity the stack can grow to
+  size_t limit() const { return top_ - limit_; }
+
 protected:
+  [[noreturn]] static void overflow();
+  [[noreturn]] static void underflow();
+
+  /// Commit enough pages below base_ for count cells above sp_, or throw if
+  /// that would pass limit_
+  void grow(size_t count);
+
+  /// Called when the guard below base_ is touched
+  static void guard_fault(void* stack);
+
+  MemorySegment memory_;
+  /// Lowest address base_ can grow down to
+  Cell* limit_;
   Cell* base_;
   Cell* sp_;
   Cell* top_;
 };
 
+struct Array;
+struct Quotation;
+struct Word;
+
 // TODO: this should maybe be a record type?
-// TODO: make sure this is packed
 /***
  * Frame in hustle the call stack
+ *
+ * Frames hold untagged pointers, so calls and returns don't tag or untag
+ * anything. VM::mark_roots() traces them precisely, moving ip along with its
+ * code.
  */
 struct StackFrame {
   /// calling/called word, or null if anonymous quote
-  TypedCell<Word> word;
+  Word* word = nullptr;
 
   /// calling/called quote, or null for an interpreter entry frame
-  TypedCell<Quotation> quote;
+  Quotation* quote = nullptr;
+
+  /// Instruction stream being executed, or null if the quote has not been
+  /// entered yet
+  Array* code = nullptr;
+
+  /// Where execution continues in code once the frame is back on top. Only
+  /// written when the interpreter leaves the frame.
+  Cell* ip = nullptr;
+
+  /// Value set aside by dip while its quotation runs
+  Cell retain = Cell::from_int(0);
 
-  /// Offset in the quote definition
-  Cell offset;
+  /// Inputs of the "::" word running in this frame, the last one first. Set
+  /// by OP_ENTER_LOCALS, and points into VM::locals_.
+  Cell* locals = nullptr;
+
+  /// Set when code is a definition, which cold quotes are walked through a
+  /// cell at a time instead of being lowered
+  bool walking = false;
+
+  /// Set along with walking when native code left the frame to make a call.
+  /// ip is where the native code resumes, or where walking carries on if the
+  /// native code has since been dropped.
+  bool native = false;
+
+  /// Offset of ip in the instruction stream, for backtraces
+  size_t offset() const;
 };
 
 class CallStack;
@@ -103,8 +244,12 @@ private:
  */
 class CallStack : private Stack {
 public:
-  CallStack(size_t frame_ct)
-      : Stack(frame_ct * (sizeof(StackFrame) / sizeof(Cell))) {}
+  /// Number of cells used by each frame
+  static constexpr size_t FRAME_CELLS = sizeof(StackFrame) / sizeof(Cell);
+
+  CallStack(size_t frame_ct) : Stack(frame_ct * FRAME_CELLS) {}
+  CallStack(size_t initial_frames, size_t max_frames)
+      : Stack(initial_frames * FRAME_CELLS, max_frames * FRAME_CELLS) {}
   void push(const StackFrame& frame);
 
   // This is a hack to allow us to unwind the call stack after a C++ exception
@@ -112,16 +257,22 @@ public:
 
   State get_state();
   void restore_state(State);
-  void update_offset(size_t offset);
   StackFrame pop();
 
+  /// Get the current frame, which can be updated in place
+  StackFrame& top() {
+    HSTL_ASSERT(sp_ < top_);
+    return *(StackFrame*)sp_;
+  }
+
   StackFrame* begin() {
-    HSTL_ASSERT((top_ - sp_) % 3 == 0);
+    HSTL_ASSERT((top_ - sp_) % FRAME_CELLS == 0);
     return (StackFrame*)sp_;
   }
   StackFrame* end() { return (StackFrame*)top_; }
 
   using Stack::sp;
+  using Stack::sp_address;
   // TODO there seems like safety issue with this call
   StackFrame& operator[](uintptr_t idx);
   StackFrame peek() { return (*this)[0]; }
@@ -140,17 +291,10 @@ inline CallStack::State CallStack::get_state() {
 inline StackFrame& CallStack::operator[](uintptr_t idx) {
   HSTL_ASSERT(sp_ <= top_);
 
-  HSTL_ASSERT((uintptr_t)(top_ - sp_) >=
-              (idx * (sizeof(StackFrame) / sizeof(Cell))));
+  HSTL_ASSERT((uintptr_t)(top_ - sp_) >= (idx * FRAME_CELLS));
   return *(((StackFrame*)sp_) + idx);
 }
 
-// TODO this is really inefficient
-inline void CallStack::update_offset(size_t offset) {
-  StackFrame frame = pop();
-  frame.offset = Cell::from_int(offset);
-  push(frame);
-}
 inline void CallStack::restore_state(State s) {
   HSTL_ASSERT(s.sp != nullptr);
   HSTL_ASSERT(s.sp > sp_);
@@ -159,16 +303,26 @@ inline void CallStack::restore_state(State s) {
 }
 
 inline void CallStack::push(const StackFrame& f) {
-  Stack::push(f.offset);
-  Stack::push(f.quote);
-  Stack::push(f.word);
+#if HUSTLE_GUARD_PAGES
+  // A frame which doesn't fit faults, then is written again once the stack
+  // has grown
+  *((StackFrame*)sp_ - 1) = f;
+  sp_ -= FRAME_CELLS;
+#else
+  if ((size_t)(sp_ - base_) < FRAME_CELLS) {
+    grow(FRAME_CELLS);
+  }
+  sp_ -= FRAME_CELLS;
+  *(StackFrame*)sp_ = f;
+#endif
 }
 
 inline StackFrame CallStack::pop() {
-  StackFrame f;
-  f.word = Stack::pop();
-  f.quote = Stack::pop();
-  f.offset = Stack::pop();
+  if (depth() < FRAME_CELLS) {
+    underflow();
+  }
+  StackFrame f = *(StackFrame*)sp_;
+  sp_ += FRAME_CELLS;
   return f;
 }
 
@@ -18,4 +18,11 @@
 #define HUSTLE_NO_RETURN
 #endif
 
+/// Set if the compiler supports taking the address of a label (goto *ptr)
+#if defined(__GNUC__)
+#define HUSTLE_COMPUTED_GOTO 1
+#else
+#define HUSTLE_COMPUTED_GOTO 0
+#endif
+
 #endif
@@ -14,6 +14,12 @@ class Memory {
 public:
   enum Flags { MEM_READ = 1, MEM_WRITE = 2, MEM_EXEC = 4 };
 
+  /**
+   * Map size bytes of memory.
+   *
+   * Without any flags only address space is reserved. Pages are committed as
+   * protect() makes them accessible.
+   */
   static MemorySegment allocate(size_t size, unsigned flags);
 
   // TODO: do we want to be able to change protections on a subsection?
@@ -24,6 +30,42 @@ public:
 
   // Should not need to call this directly
   static void release(MemorySegment& segment);
+
+  /**
+   * Return the pages of a region to the OS.
+   *
+   * The region is left reserved but inaccessible, as if it had been allocated
+   * without any flags, and reads as zero once protect() makes it accessible
+   * again.
+   *
+   * \param addr page aligned start of the region
+   * \param size size of the region, a multiple of page_size()
+   */
+  static void decommit(void* addr, size_t size);
+
+  /// Granularity of protection changes
+  static size_t page_size();
+
+  /// Called with the context passed to add_guard()
+  using FaultHandler = void (*)(void* context);
+
+  /**
+   * Make a region inaccessible, and call handler when it is touched.
+   *
+   * The handler runs in place of the faulting instruction. It can either
+   * throw, or make the faulting address accessible and return to retry the
+   * access. Code which can touch a guard must be built with
+   * -fnon-call-exceptions. Only supported where HUSTLE_GUARD_PAGES is set;
+   * elsewhere the region is protected but touching it is fatal.
+   *
+   * \param addr page aligned start of the region
+   * \param size size of the region, a multiple of page_size()
+   */
+  static void add_guard(void* addr, size_t size, FaultHandler handler,
+                        void* context);
+
+  /// Stop handling faults on a region registered with add_guard()
+  static void remove_guard(void* addr);
 };
 
 class MemorySegment {
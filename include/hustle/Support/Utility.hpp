@@ -76,7 +76,7 @@ inline constexpr uintptr_t set_bits(uintptr_t value, uintptr_t existing = 0) {
   static_assert(low <= high, "Low param must be <= the high param");
 
   constexpr uintptr_t high_mask = ((uintptr_t)(-1)) >> ((bits - 1) - high);
-  constexpr uintptr_t low_mask = ((1 << low) - 1);
+  constexpr uintptr_t low_mask = ((static_cast<uintptr_t>(1) << low) - 1);
   constexpr uintptr_t mask = high_mask & ~low_mask;
 
   return (existing & ~mask) | ((value << low) & mask);
@@ -12,12 +12,17 @@
 #include "hustle/Parser/Lexer.hpp"
 #include "hustle/Stack.hpp"
 #include "hustle/Support/Error.hpp"
+#include "hustle/VM/Bytecode.hpp"
+#include "hustle/VM/IR.hpp"
+#include "hustle/VM/Optimizer.hpp"
 #include "hustle/cell.hpp"
 
+#include <deque>
 #include <map>
 #include <memory>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 namespace hustle {
 
@@ -27,11 +32,78 @@ struct Word;
 
 class Lexer;
 
+/**
+ * Interface for generating native code for quotations.
+ *
+ * The VM hands quotations which have been called frequently to the installed
+ * compiler. \sa VM::set_jit()
+ */
+class NativeCompiler {
+public:
+  virtual ~NativeCompiler() = default;
+
+  /**
+   * Generate native code for a quotation.
+   *
+   * The returned function is installed as the quotation's entry point, and is
+   * called with the quotation's frame on top of the call stack. It pops the
+   * frame when it finishes. To call anything which needs a frame of its own
+   * it instead marks its frame StackFrame::native, calls VM::call_word() and
+   * returns, and is called again with ip set once the frame is back on top.
+   *
+   * \returns the entry point, or null if the quotation can not be compiled.
+   * The quotation is then not passed to the compiler again.
+   */
+  virtual Quotation::FuncType compile(VM& vm, Quotation* quote) = 0;
+
+  /// Mark any heap objects the compiler holds on to
+  virtual void mark_roots(Heap::MarkFunction fn) {}
+};
+
+/// Ways of running a quotation, slowest first
+enum Tier : uint8_t {
+  /// Walked straight from its definition
+  TIER_INTERPRETED,
+  /// Lowered to an instruction stream. \sa compile_quotation()
+  TIER_BYTECODE,
+  /// Compiled to native code by the installed NativeCompiler
+  TIER_NATIVE,
+};
+
+/// Record of a quotation moving up to a faster tier
+struct TierEvent {
+  /// The word which was called, or the quotation if it had no name
+  Cell callable;
+  Tier tier;
+};
+
+/// Settings fixed when a VM is created
+struct VMOptions {
+  /// Maximum depth of the data stack, in cells
+  size_t stack_size = 1 << 20;
+
+  /// Maximum depth of the call stack, in frames
+  size_t call_depth = 1 << 18;
+
+  /// Most locals live at once, across all active "::" words
+  size_t locals_size = 1 << 18;
+
+  /// Bytes usable by the old generation at first
+  size_t heap_initial = Heap::DEFAULT_INITIAL_SIZE;
+
+  /// Bytes the old generation can grow to
+  size_t heap_max = Heap::DEFAULT_MAX_SIZE;
+
+  /// Threads copying objects in a major collection
+  unsigned gc_threads = 1;
+};
+
 struct VM {
   using CallType = void (*)(VM*, Quotation*);
+  /// Cells usable on the data stack before it first grows
   static constexpr size_t STACK_SIZE = 4096;
   // public:
-  VM();
+  VM(const VMOptions& options = VMOptions());
   ~VM();
   VM(const VM&) = delete;
   VM& operator=(const VM&) = delete;
@@ -46,7 +118,8 @@ struct VM {
 
   void evaluate(Cell c) HUSTLE_MAY_ALLOCATE;
 
-  void interpreter_loop();
+  /// Run the interpreter until the current entry frame is popped
+  void interpreter_loop() { (this->*interpreter_)(); }
   void step_hook();
 
   void push(Cell cell) { stack_.push(cell); }
@@ -63,12 +136,35 @@ struct VM {
     push(Cell(o));
   }
 
+  /// Allocate a word for a primitive, without binding its name
+  Word* make_primitive(const char* name, CallType handler,
+                       bool is_parse = false) HUSTLE_MAY_ALLOCATE;
   Word* register_primitive(const char* name, CallType handler,
                            bool is_parse = false) HUSTLE_MAY_ALLOCATE;
+  /**
+   * Define the word str as quote, making it a parse word if parseword is set.
+   *
+   * If a word named str already exists, it is redefined in place rather than
+   * replaced: its definition and is_parse_word are overwritten and its version
+   * is bumped. Code which was parsed before then holds the same Word, so it
+   * calls the new definition from then on. Specialised call sites notice
+   * through the version, code which resolved the old definition's entry
+   * point is invalidated, and the optimizer rebuilds definitions which had
+   * inlined the old one.
+   */
   void register_symbol(String* str, Quotation* quote,
                        bool parseword = false) HUSTLE_MAY_ALLOCATE;
+  /// Bind string to word, replacing whatever it named before
   void register_symbol(String* string, Word* word);
 
+  /**
+   * Discard all compiled code.
+   *
+   * Must be called whenever something the compiled code may depend on (such
+   * as the definition of a primitive Word) changes. Code is rebuilt lazily.
+   */
+  void invalidate_code() { ++code_epoch_; }
+
   cell_t lookup_symbol(const std::string& name);
   // private:
   // TODO do these really need to be functions?
@@ -81,11 +177,68 @@ struct VM {
   Stack stack_;
   CallStack call_stack_;
 
+  /**
+   * Inputs of the "::" words being run, those of the innermost on top.
+   *
+   * Each frame running one of these words points at its own inputs here (see
+   * StackFrame::locals), so quotations using them can be called from inside
+   * other "::" words.
+   */
+  Stack locals_;
+
+  /**
+   * Get the locals used by the quote running in the frame on top.
+   *
+   * These are the inputs of the "::" word running there or, for a quotation
+   * literal in the body of one, those of the nearest frame running that word.
+   * \sa Quotation::scope
+   */
+  Cell* current_locals() {
+    StackFrame& frame = call_stack_.top();
+    Quotation* scope = frame.quote->scope;
+    return scope == nullptr ? frame.locals : scope_locals(scope);
+  }
+
   std::map<std::string, cell_t> symbol_table_;
 
   Lexer lexer_;
   Heap heap_;
 
+  /// Names of the locals in scope while a "::" body is parsed, first input
+  /// first
+  std::vector<std::string> parse_locals_;
+
+  /// Incremented every time compiled code is invalidated
+  intptr_t code_epoch_ = 1;
+
+  /// Fused primitives used when lowering quotations, longest pattern first
+  std::vector<SuperInstruction> superinstructions_;
+
+  /// Primitives which are lowered to control flow instructions
+  SuperInstruction::Element control_words_[CONTROL_MAX];
+
+  /// Primitives which work on locals, lowered to OP_LOCAL_GET and friends
+  SuperInstruction::Element local_words_[LOCAL_MAX];
+
+  /// Primitives run by the interpreter inside checked runs, with their opcode
+  std::vector<std::pair<Opcode, SuperInstruction::Element>> inline_words_;
+
+  /// Primitives which the IR treats as stack shuffles
+  std::vector<ShuffleWord> shuffle_words_;
+
+  /// Instruction stream for loops run by OP_WHILE. \sa make_loop_code()
+  TypedCell<Array> loop_code_;
+
+  /// Instruction stream for frames left by the dip primitive. \sa
+  /// make_restore_code()
+  TypedCell<Array> restore_code_;
+
+  /// Statistics on common sequences, only collected when set
+  std::unique_ptr<SequenceStats> sequence_stats_;
+
+  /// Passes run over definitions given to def
+  Optimizer optimizer_;
+
   void mark_roots(Heap::MarkFunction fn);
 
   template <typename T, typename... Args>
@@ -109,13 +262,69 @@ struct VM {
 
   typedef void (*DebugListener)();
 
-  DebugListener set_debug_listener(DebugListener new_listener) {
-    auto old_listener = debug_listener_;
-    debug_listener_ = new_listener;
-    return old_listener;
-  }
+  /**
+   * Set the function called when the interpreter hits a breakpoint.
+   *
+   * Single stepping is only supported while a listener is installed. Without
+   * one, the interpreter runs a variant of the loop which has no per
+   * instruction debugging hooks.
+   */
+  DebugListener set_debug_listener(DebugListener new_listener);
   void interpreter_break();
 
+  /**
+   * Install a compiler for hot quotations.
+   *
+   * Once a quotation has been entered jit_threshold times it is passed to the
+   * compiler. Passing null disables native compilation.
+   */
+  void set_jit(std::unique_ptr<NativeCompiler> compiler) {
+    jit_ = std::move(compiler);
+  }
+
+  /**
+   * Number of native entry points currently running.
+   *
+   * Native code is only left for the interpreter loop by returning, so this
+   * is only above one while a primitive called from native code runs a
+   * nested loop. Code can only be thrown away while it is zero.
+   */
+  uint32_t native_depth_ = 0;
+
+  /**
+   * Call word from the frame on top, as the interpreter does when walking a
+   * definition.
+   *
+   * Compound words get a frame of their own, pushed or, for a tail call,
+   * replacing the caller's, and run once control is back in the interpreter
+   * loop. Primitives run straight away.
+   *
+   * \returns true if the frame on top is no longer the caller's
+   */
+  bool call_word(Word* word, bool tail) HUSTLE_MAY_ALLOCATE;
+
+  /**
+   * Invocation on which a quotation is first lowered to bytecode.
+   *
+   * Until then it is interpreted straight from its definition, so code which
+   * only runs once (parse word bodies, REPL input) is never lowered.
+   */
+  uint32_t bytecode_threshold = 2;
+
+  /**
+   * Number of invocations before a quotation is compiled to native code.
+   *
+   * Backward jumps taken inside the quotation count as invocations, so loops
+   * are compiled sooner.
+   */
+  uint32_t jit_threshold = 1000;
+
+  /// Most recent tier changes, oldest first. Printed by tier-events.
+  std::deque<TierEvent> tier_events_;
+
+  /// Most tier changes remembered in tier_events_
+  static constexpr size_t MAX_TIER_EVENTS = 256;
+
   template <typename T>
   Handle<T> make_handle(T* ptr) {
     return handle_manager_.make_handle(ptr);
@@ -130,7 +339,39 @@ struct VM {
   static VM* get_current_vm();
 
 private:
+  /// Get the instruction stream for a quote, compiling it if needed
+  Array* quotation_code(Quotation* quote) HUSTLE_MAY_ALLOCATE;
+
+  /**
+   * Get the instruction stream for a quote if it can be entered without going
+   * through the top of the interpreter loop.
+   *
+   * Returns null if the quote needs to be compiled or has a native entry
+   * point.
+   */
+  Array* direct_code(Quotation* quote);
+
+  /**
+   * Count an entry into quote, compiling it to native code once it is hot.
+   *
+   * Returns true if quote now has a native entry point.
+   */
+  bool tier_up(Word* word, Quotation* quote) HUSTLE_MAY_ALLOCATE;
+
+  /// Note that the quote called through word has moved to tier
+  void record_tier(Word* word, Quotation* quote, Tier tier);
+
+  /// Find the locals of the nearest frame running scope, or throw
+  Cell* scope_locals(Quotation* scope);
+
+  template <bool Debuggable>
+  void run_interpreter();
+
+  using InterpreterFn = void (VM::*)();
+  InterpreterFn interpreter_ = &VM::run_interpreter<false>;
+
   DebugListener debug_listener_ = nullptr;
+  std::unique_ptr<NativeCompiler> jit_;
   HandleManager handle_manager_;
 };
 
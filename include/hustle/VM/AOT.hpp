@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * \file
+ * Support for words compiled ahead of time by hustle-aot.
+ *
+ * hustle-aot translates word definitions from .hsl files to C++ functions at
+ * build time (see add_hustle_aot() in CMakeLists.txt). The generated
+ * translation unit holds a table of AOTWord, in the same way primitives.def
+ * lists the primitives, and a function which hands it to register_aot_words().
+ *
+ * Compiled words only call leaf primitives and each other, and are installed
+ * as leaf primitives themselves. Primitives are looked up by name when the
+ * module is registered, since their functions are private to the VM.
+ */
+
+#ifndef HUSTLE_VM_AOT_HPP
+#define HUSTLE_VM_AOT_HPP
+
+#include "hustle/Core.hpp"
+#include "hustle/Object.hpp"
+
+#include <cstddef>
+
+namespace hustle {
+
+struct VM;
+
+/// A word compiled ahead of time
+struct AOTWord {
+  const char* name;
+  void (*function)(VM*, Quotation*);
+  /// Effect inferred for the original definition, may be unknown
+  StackEffect effect;
+};
+
+/// The tables generated by hustle-aot for one set of .hsl files
+struct AOTModule {
+  const AOTWord* words;
+  size_t word_count;
+
+  /// Names of the primitives called by the words
+  const char* const* primitive_names;
+
+  /// Filled with the entry points of primitive_names when registered
+  void (**primitives)(VM*, Quotation*);
+  size_t primitive_count;
+};
+
+/**
+ * Resolve the primitives used by module, and define its words.
+ *
+ * Words which already exist are redefined in place, so code which has
+ * already been parsed calls the compiled version.
+ *
+ * \throws Exception if a primitive is missing, or is not a leaf primitive
+ */
+void register_aot_words(VM& vm, const AOTModule& module) HUSTLE_MAY_ALLOCATE;
+
+} // namespace hustle
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * \file
+ * Pre-decoded instruction stream used by the interpreter.
+ *
+ * Rather than walking a Quotation's definition and switching on the tag of
+ * every cell, the interpreter lowers each definition into a compact stream of
+ * instructions the first time it is executed. The stream lives in an Array on
+ * the heap, so operands are traced and moved by the GC like any other cell.
+ *
+ * Each instruction is an opcode cell (stored as a fixnum) followed by its
+ * operands:
+ *
+ *  - OP_PUSH value: push value on the stack. Wrappers are unwrapped when the
+ *    definition is lowered, so this also covers wrapped literals.
+ *  - OP_CALL word _ _: call the current definition of word. The first time
+ *    this runs it is rewritten in place to OP_CALL_QUOTE.
+ *  - OP_CALL_QUOTE word quote version: call quote, which was the definition of
+ *    word when word's version was version. If the word has been redefined
+ *    since, this reverts to OP_CALL.
+ *  - OP_CALL_PRIMITIVE fn word: call the primitive fn directly.
+ *  - OP_CALL_LEAF fn word: call the leaf primitive fn without pushing a frame
+ *    for it. There is no tail form, since the caller's frame is still needed
+ *    to run the OP_RETURN which follows. \sa Quotation::is_leaf
+ *  - OP_CALL_ANON quote: call a quotation literal.
+ *  - OP_CALL_DYNAMIC: pop a word or quotation and call it. This is "call".
+ *  - OP_TAIL_CALL, OP_TAIL_CALL_QUOTE, OP_TAIL_CALL_PRIMITIVE,
+ *    OP_TAIL_CALL_ANON, OP_TAIL_CALL_DYNAMIC: same as the above, but used for
+ *    a call in the final position of a quotation. The callee reuses the
+ *    caller's frame, so recursion in tail position runs in constant call stack
+ *    space.
+ *  - OP_RETURN: return from the quotation.
+ *
+ * Control flow runs in the interpreter loop, rather than recursing through
+ * VM::call():
+ *
+ *  - OP_JUMP target: continue at offset target of the instruction stream.
+ *  - OP_BRANCH_FALSE target: pop a value, and jump to target if it is False.
+ *  - OP_DIP: pop a callable and a value. The value is kept in the frame's
+ *    retain slot while the callable runs.
+ *  - OP_RESTORE: push the value from the retain slot. Follows OP_DIP, and
+ *    starts VM::restore_code_, which the dip primitive leaves in its own frame
+ *    to finish the dip once the callable returns.
+ *  - OP_WHILE: pop a body and a condition, and push a frame which runs
+ *    VM::loop_code_ (OP_LOOP_COND, OP_LOOP_BODY) until the condition returns
+ *    False. The frame's quote is the condition, and its retain slot the body.
+ *
+ * When the quotations are literals, "{ a } { b } ? call" and
+ * "{ cond } { body } while" are lowered to branches and jumps in the caller's
+ * own instruction stream, so no loop frame is needed.
+ *
+ * Runs of literals, primitives and control flow on literal quotations usually
+ * have a stack effect which can be worked out when they are lowered (see
+ * infer_effect()). Each such run is checked once on entry, and then uses
+ * instructions which don't check the stack again:
+ *
+ *  - OP_CHECK_STACK in growth: throw unless the stack holds at least in cells,
+ *    and has room for growth more.
+ *  - OP_PUSH_UNCHECKED value: OP_PUSH without the overflow check.
+ *  - OP_DUP, OP_DROP, OP_SWAP, OP_OVER, OP_ADD, OP_SUB, OP_LT, OP_GT: the
+ *    primitive of the same name, run by the interpreter without any checks.
+ *    \sa add_inline_word()
+ *
+ * A run which would underflow or overflow therefore fails before any of it
+ * runs, rather than part way through.
+ *
+ * Straight line runs of literals, shuffles and leaf primitives are lowered
+ * through the IR (see IR.hpp) when that gives fewer instructions. The code
+ * produced from the IR also uses:
+ *
+ *  - OP_PICK depth: push a copy of the cell depth below the top.
+ *  - OP_SHUFFLE in out map: replace the top in cells with out cells, each a
+ *    copy of one of them. Bits 4*i and up of map hold the index of the cell
+ *    copied into position i, counting from the deepest in both cases.
+ *  - OP_ADD_FIXNUM, OP_SUB_FIXNUM, OP_LT_FIXNUM, OP_GT_FIXNUM: OP_ADD, OP_SUB,
+ *    OP_LT and OP_GT on operands already known to be fixnums, so the tags are
+ *    neither checked nor removed.
+ *
+ * Words defined with "::" keep their inputs on VM::locals_ rather than the data
+ * stack (see LocalWord). Accesses are lowered, along with the literal before
+ * them, to:
+ *
+ *  - OP_ENTER_LOCALS count: move the top count cells of the stack onto the
+ *    locals stack, keeping their order, and point the frame at them.
+ *  - OP_LEAVE_LOCALS count: drop count cells from the locals stack.
+ *  - OP_LOCAL_GET index: push local index of VM::current_locals(), which
+ *    are those of the frame unless the quote is a literal in a "::" body.
+ *  - OP_LOCAL_SET index: pop a value into that local.
+ *
+ * These always have a known effect, so they only appear in checked runs, and
+ * don't check the data stack themselves.
+ *
+ * Calls to primitives (and to quotations with a native entry point) are
+ * resolved when a definition is lowered, so replacing one of those requires
+ * VM::invalidate_code(). Other words are checked against Word::version, so
+ * they can be redefined without discarding any code.
+ *
+ * While lowering, common sequences of primitives are replaced by a single call
+ * to a fused primitive (a superinstruction). The table of superinstructions is
+ * generated from primitives.yml.
+ */
+
+#ifndef HUSTLE_VM_BYTECODE_HPP
+#define HUSTLE_VM_BYTECODE_HPP
+
+#include "hustle/Core.hpp"
+#include "hustle/Object.hpp"
+#include "hustle/cell.hpp"
+
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace hustle {
+
+struct VM;
+
+enum Opcode : uint8_t {
+  OP_PUSH,
+  OP_CALL,
+  OP_CALL_QUOTE,
+  OP_CALL_PRIMITIVE,
+  OP_CALL_LEAF,
+  OP_TAIL_CALL,
+  OP_TAIL_CALL_QUOTE,
+  OP_TAIL_CALL_PRIMITIVE,
+  OP_RETURN,
+  OP_CALL_ANON,
+  OP_TAIL_CALL_ANON,
+  OP_CALL_DYNAMIC,
+  OP_TAIL_CALL_DYNAMIC,
+  OP_JUMP,
+  OP_BRANCH_FALSE,
+  OP_DIP,
+  OP_RESTORE,
+  OP_WHILE,
+  OP_LOOP_COND,
+  OP_LOOP_BODY,
+  OP_CHECK_STACK,
+  OP_PUSH_UNCHECKED,
+  OP_DUP,
+  OP_DROP,
+  OP_SWAP,
+  OP_OVER,
+  OP_ADD,
+  OP_SUB,
+  OP_LT,
+  OP_GT,
+  OP_PICK,
+  OP_SHUFFLE,
+  OP_ADD_FIXNUM,
+  OP_SUB_FIXNUM,
+  OP_LT_FIXNUM,
+  OP_GT_FIXNUM,
+  OP_ENTER_LOCALS,
+  OP_LEAVE_LOCALS,
+  OP_LOCAL_GET,
+  OP_LOCAL_SET,
+  OP_MAX
+};
+
+/// Number of cells (including the opcode) used by each instruction
+constexpr uint8_t OPCODE_SIZE[OP_MAX] = {2, 4, 4, 3, 3, 4, 4, 3, 1, 2, 2, 1,
+                                         1, 2, 2, 1, 1, 1, 1, 1, 3, 2, 1, 1,
+                                         1, 1, 1, 1, 1, 1, 2, 4, 1, 1, 1, 1,
+                                         2, 2, 2, 2};
+
+/// Most cells taken or left by an OP_SHUFFLE
+constexpr size_t MAX_SHUFFLE = 15;
+
+/// Bits used for each index in the map of an OP_SHUFFLE
+constexpr unsigned SHUFFLE_INDEX_BITS = 4;
+
+static_assert(OPCODE_SIZE[OP_CALL] == OPCODE_SIZE[OP_CALL_QUOTE] &&
+                  OPCODE_SIZE[OP_TAIL_CALL] == OPCODE_SIZE[OP_TAIL_CALL_QUOTE],
+              "Call sites are specialised in place");
+
+inline constexpr Cell encode_opcode(Opcode op) { return Cell::from_int(op); }
+
+inline Opcode decode_opcode(Cell c) {
+  HSTL_ASSERT(c.is_a<intptr_t>());
+  return (Opcode)(c.raw() >> CELL_TAG_BITS);
+}
+
+/**
+ * Store a native function pointer in a Cell.
+ *
+ * The pointer is stored as a fixnum so the GC will leave it alone.
+ */
+inline Cell encode_native(Quotation::FuncType fn) {
+  Cell c = Cell::from_int((intptr_t)fn);
+  HSTL_ASSERT(c.cast<intptr_t>() == (intptr_t)fn);
+  return c;
+}
+
+inline Quotation::FuncType decode_native(Cell c) {
+  return (Quotation::FuncType)(c.raw() >> CELL_TAG_BITS);
+}
+
+/**
+ * A sequence of cells which is replaced by a single fused primitive when a
+ * quotation is lowered.
+ */
+struct SuperInstruction {
+  struct Element {
+    enum Kind {
+      /// Matches a word, as long as it is still bound to its primitive
+      WORD,
+      /// Matches a specific fixnum
+      LITERAL,
+      /// Matches any literal, which is pushed before the fused primitive
+      ANY
+    };
+    Kind kind;
+    Cell value;
+    Quotation::FuncType entry = nullptr;
+  };
+
+  std::vector<Element> pattern;
+
+  /**
+   * Word for the fused primitive. Its name is the pattern, but it isn't in the
+   * symbol table.
+   */
+  TypedCell<Word> word;
+};
+
+/**
+ * Register a superinstruction.
+ *
+ * \param pattern space separated list of primitive names, integers and "_"
+ * wildcards
+ * \param fn fused primitive which replaces the pattern
+ */
+void add_superinstruction(VM& vm, const char* pattern,
+                          Quotation::FuncType fn) HUSTLE_MAY_ALLOCATE;
+
+/// Words which are lowered to control flow instructions
+enum ControlWord {
+  CONTROL_CALL,
+  CONTROL_TERNARY,
+  CONTROL_WHILE,
+  CONTROL_DIP,
+  CONTROL_MAX
+};
+
+/**
+ * Record the primitive word for a control flow operation.
+ *
+ * Lowering only treats the word specially while it is still bound to the
+ * primitive it had when this was called.
+ */
+void add_control_word(VM& vm, ControlWord kind, const char* name);
+
+/**
+ * Words which work on the locals of words defined with "::".
+ *
+ * Each is preceded by a fixnum literal: the number of locals for LOCAL_ENTER
+ * and LOCAL_LEAVE, and the index of the local for LOCAL_GET and LOCAL_SET,
+ * the last input being 0.
+ */
+enum LocalWord { LOCAL_GET, LOCAL_SET, LOCAL_ENTER, LOCAL_LEAVE, LOCAL_MAX };
+
+/// Record the primitive word for a locals operation
+void add_local_word(VM& vm, LocalWord kind, const char* name);
+
+/**
+ * Match a fixnum literal followed by a locals word, starting at it.
+ *
+ * \returns the operation, or LOCAL_MAX if the cells are anything else
+ */
+LocalWord match_local_word(VM& vm, const Cell* it, const Cell* end);
+
+/// Build the instruction stream run by frames pushed by OP_WHILE
+Array* make_loop_code(VM& vm) HUSTLE_MAY_ALLOCATE;
+
+/// Build the instruction stream which finishes a dip run by the primitive
+Array* make_restore_code(VM& vm) HUSTLE_MAY_ALLOCATE;
+
+/**
+ * Record a primitive which the interpreter runs itself inside a checked run.
+ *
+ * \param op instruction which replaces calls to the word
+ * \param name word, which must have a stack effect
+ */
+void add_inline_word(VM& vm, Opcode op, const char* name);
+
+/// Find the longest superinstruction matching the cells starting at begin
+const SuperInstruction* match_superinstruction(VM& vm, const Cell* begin,
+                                               const Cell* end);
+
+/// Get the instruction which replaces a call to cell, or OP_MAX if none does
+Opcode inline_opcode(VM& vm, Cell cell);
+
+/**
+ * Work out the stack effect of a quotation from its definition.
+ *
+ * Literals and primitives with a declared effect are followed through
+ * "{ a } call", "{ a } { b } ? call" (both branches must have the same effect)
+ * and "{ cond } { body } while" (the body must leave the stack as it found
+ * it). Anything else, including calls to words which can be redefined, makes
+ * the effect unknown.
+ */
+StackEffect infer_effect(VM& vm, Quotation* quote);
+
+/**
+ * Counts of the pairs and triples of cells seen when lowering quotations.
+ *
+ * Words are recorded by name, fixnums by value, and any other literal as "_",
+ * so entries can be copied straight into the superinstruction table in
+ * primitives.yml. Only quotations which actually run get lowered, so this
+ * reflects the code used by a workload rather than everything it loads.
+ */
+class SequenceStats {
+public:
+  void record(Array* definition);
+
+  /// Print the most common pairs and triples
+  void dump(std::ostream& os, size_t max_entries = 20) const;
+
+  const std::unordered_map<std::string, uint64_t>& pairs() const {
+    return counts_[0];
+  }
+  const std::unordered_map<std::string, uint64_t>& triples() const {
+    return counts_[1];
+  }
+
+private:
+  std::unordered_map<std::string, uint64_t> counts_[2];
+};
+
+/**
+ * Lower the definition of a quote into an instruction stream.
+ *
+ * The result is cached in Quotation::code.
+ */
+Array* compile_quotation(VM& vm, Quotation* quote) HUSTLE_MAY_ALLOCATE;
+
+} // namespace hustle
+#endif
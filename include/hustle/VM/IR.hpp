@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * \file
+ * Register based intermediate representation for straight line code.
+ *
+ * Stack code is hard to optimize directly, since every value is addressed by
+ * its position, and shuffles move values around without computing anything.
+ * When a quotation is lowered (see Bytecode.hpp), each run of literals, stack
+ * shuffles and leaf primitives with a known stack effect is translated into
+ * SSA form: every value is defined once, by a single instruction, and
+ * instructions name the values they use. Shuffles disappear in the process,
+ * since they only change which values later instructions refer to.
+ *
+ * The IR is then optimized:
+ *
+ *  - value numbering merges instructions computing the same pure result.
+ *  - dead code elimination removes pure instructions whose results are never
+ *    used.
+ *  - tag check elimination lets arithmetic skip the fixnum checks on operands
+ *    which are known to be fixnums, because they are fixnum literals, results
+ *    of arithmetic, or have already been checked.
+ *
+ * Finally it is scheduled back into interpreter instructions, copying values
+ * into place with OP_PICK and leaving the results in order with a single
+ * OP_SHUFFLE, instead of replaying the original shuffles.
+ *
+ * Instructions only refer to values defined before them, and the IR never
+ * outlives the lowering of one run, so the cells it holds are never moved by
+ * the GC.
+ */
+
+#ifndef HUSTLE_VM_IR_HPP
+#define HUSTLE_VM_IR_HPP
+
+#include "hustle/Object.hpp"
+#include "hustle/VM/Bytecode.hpp"
+#include "hustle/cell.hpp"
+
+#include <array>
+#include <initializer_list>
+#include <iosfwd>
+#include <vector>
+
+namespace hustle {
+
+struct VM;
+
+enum IROp : uint8_t {
+  /// A cell which was on the stack on entry. Never removed.
+  IR_INPUT,
+  /// A literal
+  IR_CONST,
+  IR_ADD,
+  IR_SUB,
+  IR_LT,
+  IR_GT,
+  /// Call a leaf primitive with a known stack effect
+  IR_CALL,
+  /// Read a local. Pure, since only IR_LOCAL_SET changes it.
+  IR_LOCAL_GET,
+  /// Write a local
+  IR_LOCAL_SET,
+};
+
+/// Values are numbered from 0 in the order they are defined
+using IRValue = uint32_t;
+
+struct IRInstruction {
+  IROp op;
+
+  /// Values used, deepest first
+  std::vector<IRValue> operands;
+
+  /// Values defined, deepest first
+  std::vector<IRValue> results;
+
+  /**
+   * IR_CONST: the literal, unwrapped.
+   * IR_CALL: the word called.
+   * IR_INPUT: the depth of the cell on entry, 0 being the top.
+   * IR_LOCAL_GET, IR_LOCAL_SET: the index of the local. \sa LocalWord
+   */
+  Cell cell;
+
+  /// Set if the operands must be checked to be fixnums
+  bool checks_tags = false;
+
+  /// Set if the instruction can be merged with an identical one, or removed
+  bool is_pure = false;
+};
+
+/// A run of straight line code in SSA form
+struct IRFunction {
+  std::vector<IRInstruction> instructions;
+
+  /// Values left on the stack, deepest first
+  std::vector<IRValue> outputs;
+
+  /// Number of cells taken from the stack, which is the number of IR_INPUTs
+  uint32_t inputs = 0;
+
+  /// Number of values defined
+  uint32_t value_count = 0;
+};
+
+/// A primitive which only rearranges the top of the stack
+struct ShuffleWord {
+  SuperInstruction::Element word;
+
+  /// Number of cells taken
+  uint8_t in;
+
+  /// For each cell left, deepest first, the input it is a copy of
+  std::vector<uint8_t> out;
+};
+
+/**
+ * Record a primitive which the IR treats as a shuffle.
+ *
+ * \param out for each cell left by the word, deepest first, the index of the
+ * input it copies, where 0 is the deepest input. The number of inputs is
+ * taken from the word's stack effect.
+ */
+void add_shuffle_word(VM& vm, const char* name,
+                      std::initializer_list<uint8_t> out);
+
+/**
+ * Translate the longest run of cells starting at begin which the IR can
+ * express.
+ *
+ * \returns the end of the translated run
+ */
+const Cell* build_ir(VM& vm, const Cell* begin, const Cell* end,
+                     IRFunction& ir);
+
+/**
+ * Merge instructions which compute the same pure result.
+ *
+ * Reads of a local are only merged while it hasn't been written in between.
+ */
+bool number_values(IRFunction& ir);
+
+/// Remove pure instructions whose results are never used
+bool eliminate_dead_code(IRFunction& ir);
+
+/// Drop fixnum checks on operands which are known to be fixnums
+bool eliminate_tag_checks(IRFunction& ir);
+
+/// Run all of the above until nothing changes
+void optimize_ir(IRFunction& ir);
+
+/// An interpreter instruction produced from the IR
+struct IRLowered {
+  Opcode op;
+  std::array<Cell, 3> operands;
+};
+
+/**
+ * Schedule the IR as interpreter instructions.
+ *
+ * The instructions expect the stack to have been checked for effect, which is
+ * filled in. They don't include the OP_CHECK_STACK.
+ *
+ * \returns false if the IR can't be lowered, in which case the run should be
+ * lowered from its definition instead
+ */
+bool lower_ir(VM& vm, const IRFunction& ir, std::vector<IRLowered>& code,
+              StackEffect& effect);
+
+/// Print the IR, one instruction per line
+void dump_ir(std::ostream& os, const IRFunction& ir);
+
+} // namespace hustle
+#endif
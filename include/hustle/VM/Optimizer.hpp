@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * \file
+ * Rewrites applied to definitions when a word is defined.
+ *
+ * Unlike lowering (see Bytecode.hpp), which runs every time code is rebuilt,
+ * these work on the definition array itself, so the result is what later
+ * lowering, effect inference and the JIT see. Passes only rewrite calls to
+ * words which are still bound to the primitive they expect. A definition is
+ * optimized against the primitives in place when it is defined. The original
+ * is kept as Quotation::source.
+ *
+ * Passes record which words each result relies on (see Optimizer::depend_on).
+ * When one of those words is redefined, the definitions which relied on it
+ * are optimized again from their source, so inlining and folding never hide
+ * a redefinition made at the REPL.
+ */
+
+#ifndef HUSTLE_VM_OPTIMIZER_HPP
+#define HUSTLE_VM_OPTIMIZER_HPP
+
+#include "hustle/Core.hpp"
+#include "hustle/GC.hpp"
+#include "hustle/Object.hpp"
+#include "hustle/cell.hpp"
+
+#include <iosfwd>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace hustle {
+
+struct VM;
+
+/// A rewrite of the cells of a definition
+class OptimizerPass {
+public:
+  virtual ~OptimizerPass() = default;
+
+  /// Name shown in optimizer dumps
+  virtual const char* name() const = 0;
+
+  /**
+   * Rewrite a definition in place.
+   *
+   * The cells are not visible to the GC, so passes must not allocate.
+   *
+   * \returns true if anything changed
+   */
+  virtual bool run(VM& vm, std::vector<Cell>& cells) = 0;
+};
+
+/**
+ * Pipeline of passes run over each definition given to def.
+ *
+ * The passes run in order, repeatedly, until none of them change anything.
+ * Quotation literals in the definition are optimized first.
+ */
+class Optimizer {
+public:
+  void add_pass(std::unique_ptr<OptimizerPass> pass) {
+    passes_.push_back(std::move(pass));
+  }
+
+  const std::vector<std::unique_ptr<OptimizerPass>>& passes() const {
+    return passes_;
+  }
+
+  /**
+   * Optimize the definition of quote, and those of its quotation literals.
+   *
+   * Quotes which have already been optimized are left alone.
+   *
+   * \param name used to label the dump
+   */
+  void optimize(VM& vm, Quotation* quote,
+                std::string_view name) HUSTLE_MAY_ALLOCATE;
+
+  /**
+   * Optimize again the definitions which relied on word.
+   *
+   * Called when word is redefined. Words defined by those definitions are
+   * treated as redefined in turn, however far that goes. All of them go back
+   * to their source before any is optimized again, so none is rebuilt from
+   * another's stale result.
+   */
+  void redefined(VM& vm, Word* word) HUSTLE_MAY_ALLOCATE;
+
+  /// Stop tracking what quote, and the quotations inside it, rely on
+  void forget(Quotation* quote);
+
+  /**
+   * Record that the definition currently being optimized relies on word.
+   *
+   * For use by passes which rewrite or remove calls to word.
+   */
+  void depend_on(Word* word);
+
+  /// Check if the definition of quote relies on word, directly or not
+  bool relies_on(Quotation* quote, Word* word) const;
+
+  /// The word being defined, if it already exists. Only set while passes run
+  Word* defining() const { return defining_; }
+
+  void mark_roots(Heap::MarkFunction fn);
+
+  /// Where definitions are printed before and after optimization, if set
+  std::ostream* dump = nullptr;
+
+  /// Most times the passes are repeated for one definition
+  static constexpr unsigned MAX_ROUNDS = 8;
+
+  /// Longest definition, in cells, which is inlined into its callers
+  static constexpr size_t INLINE_LIMIT = 8;
+
+private:
+  void optimize(VM& vm, Handle<Quotation>& quote,
+                std::string_view name) HUSTLE_MAY_ALLOCATE;
+  /// Stop tracking what quote relies on, leaving its quotation literals be
+  void forget_dependencies(Quotation* quote);
+
+  std::vector<std::unique_ptr<OptimizerPass>> passes_;
+  /**
+   * Definitions which were optimized using each word. The keys move with the
+   * objects, so both maps are rebuilt by mark_roots().
+   */
+  std::unordered_multimap<Word*, Quotation*> users_;
+  /// The words each definition was optimized using, the reverse of users_
+  std::unordered_multimap<Quotation*, Word*> uses_;
+  /// Definitions being rebuilt by redefined()
+  std::vector<Cell> rebuilding_;
+  TypedCell<Word> defining_;
+  Quotation* current_ = nullptr;
+};
+
+/**
+ * Install the standard passes.
+ *
+ * - inlining of short, non-recursive words which don't use locals
+ * - constant folding of primitives listed as pure in primitives.yml, when
+ *   all their inputs are fixnum literals
+ * - peephole simplification of stack shuffles (dup drop, swap swap, literal
+ *   followed by dup/swap/over, ...)
+ * - removal of literals which are immediately dropped
+ */
+void add_default_passes(VM& vm, Optimizer& optimizer);
+
+} // namespace hustle
+#endif
@@ -6,34 +6,341 @@
 
 #include "hustle/GC.hpp"
 #include "hustle/Object.hpp"
+#include "hustle/Support/Error.hpp"
 #include "hustle/VM.hpp"
 
+#include <algorithm>
 #include <assert.h>
-#include <stack>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <thread>
 
 using namespace hustle;
 
-hustle::HeapRegion::HeapRegion(Heap* heap) : heap_(heap) {
-  start_ = (uint8_t*)malloc(REGION_SIZE);
+namespace {
+constexpr size_t OBJECT_ALIGN = size_t(1) << CELL_TAG_BITS;
+
+/// Bytes a copying thread takes from the semi-space at a time
+constexpr size_t LAB_SIZE = 64 * 1024;
+/// Objects bigger than this are copied outside of the allocation buffers
+constexpr size_t LAB_OBJECT_SIZE = LAB_SIZE / 8;
+
+/**
+ * Bytes which copying threads may leave unused in their allocation buffers,
+ * when copying live bytes
+ */
+size_t parallel_slack(size_t live, unsigned threads) {
+  return threads > 1 ? live / 4 + threads * LAB_SIZE : 0;
+}
+
+/// Size an object takes in its region
+size_t aligned_size(size_t sz) {
+  return (sz + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1);
+}
+
+/**
+ * Call fn with each cell of o which may hold a reference, and whose address
+ * is in [lo, hi).
+ */
+template <typename F>
+void visit_slots(Object* o, const void* lo, const void* hi, F& fn) {
+  auto visit = [&](void* slot) {
+    if (slot >= lo && slot < hi) {
+      fn((cell_t*)slot);
+    }
+  };
+  cell_tag type = o->tag();
+  switch (type) {
+  case CELL_ARRAY: {
+    Array* array = (Array*)o;
+    Cell* end = std::min(array->end(), (Cell*)hi);
+    for (Cell* element = std::max(array->begin(), (Cell*)lo); element < end;
+         ++element) {
+      fn((cell_t*)element);
+    }
+  } break;
+  case CELL_STRING:
+    break;
+  case CELL_QUOTE: {
+    Quotation* quote = (Quotation*)(o);
+    if (quote->definition != nullptr) {
+      visit(&quote->definition);
+    }
+    if (quote->code != nullptr) {
+      visit(&quote->code);
+    }
+    if (quote->source != nullptr) {
+      visit(&quote->source);
+    }
+    if (quote->word != nullptr) {
+      visit(&quote->word);
+    }
+    if (quote->scope != nullptr) {
+      visit(&quote->scope);
+    }
+    break;
+  }
+  case CELL_WRAPPER: {
+    Wrapper* wrapper = (Wrapper*)(o);
+    visit(&wrapper->wrapped);
+  } break;
+
+  case CELL_WORD: {
+    Word* word = (Word*)o;
+    visit(&word->name);
+    visit(&word->definition);
+    visit(&word->properties);
+  } break;
+  default:
+    HSTL_ASSERT(false);
+  }
+}
+
+template <typename F>
+void visit_slots(Object* o, F& fn) {
+  visit_slots(o, o, (uint8_t*)o + o->size(), fn);
+}
+
+inline void prefetch(const void* addr) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(addr);
+#else
+  (void)addr;
+#endif
+}
+
+/**
+ * Visit the objects copied to a region from scan onwards, including those
+ * copied while doing so.
+ *
+ * The objects waiting to be visited are the ones between scan and the
+ * allocation pointer, so the region itself is the work queue.
+ *
+ * \returns the new scan position
+ */
+template <typename F>
+uint8_t* scan_copied(uint8_t* scan, uint8_t* const& allocate_ptr, F& fn) {
+  while (scan < allocate_ptr) {
+    Object* o = (Object*)scan;
+    scan += aligned_size(o->size());
+    prefetch(scan);
+    visit_slots(o, fn);
+  }
+  return scan;
+}
+
+/**
+ * Make [begin, end) look like an object without references, so the region
+ * can still be walked from one object to the next.
+ */
+void fill_gap(uint8_t* begin, uint8_t* end) {
+  if (begin < end) {
+    new (begin) Object(CELL_STRING, end - begin);
+  }
+}
+
+/**
+ * Objects waiting to be scanned by a copying thread.
+ *
+ * This is the Chase-Lev deque: the owner pushes and pops at the bottom, while
+ * other threads steal from the top. It has a fixed capacity, past which the
+ * owner keeps objects to itself until the deque drains.
+ */
+class WorkDeque {
+public:
+  static constexpr ptrdiff_t CAPACITY = 4096;
+
+  WorkDeque() : buffer_(new std::atomic<Object*>[CAPACITY]) {}
+
+  /// Only called by the owner
+  void push(Object* obj) {
+    ptrdiff_t bottom = bottom_.load(std::memory_order_relaxed);
+    ptrdiff_t top = top_.load(std::memory_order_acquire);
+    if (bottom - top >= CAPACITY) {
+      overflow_.push_back(obj);
+      return;
+    }
+    buffer_[bottom % CAPACITY].store(obj, std::memory_order_relaxed);
+    // Publishes the object's contents to thieves
+    bottom_.store(bottom + 1, std::memory_order_release);
+  }
+
+  /// Only called by the owner. \returns nullptr if there is no work left.
+  Object* pop() {
+    ptrdiff_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    ptrdiff_t top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return pop_overflow();
+    }
+    Object* obj = buffer_[bottom % CAPACITY].load(std::memory_order_relaxed);
+    if (top == bottom) {
+      // The last one, which a thief may be taking too
+      if (!top_.compare_exchange_strong(top, top + 1,
+                                        std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        obj = nullptr;
+      }
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return obj != nullptr ? obj : pop_overflow();
+  }
+
+  /// \returns nullptr if the deque was empty, or another thread won the race
+  Object* steal() {
+    ptrdiff_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    ptrdiff_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) {
+      return nullptr;
+    }
+    Object* obj = buffer_[top % CAPACITY].load(std::memory_order_relaxed);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return obj;
+  }
+
+  /// Check if there may be something to steal
+  bool maybe_stealable() const {
+    return bottom_.load(std::memory_order_relaxed) -
+               top_.load(std::memory_order_relaxed) >
+           0;
+  }
+
+private:
+  /// Take from the overflow, sharing some of it through the deque
+  Object* pop_overflow() {
+    if (overflow_.empty()) {
+      return nullptr;
+    }
+    Object* obj = overflow_.back();
+    overflow_.pop_back();
+    for (ptrdiff_t i = 0; i < CAPACITY / 2 && !overflow_.empty(); ++i) {
+      push(overflow_.back());
+      overflow_.pop_back();
+    }
+    return obj;
+  }
+
+  std::atomic<ptrdiff_t> top_{0};
+  std::atomic<ptrdiff_t> bottom_{0};
+  std::unique_ptr<std::atomic<Object*>[]> buffer_;
+  std::vector<Object*> overflow_;
+};
+
+/// The work of a thread copying objects in a major collection
+struct GCWorker {
+  WorkDeque work;
+  /// Local allocation buffer, in the semi-space being copied to
+  uint8_t* lab = nullptr;
+  uint8_t* lab_end = nullptr;
+};
+} // namespace
+
+/// Threads which help the one running a major collection
+class Heap::ThreadPool {
+public:
+  using Task = std::function<void(unsigned)>;
+
+  /// Start count threads, which wait for work until destroyed
+  explicit ThreadPool(unsigned count) {
+    threads_.reserve(count);
+    for (unsigned id = 1; id <= count; ++id) {
+      threads_.emplace_back([this, id] { work(id); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  /**
+   * Call task(id) on each thread of the pool, with ids from 1, and task(0) on
+   * this one. Returns once every call has.
+   */
+  void run(const Task& task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      running_ = threads_.size();
+      ++round_;
+    }
+    wake_.notify_all();
+    task(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [&] { return running_ == 0; });
+    task_ = nullptr;
+  }
+
+private:
+  void work(unsigned id) {
+    uint64_t seen = 0;
+    while (true) {
+      const Task* task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return stop_ || round_ != seen; });
+        if (stop_) {
+          return;
+        }
+        seen = round_;
+        task = task_;
+      }
+      (*task)(id);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--running_ == 0) {
+        done_.notify_one();
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable wake_, done_;
+  const Task* task_ = nullptr;
+  /// Bumped each time the pool is given a task
+  uint64_t round_ = 0;
+  /// Threads of the pool still running the current task
+  size_t running_ = 0;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
+
+static size_t round_to_pages(size_t size) {
+  const size_t page = Memory::page_size();
+  return (size + page - 1) / page * page;
+}
+
+hustle::HeapRegion::HeapRegion(Heap* heap, size_t size, size_t max_size)
+    : heap_(heap),
+      memory_(Memory::allocate(round_to_pages(std::max(size, max_size)), 0)) {
+  start_ = (uint8_t*)memory_.base();
   HSTL_ASSERT(start_ != nullptr);
-  end_ = start_ + REGION_SIZE;
+  end_ = start_;
   allocate_ptr_ = start_;
   HSTL_ASSERT((((uintptr_t)start_) & CELL_TAG_MASK) == 0);
-  reset();
-}
-
-HeapRegion::~HeapRegion() {
-  if (start_ != nullptr)
-    ::free(start_);
+  resize(size);
 }
 
 Object* HeapRegion::allocate(size_t sz) {
-  constexpr size_t object_align = 1 << CELL_TAG_BITS;
-  sz = ((sz + object_align - 1) / object_align) * object_align;
+  sz = aligned_size(sz);
 
-  HSTL_ASSERT((sz & (object_align - 1)) == 0);
+  HSTL_ASSERT((sz & (OBJECT_ALIGN - 1)) == 0);
 
   HSTL_ASSERT(sz < bytes_free());
   // assert((uintpt))
@@ -44,103 +351,544 @@ Object* HeapRegion::allocate(size_t sz) {
 }
 
 void HeapRegion::reset() {
+  // Only what was allocated can have been written to
+  memset(start_, 0, allocate_ptr_ - start_);
   allocate_ptr_ = start_;
-  memset(start_, 0, end_ - start_);
 }
 
-Heap::Heap(MarkRootsFunction mark_roots)
-    : mark_roots_(mark_roots), region_a_(this), region_b_(this),
-      current_heap_(&region_a_), backup_heap_(&region_b_) {}
+void HeapRegion::resize(size_t size) {
+  size = round_to_pages(size);
+  HSTL_ASSERT(size <= memory_.size());
+  HSTL_ASSERT(start_ + size >= allocate_ptr_);
+  uint8_t* new_end = start_ + size;
+  if (new_end > end_) {
+    // Fresh pages read as zero, as reset() leaves them
+    Memory::protect(end_, new_end - end_, Memory::MEM_READ | Memory::MEM_WRITE);
+  } else if (new_end < end_) {
+    Memory::decommit(new_end, end_ - new_end);
+  }
+  end_ = new_end;
+}
+
+/**
+ * Bytes of address space an old semi-space reserves: the maximum size, plus a
+ * full promotion, plus what copying threads may leave unused.
+ */
+static size_t old_reservation(size_t max_size, unsigned threads) {
+  size_t bytes = max_size + Heap::NURSERY_SIZE + Heap::SURVIVOR_SIZE;
+  return bytes + parallel_slack(bytes, threads);
+}
+
+Heap::Heap(MarkRootsFunction mark_roots, size_t initial_size, size_t max_size,
+           unsigned gc_threads)
+    : mark_roots_(mark_roots), nursery_(this, NURSERY_SIZE),
+      survivor_a_(this, SURVIVOR_SIZE), survivor_b_(this, SURVIVOR_SIZE),
+      survivor_(&survivor_a_), backup_survivor_(&survivor_b_),
+      region_a_(this, initial_size,
+                old_reservation(std::max(initial_size, max_size), gc_threads)),
+      region_b_(this, 0,
+                old_reservation(std::max(initial_size, max_size), gc_threads)),
+      current_heap_(&region_a_), backup_heap_(&region_b_),
+      initial_size_(round_to_pages(initial_size)),
+      max_size_(round_to_pages(std::max(initial_size, max_size))),
+      capacity_(initial_size_), gc_threads_(std::max(gc_threads, 1u)) {
+  resize_old();
+  if (gc_threads_ > 1) {
+    thread_pool_ = std::make_unique<ThreadPool>(gc_threads_ - 1);
+  }
+}
+
+Heap::~Heap() = default;
 
 Object* Heap::allocate(size_t sz) {
 
   // Force a gc for testing
   if (debug_alloc) {
+    if (debug_alloc_major) {
+      swap_heaps();
+    } else {
+      minor_gc();
+    }
+    check_exhausted();
+  }
+
+  if (sz >= LARGE_OBJECT_SIZE) {
+    return allocate_large(sz);
+  }
+
+  if (nursery_.bytes_free() <= sz) {
+    minor_gc();
+    check_exhausted();
+  }
+  HSTL_ASSERT(nursery_.bytes_free() > sz);
+  return nursery_.allocate(sz);
+}
+
+void Heap::gc() { swap_heaps(); }
+
+void Heap::minor_gc() {
+  // In the worst case, everything young is promoted
+  size_t young = nursery_.bytes_used() + survivor_->bytes_used();
+  if (current_heap_->bytes_free() <= young) {
     swap_heaps();
+  } else {
+    collect_young();
+  }
+}
+
+void Heap::check_exhausted() {
+  if (exhausted_) {
+    // Only report it once, the next major collection checks again
+    exhausted_ = false;
+    throw Exception("Heap exhausted");
   }
-  // TODO this is dumb
+}
 
-  if (current_heap_->bytes_free() < 1024 * 1024 ||
-      current_heap_->bytes_free() < sz) {
+Object* Heap::allocate_old(size_t sz) {
+  Object* obj = current_heap_->allocate(sz);
+  record_object(obj, aligned_size(sz));
+  return obj;
+}
+
+Heap::LargeObject::LargeObject(MemorySegment&& memory, size_t size)
+    : memory(std::move(memory)), size(size),
+      cards((size + CARD_SIZE - 1) >> CARD_BITS, CARD_CLEAN) {}
+
+Object* Heap::allocate_large(size_t sz) {
+  // Large objects only die in major collections. Collecting can't help an
+  // object which is too big on its own, so only do it once others have been
+  // allocated since the last one.
+  if (large_bytes_allocated_ != 0 && large_bytes_allocated_ + sz > capacity_) {
     swap_heaps();
+    check_exhausted();
+  }
+  if (large_bytes_ + sz + capacity_ > max_size_) {
+    throw Exception("Heap exhausted");
   }
-  HSTL_ASSERT(current_heap_->bytes_free() > sz);
-  return current_heap_->allocate(sz);
+  // Fresh pages read as zero, like the rest of the heap
+  MemorySegment memory = Memory::allocate(
+      round_to_pages(sz), Memory::MEM_READ | Memory::MEM_WRITE);
+  const void* base = memory.base();
+  large_objects_.emplace(std::piecewise_construct, std::forward_as_tuple(base),
+                         std::forward_as_tuple(std::move(memory), sz));
+  large_bytes_ += sz;
+  large_bytes_allocated_ += sz;
+  // The object is filled in without a write barrier
+  mark_large_cards(base, sz);
+  return (Object*)base;
 }
 
-void Heap::gc() { swap_heaps(); }
+void Heap::mark_large_cards(const void* begin, size_t size) noexcept {
+  if (large_objects_.empty()) {
+    return;
+  }
+  // The last object starting at or before begin
+  auto it = large_objects_.upper_bound(begin);
+  if (it == large_objects_.begin()) {
+    return;
+  }
+  --it;
+  LargeObject& large = it->second;
+  size_t offset = (const uint8_t*)begin - (const uint8_t*)it->first;
+  if (offset >= large.size) {
+    return;
+  }
+  size_t first = offset >> CARD_BITS;
+  size_t last = (offset + size - 1) >> CARD_BITS;
+  std::fill(&large.cards[first], &large.cards[last + 1], CARD_DIRTY);
+  if (!large.remembered) {
+    large.remembered = true;
+    large.next_remembered = remembered_;
+    remembered_ = &large;
+  }
+}
 
-void Heap::swap_heaps() {
+void Heap::sweep_large() {
+  large_bytes_ = 0;
+  large_bytes_allocated_ = 0;
+  remembered_ = nullptr;
+  for (auto it = large_objects_.begin(); it != large_objects_.end();) {
+    LargeObject& large = it->second;
+    if (!large.marked) {
+      it = large_objects_.erase(it);
+      continue;
+    }
+    large.marked = false;
+    large.remembered = false;
+    // Nothing is young after a major collection
+    std::fill(large.cards.begin(), large.cards.end(), CARD_CLEAN);
+    large_bytes_ += large.size;
+    ++it;
+  }
+}
+
+void Heap::mark_cards(const void* begin, size_t size) noexcept {
+  size_t offset = (const uint8_t*)begin - current_heap_->start_;
+  size_t first = offset >> CARD_BITS;
+  size_t last = (offset + size - 1) >> CARD_BITS;
+  std::fill(&cards_[first], &cards_[last + 1], CARD_DIRTY);
+}
+
+void Heap::record_object(const void* obj, size_t size) noexcept {
+  size_t offset = (const uint8_t*)obj - current_heap_->start_;
+  // Every card starting inside the object
+  size_t first = (offset + CARD_SIZE - 1) >> CARD_BITS;
+  size_t last = (offset + size - 1) >> CARD_BITS;
+  for (size_t card = first; card <= last; ++card) {
+    object_starts_[card] = gsl::narrow_cast<uint32_t>(offset);
+  }
+}
+
+void Heap::clear_cards() {
+  std::fill(cards_.begin(), cards_.end(), CARD_CLEAN);
+  std::fill(object_starts_.begin(), object_starts_.end(), NO_OBJECT);
+}
+
+size_t Heap::target_capacity(size_t live) const noexcept {
+  // Keep at most half of it in use, with room for everything young to be
+  // promoted
+  size_t target = std::max(live * 2, live + NURSERY_SIZE + SURVIVOR_SIZE);
+  return std::clamp(round_to_pages(target), initial_size_, max_size_);
+}
+
+void Heap::resize_old() {
+  current_heap_->resize(std::max(capacity_, current_heap_->bytes_used()));
+  const size_t cards = current_heap_->capacity() >> CARD_BITS;
+  cards_.resize(cards, CARD_CLEAN);
+  object_starts_.resize(cards, NO_OBJECT);
+}
+
+void Heap::collect_young() {
   HSTL_ASSERT(!running_gc_);
   running_gc_ = true;
-  std::stack<Object*> work_stack;
+  ++minor_collections;
+
+  HeapRegion* const from_survivor = survivor_;
+  HeapRegion* const to_survivor = backup_survivor_;
+  HeapRegion* const old = current_heap_;
+  // Objects promoted by this collection are scanned from here, not through
+  // the cards
+  uint8_t* const old_top = old->allocate_ptr_;
+
+  auto copy_object = [&](cell_t* handle) {
+    if (!is_a<Object>(*handle)) {
+      return;
+    }
+    Object* obj = get_cell_pointer(*handle);
+    if (!nursery_.contains(obj) && !from_survivor->contains(obj)) {
+      return;
+    }
+    Object* new_ptr;
+    if (obj->is_forwarding()) {
+      new_ptr = obj->get_forwarding();
+    } else {
+      auto sz = obj->size();
+      unsigned age = obj->age() + 1;
+      if (age < TENURE_AGE && to_survivor->bytes_free() > aligned_size(sz)) {
+        new_ptr = to_survivor->allocate(sz);
+        memcpy(new_ptr, obj, sz);
+        new_ptr->set_age(age);
+      } else {
+        new_ptr = allocate_old(sz);
+        memcpy(new_ptr, obj, sz);
+        bytes_promoted += aligned_size(sz);
+      }
+      obj->forward_to(new_ptr);
+    }
+    *handle = new_ptr->get_cell().raw();
+    // An old object still points into the young generation
+    if (to_survivor->contains(new_ptr) && !to_survivor->contains(handle)) {
+      write_barrier_slot(handle);
+    }
+  };
+
+  // fixup the roots
+  mark_roots_(copy_object);
+
+  // and the old objects which were written to
+  const size_t card_count =
+      (old_top - old->start_ + CARD_SIZE - 1) >> CARD_BITS;
+  for (size_t card = 0; card < card_count; ++card) {
+    if (cards_[card] == CARD_CLEAN) {
+      continue;
+    }
+    // Scanning marks the card again if it still needs to be
+    cards_[card] = CARD_CLEAN;
+    uint8_t* lo = old->start_ + (card << CARD_BITS);
+    uint8_t* hi = std::min(lo + CARD_SIZE, old_top);
+    HSTL_ASSERT(object_starts_[card] != NO_OBJECT);
+    for (uint8_t* it = old->start_ + object_starts_[card]; it < hi;
+         it += aligned_size(((Object*)it)->size())) {
+      visit_slots((Object*)it, lo, hi, copy_object);
+    }
+  }
+
+  // and the large objects which were written to
+  LargeObject* remembered = remembered_;
+  remembered_ = nullptr;
+  while (remembered != nullptr) {
+    LargeObject* large = remembered;
+    remembered = large->next_remembered;
+    large->remembered = false;
+    Object* obj = (Object*)large->memory.base();
+    for (size_t card = 0; card < large->cards.size(); ++card) {
+      if (large->cards[card] == CARD_CLEAN) {
+        continue;
+      }
+      large->cards[card] = CARD_CLEAN;
+      uint8_t* lo = (uint8_t*)obj + (card << CARD_BITS);
+      visit_slots(obj, lo, lo + CARD_SIZE, copy_object);
+    }
+  }
+
+  // Copied objects are queued in two places, and scanning either one can add
+  // to the other
+  uint8_t* survivor_scan = to_survivor->start_;
+  uint8_t* old_scan = old_top;
+  while (survivor_scan < to_survivor->allocate_ptr_ ||
+         old_scan < old->allocate_ptr_) {
+    survivor_scan =
+        scan_copied(survivor_scan, to_survivor->allocate_ptr_, copy_object);
+    old_scan = scan_copied(old_scan, old->allocate_ptr_, copy_object);
+  }
+
+  nursery_.reset();
+  from_survivor->reset();
+  survivor_ = to_survivor;
+  backup_survivor_ = from_survivor;
+
+  running_gc_ = false;
+}
+
+void Heap::copy_live() {
+  // Large objects reached but not scanned yet
+  LargeObject* marked = nullptr;
 
   auto copy_object = [&, current_heap = current_heap_,
                       backup_heap = backup_heap_](cell_t* handle) {
-    if (is_a<Object>(*handle)) {
-      Object* obj = get_cell_pointer(*handle);
-      if (current_heap->contains(obj)) {
-        if (obj->is_forwarding()) {
-          Object* forwarded = obj->get_forwarding();
-          *handle = forwarded->get_cell().raw();
-          return;
-        } else {
-          auto sz = obj->size();
-          Object* new_ptr = backup_heap->allocate(sz);
-          memcpy(new_ptr, obj, sz);
-          obj->forward_to(new_ptr);
-          work_stack.push(new_ptr);
-          *handle = new_ptr->get_cell().raw();
-        }
+    if (!is_a<Object>(*handle)) {
+      return;
+    }
+    Object* obj = get_cell_pointer(*handle);
+    if (!current_heap->contains(obj) && !is_young(obj)) {
+      auto it = large_objects_.find(obj);
+      if (it != large_objects_.end() && !it->second.marked) {
+        it->second.marked = true;
+        it->second.next_marked = marked;
+        marked = &it->second;
       }
+      return;
     }
+    if (obj->is_forwarding()) {
+      Object* forwarded = obj->get_forwarding();
+      *handle = forwarded->get_cell().raw();
+      return;
+    }
+    auto sz = obj->size();
+    Object* new_ptr = backup_heap->allocate(sz);
+    memcpy(new_ptr, obj, sz);
+    obj->forward_to(new_ptr);
+    *handle = new_ptr->get_cell().raw();
   };
 
   // fixup the roots
   mark_roots_(copy_object);
 
-  while (!work_stack.empty()) {
-    Object* o = work_stack.top();
-    work_stack.pop();
-    cell_tag type = o->tag();
-    switch (type) {
-    case CELL_ARRAY: {
-      Array* array = (Array*)o;
-      Cell* end = array->end();
-      for (Cell* element = array->begin(); element < end; ++element) {
-        copy_object((cell_t*)element); // TODO this is a hack
-      }
-    } break;
-    case CELL_STRING:
+  uint8_t* scan = backup_heap_->start_;
+  while (true) {
+    scan = scan_copied(scan, backup_heap_->allocate_ptr_, copy_object);
+    if (marked == nullptr) {
       break;
-    case CELL_QUOTE: {
-      Quotation* quote = (Quotation*)(o);
-      if (quote->definition != nullptr) {
-        copy_object((cell_t*)&quote->definition);
+    }
+    LargeObject* large = marked;
+    marked = large->next_marked;
+    visit_slots((Object*)large->memory.base(), copy_object);
+  }
+}
+
+void Heap::copy_live_parallel() {
+  HeapRegion* const from = current_heap_;
+  HeapRegion* const to = backup_heap_;
+  const unsigned thread_count = gc_threads_;
+  std::unique_ptr<GCWorker[]> workers(new GCWorker[thread_count]);
+  std::atomic<uint8_t*> top{to->allocate_ptr_};
+
+  auto allocate_to = [&](size_t sz) {
+    uint8_t* ptr = top.fetch_add(sz, std::memory_order_relaxed);
+    // Only reached if the buffers waste more than parallel_slack() allows for
+    if (ptr + sz >= to->end_) {
+      fputs("Heap exhausted during a collection\n", stderr);
+      abort();
+    }
+    return ptr;
+  };
+
+  auto copy_object = [&](GCWorker& worker, cell_t* handle) {
+    if (!is_a<Object>(*handle)) {
+      return;
+    }
+    Object* obj = get_cell_pointer(*handle);
+    if (!from->contains(obj) && !is_young(obj)) {
+      auto it = large_objects_.find(obj);
+      if (it != large_objects_.end() &&
+          !it->second.marked.exchange(true, std::memory_order_relaxed)) {
+        worker.work.push(obj);
       }
-      break;
+      return;
+    }
+    const uintptr_t header = obj->load_header();
+    if (Object* forwarded = Object::forwarding_of(header)) {
+      *handle = forwarded->get_cell().raw();
+      return;
     }
-    case CELL_WRAPPER: {
-      Wrapper* wrapper = (Wrapper*)(o);
-      copy_object((cell_t*)&wrapper->wrapped);
-    } break;
 
-    case CELL_WORD: {
-      Word* word = (Word*)o;
-      copy_object((cell_t*)&word->name);
-      copy_object((cell_t*)&word->definition);
-      copy_object((cell_t*)&word->properties);
-    } break;
-    default:
-      HSTL_ASSERT(false);
+    const size_t sz = Object::header_size(header);
+    const size_t aligned = aligned_size(sz);
+    uint8_t* copy;
+    const bool in_lab = aligned <= LAB_OBJECT_SIZE;
+    if (in_lab) {
+      if ((size_t)(worker.lab_end - worker.lab) < aligned) {
+        fill_gap(worker.lab, worker.lab_end);
+        worker.lab = allocate_to(LAB_SIZE);
+        worker.lab_end = worker.lab + LAB_SIZE;
+      }
+      copy = worker.lab;
+      worker.lab += aligned;
+    } else {
+      copy = allocate_to(aligned);
+    }
+    // The header is only read once, as other threads may be forwarding it
+    memcpy(copy, &header, sizeof(header));
+    memcpy(copy + sizeof(header), (uint8_t*)obj + sizeof(header),
+           sz - sizeof(header));
+
+    Object* new_ptr = obj->try_forward_to(header, (Object*)copy);
+    if (new_ptr == (Object*)copy) {
+      worker.work.push(new_ptr);
+    } else if (in_lab) {
+      // Another thread copied it first
+      memset(copy, 0, aligned);
+      worker.lab = copy;
+    } else {
+      // Hand the copy back if nothing was allocated after it
+      memset(copy, 0, aligned);
+      uint8_t* end = copy + aligned;
+      if (!top.compare_exchange_strong(end, copy, std::memory_order_relaxed)) {
+        fill_gap(copy, copy + aligned);
+      }
+    }
+    *handle = new_ptr->get_cell().raw();
+  };
+
+  auto scan = [&](GCWorker& worker, Object* obj) {
+    auto copy = [&](cell_t* handle) { copy_object(worker, handle); };
+    visit_slots(obj, copy);
+  };
+
+  // Threads waiting for work. Once all of them are, nothing is left to copy.
+  std::atomic<unsigned> idle{0};
+
+  auto run = [&](unsigned id) {
+    GCWorker& self = workers[id];
+    while (true) {
+      while (Object* obj = self.work.pop()) {
+        scan(self, obj);
+      }
+      Object* stolen = nullptr;
+      for (unsigned i = 1; i < thread_count && stolen == nullptr; ++i) {
+        stolen = workers[(id + i) % thread_count].work.steal();
+      }
+      if (stolen != nullptr) {
+        scan(self, stolen);
+        continue;
+      }
+
+      idle.fetch_add(1);
+      while (true) {
+        if (idle.load() == thread_count) {
+          return;
+        }
+        bool found = false;
+        for (unsigned i = 0; i < thread_count && !found; ++i) {
+          found = workers[i].work.maybe_stealable();
+        }
+        if (found) {
+          idle.fetch_sub(1);
+          break;
+        }
+        std::this_thread::yield();
+      }
     }
+  };
+
+  // The roots are copied before the other threads start, and shared from
+  // there
+  mark_roots_([&](cell_t* handle) { copy_object(workers[0], handle); });
+
+  thread_pool_->run(run);
+
+  for (unsigned id = 0; id < thread_count; ++id) {
+    fill_gap(workers[id].lab, workers[id].lab_end);
+  }
+  to->allocate_ptr_ = top.load();
+}
+
+void Heap::swap_heaps() {
+  HSTL_ASSERT(!running_gc_);
+
+  // Everything live fits in what is in use now. Only a heap which was
+  // already reported exhausted can have grown past what is reserved.
+  size_t to_size = current_heap_->bytes_used() + nursery_.bytes_used() +
+                   survivor_->bytes_used() + OBJECT_ALIGN;
+  if (to_size > backup_heap_->reserved()) {
+    throw Exception("Heap exhausted");
   }
+  running_gc_ = true;
+  ++major_collections;
 
-  current_heap_->reset();
+  // Plus what copying threads leave unused in their allocation buffers. That
+  // is reserved too, unless the heap has grown past its maximum size.
+  const size_t parallel_size =
+      to_size + parallel_slack(to_size, gc_threads_);
+  if (gc_threads_ > 1 && parallel_size <= backup_heap_->reserved()) {
+    backup_heap_->resize(parallel_size);
+    copy_live_parallel();
+  } else {
+    backup_heap_->resize(to_size);
+    copy_live();
+  }
+  sweep_large();
+
+  // The semi-space copied from isn't needed until the next major collection
+  current_heap_->allocate_ptr_ = current_heap_->start_;
+  current_heap_->resize(0);
+  nursery_.reset();
+  survivor_->reset();
   auto tmp = current_heap_;
   current_heap_ = backup_heap_;
   backup_heap_ = tmp;
 
+  const size_t live = current_heap_->bytes_used();
+  exhausted_ = live + NURSERY_SIZE + SURVIVOR_SIZE > max_size_;
+  const size_t target = target_capacity(live);
+  if (live * 4 < capacity_) {
+    ++sparse_collections_;
+  } else {
+    sparse_collections_ = 0;
+  }
+  if (target > capacity_ || sparse_collections_ >= SHRINK_AFTER) {
+    capacity_ = target;
+    sparse_collections_ = 0;
+  }
+  resize_old();
+
+  // Nothing is young any more, so no card is dirty
+  clear_cards();
+  for (uint8_t* it = current_heap_->start_; it < current_heap_->allocate_ptr_;
+       it += aligned_size(((Object*)it)->size())) {
+    record_object(it, aligned_size(((Object*)it)->size()));
+  }
+
   running_gc_ = false;
 }
 
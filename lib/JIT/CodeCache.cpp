@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "CodeCache.hpp"
+
+#include <hustle/Support/Assert.hpp>
+#include <hustle/Support/Utility.hpp>
+
+#include <string.h>
+
+using namespace hustle;
+using namespace hustle::jit;
+
+#if HUSTLE_JIT_X86_64
+// Provided by the unwinder in libgcc
+extern "C" void __register_frame(void*);
+extern "C" void __deregister_frame(void*);
+#endif
+
+using namespace hustle::jit::dwarf;
+
+namespace {
+constexpr size_t PAGE_GRANULARITY = 4096;
+
+constexpr size_t align_up(size_t value, size_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+class EHFrameWriter {
+public:
+  size_t offset() const { return data_.size(); }
+
+  void u8(uint8_t v) { data_.push_back(v); }
+  void u32(uint32_t v) { bytes(&v, sizeof(v)); }
+  void u64(uint64_t v) { bytes(&v, sizeof(v)); }
+  void bytes(const void* p, size_t sz) {
+    auto* b = (const uint8_t*)p;
+    data_.insert(data_.end(), b, b + sz);
+  }
+
+  /// Reserve the length field of an entry. \sa end_entry()
+  size_t begin_entry() {
+    size_t pos = offset();
+    u32(0);
+    return pos;
+  }
+
+  /// Pad the entry to pointer alignment and fill in its length
+  void end_entry(size_t start) {
+    while ((offset() - start) % sizeof(void*) != 0) {
+      u8(DW_CFA_nop);
+    }
+    uint32_t length = (uint32_t)(offset() - start - sizeof(uint32_t));
+    memcpy(&data_[start], &length, sizeof(length));
+  }
+
+  std::vector<uint8_t>& data() { return data_; }
+
+private:
+  std::vector<uint8_t> data_;
+};
+} // namespace
+
+/// Build an .eh_frame section (CIE, FDE and terminator) for a single function
+static std::vector<uint8_t> build_eh_frame(const void* code, size_t size,
+                                           const std::vector<uint8_t>& cfi) {
+  EHFrameWriter w;
+
+  size_t cie = w.begin_entry();
+  w.u32(0); // CIE id
+  w.u8(1);  // version
+  w.bytes("zR", 3);
+  w.u8(1);    // code alignment factor
+  w.u8(0x78); // data alignment factor (-8)
+  w.u8(dwarf::RA);
+  w.u8(1); // augmentation data length
+  w.u8(DW_EH_PE_absptr);
+  // On entry the CFA is rsp + 8, and the return address is just below it
+  w.u8(DW_CFA_def_cfa);
+  w.u8(dwarf::RSP);
+  w.u8(8);
+  w.u8(DW_CFA_offset | dwarf::RA);
+  w.u8(1);
+  w.end_entry(cie);
+
+  size_t fde = w.begin_entry();
+  w.u32((uint32_t)(w.offset() - cie)); // offset back to the CIE
+  w.u64((uint64_t)code);
+  w.u64(size);
+  w.u8(0); // augmentation data length
+  w.bytes(cfi.data(), cfi.size());
+  w.end_entry(fde);
+
+  w.u32(0); // terminator
+  return std::move(w.data());
+}
+
+CodeCache::CodeCache(size_t size) {
+#if HUSTLE_JIT_X86_64
+  size = align_up(size, PAGE_GRANULARITY);
+  segment_.emplace(Memory::allocate(
+      size, Memory::MEM_READ | Memory::MEM_WRITE | Memory::MEM_EXEC));
+#else
+  (void)size;
+#endif
+}
+
+CodeCache::~CodeCache() { clear(); }
+
+void* CodeCache::install(const std::vector<uint8_t>& code,
+                         const std::vector<uint8_t>& cfi) {
+  if (!segment_) {
+    return nullptr;
+  }
+  size_t start = align_up(used_, 16);
+  if (start + code.size() > segment_->size()) {
+    return nullptr;
+  }
+  void* fn = pointer_add<void>(segment_->base(), start);
+  memcpy(fn, code.data(), code.size());
+  used_ = start + code.size();
+
+#if HUSTLE_JIT_X86_64
+  auto eh_frame = build_eh_frame(fn, code.size(), cfi);
+  auto frame = std::make_unique<uint8_t[]>(eh_frame.size());
+  memcpy(frame.get(), eh_frame.data(), eh_frame.size());
+  __register_frame(frame.get());
+  frames_.push_back(std::move(frame));
+#endif
+  return fn;
+}
+
+bool CodeCache::contains(const void* addr) const {
+  return segment_ && addr >= segment_->base() &&
+         addr < pointer_add<void>(segment_->base(), used_);
+}
+
+void CodeCache::clear() {
+#if HUSTLE_JIT_X86_64
+  for (auto& frame : frames_) {
+    __deregister_frame(frame.get());
+  }
+#endif
+  frames_.clear();
+  used_ = 0;
+}
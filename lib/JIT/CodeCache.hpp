@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef HUSTLE_JIT_CODE_CACHE_HPP
+#define HUSTLE_JIT_CODE_CACHE_HPP
+
+#include <hustle/Support/Memory.hpp>
+
+#include <memory>
+#include <optional>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/// Set if we can generate and unwind through native code on this platform
+#if defined(__x86_64__) && defined(__linux__)
+#define HUSTLE_JIT_X86_64 1
+#else
+#define HUSTLE_JIT_X86_64 0
+#endif
+
+namespace hustle::jit {
+
+/// DWARF call frame information constants for x86-64
+namespace dwarf {
+constexpr uint8_t DW_CFA_nop = 0x00;
+constexpr uint8_t DW_CFA_advance_loc = 0x40;
+constexpr uint8_t DW_CFA_offset = 0x80;
+constexpr uint8_t DW_CFA_def_cfa = 0x0c;
+constexpr uint8_t DW_CFA_def_cfa_register = 0x0d;
+constexpr uint8_t DW_CFA_def_cfa_offset = 0x0e;
+constexpr uint8_t DW_EH_PE_absptr = 0x00;
+
+constexpr uint8_t RBX = 3;
+constexpr uint8_t RBP = 6;
+constexpr uint8_t RSP = 7;
+constexpr uint8_t R12 = 12;
+constexpr uint8_t R13 = 13;
+constexpr uint8_t R14 = 14;
+constexpr uint8_t RA = 16;
+} // namespace dwarf
+
+/**
+ * Executable memory holding generated code.
+ *
+ * Code is bump allocated and never moved, so entry points handed out stay
+ * valid until the cache is cleared. Since generated code may be running
+ * (further up the C++ stack) while new code is installed, the segment is
+ * mapped writable and executable for its whole life.
+ *
+ * C++ exceptions thrown by primitives need to unwind through generated code,
+ * so unwind information is registered for every installed function.
+ */
+class CodeCache {
+public:
+  explicit CodeCache(size_t size);
+  CodeCache(const CodeCache&) = delete;
+  CodeCache& operator=(const CodeCache&) = delete;
+  ~CodeCache();
+
+  /**
+   * Copy a function into the cache.
+   *
+   * \param code machine code for the function
+   * \param cfi DWARF call frame instructions describing the function's
+   * prologue, relative to the x86-64 call site state (CFA = rsp + 8)
+   * \returns the installed function, or null if the cache is full
+   */
+  void* install(const std::vector<uint8_t>& code,
+                const std::vector<uint8_t>& cfi);
+
+  /// Check if addr points into code owned by this cache
+  bool contains(const void* addr) const;
+
+  /// Free all installed code. None of it may be running.
+  void clear();
+
+  size_t used() const { return used_; }
+
+private:
+  std::optional<MemorySegment> segment_;
+  size_t used_ = 0;
+
+  /// .eh_frame data registered with the unwinder, one entry per function
+  std::vector<std::unique_ptr<uint8_t[]>> frames_;
+};
+
+} // namespace hustle::jit
+#endif
@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "hustle/JIT/JIT.hpp"
+#include "CodeCache.hpp"
+#include "X86Assembler.hpp"
+
+#include "hustle/Object.hpp"
+#include "hustle/Stack.hpp"
+#include "hustle/Support/Error.hpp"
+#include "hustle/VM.hpp"
+
+#include <stddef.h>
+
+using namespace hustle;
+using namespace hustle::jit;
+
+namespace {
+// State kept in callee saved registers for the whole function, so it survives
+// calls back into the VM.
+constexpr Reg VM_REG = R13;
+constexpr Reg FRAME_REG = R12;
+constexpr Reg SP_ADDR_REG = RBX;
+constexpr Reg STACK_BASE_REG = R14;
+
+constexpr Reg ARG0 = RDI;
+constexpr Reg ARG1 = RSI;
+
+constexpr int32_t UNTAG_MASK = ~(int32_t)CELL_TAG_MASK;
+constexpr int32_t FRAME_QUOTE_OFFSET = offsetof(StackFrame, quote);
+constexpr int32_t FRAME_IP_OFFSET = offsetof(StackFrame, ip);
+constexpr int32_t FRAME_LOCALS_OFFSET = offsetof(StackFrame, locals);
+
+/// Names of primitives which must be run by the interpreter
+const char* const FRAME_PRIMITIVES[] = {"call", "dip", "while"};
+} // namespace
+
+/**
+ * Called to make the call at resume - 1 in the definition, which the
+ * interpreter loop has to run. Leaves our frame to be resumed at resume once
+ * it is back on top.
+ */
+static void jit_call(VM* vm, size_t resume) {
+  StackFrame& frame = vm->call_stack_.top();
+  Array* definition = frame.quote->definition;
+  frame.code = definition;
+  frame.ip = definition->begin() + resume;
+  frame.walking = true;
+  frame.native = true;
+  Cell callee = (*definition)[resume - 1];
+  vm->call_word(cast<Word>(callee), frame.ip == definition->end());
+}
+
+/// Called when a push reaches the base of the stack. Throws if it can't grow.
+static void jit_stack_grow(VM* vm) { vm->stack_.reserve(1); }
+
+/// Called when the stack holds too few cells for an operation. Always throws.
+static void jit_stack_underflow(VM* vm) {
+  vm->stack_.require(vm->stack_.depth() + 1);
+}
+
+/**
+ * Called when compiled code is entered after it has been invalidated, or with
+ * an ip it has no resume point for. The interpreter walks the rest of the
+ * definition.
+ */
+static void jit_deoptimize(VM* vm, Quotation* quote) {
+  quote->entry = nullptr;
+  quote->invocations = 0;
+  StackFrame& frame = vm->call_stack_.top();
+  if (!frame.walking) {
+    frame.code = quote->definition;
+    frame.ip = frame.code->begin();
+    frame.walking = true;
+  }
+  frame.native = false;
+}
+
+static Quotation::FuncType primitive_entry(Word* word) {
+  Quotation* definition = word->definition;
+  // Compiled quotations expect a frame of their own
+  if (definition == nullptr || definition->definition != nullptr) {
+    return nullptr;
+  }
+  return definition->entry;
+}
+
+namespace {
+/**
+ * Generates the code for a single quotation.
+ *
+ * The generated function has the signature of Quotation::FuncType, and
+ * expects its own frame to be on top of the call stack when called.
+ */
+class FunctionBuilder {
+public:
+  FunctionBuilder(VM& vm, Quotation* quote) : vm_(vm), quote_(quote) {}
+
+  void prologue();
+
+  /// Pop our frame and return. Must be called after the body.
+  void epilogue();
+
+  /// Push a value known at compile time
+  void push_immediate(Cell value);
+
+  /// Push the cell at index of the definition
+  void push_definition_cell(size_t index);
+
+  /// Push the value wrapped by the Wrapper at index of the definition
+  void push_wrapped_cell(size_t index, Wrapper* wrapper);
+
+  void call_primitive(Quotation::FuncType fn);
+
+  /// Do the stack shuffle op in place. Returns false if op isn't a shuffle.
+  bool inline_shuffle(Opcode op);
+
+  /// Push local depth of the word running in our frame
+  void push_local(intptr_t depth);
+
+  /// Pop a cell into local depth of the word running in our frame
+  void pop_local(intptr_t depth);
+
+  /// Return to the interpreter loop to call the word at index of the
+  /// definition, resuming after it
+  void call_interpreted(size_t index, bool is_tail);
+
+  /// Emit the out of line paths. Must be called after the epilogue.
+  void slow_paths();
+
+  const std::vector<uint8_t>& code() const { return asm_.buffer(); }
+  const std::vector<uint8_t>& cfi() const { return cfi_; }
+
+private:
+  void load_definition(Reg dst);
+  void load_definition_cell(Reg dst, size_t index);
+  void push_reg(Reg value);
+
+  /// Load the stack pointer into RAX, jumping away if the stack holds fewer
+  /// than count cells
+  void require(size_t count);
+  void call_native(const void* fn);
+  void cfi_advance();
+
+  VM& vm_;
+  Quotation* quote_;
+  X86Assembler asm_;
+  std::vector<uint8_t> cfi_;
+  size_t cfi_offset_ = 0;
+
+  /// A push which found the stack full
+  struct OverflowSite {
+    X86Assembler::Fixup jump;
+    Reg value;
+    /// Start of the push, which is retried once the stack has grown
+    size_t retry;
+  };
+
+  /// Where the body continues after a call the interpreter made for us
+  struct ResumePoint {
+    /// Index in the definition of the cell after the call
+    size_t index;
+    size_t offset;
+  };
+
+  std::vector<OverflowSite> overflow_sites_;
+  std::vector<X86Assembler::Fixup> underflow_jumps_;
+  std::vector<X86Assembler::Fixup> deopt_jumps_;
+  /// Jumps to the return which leaves our frame on the call stack
+  std::vector<X86Assembler::Fixup> leave_jumps_;
+  std::vector<ResumePoint> resume_points_;
+  X86Assembler::Fixup resume_jump_ = 0;
+  size_t leave_offset_ = 0;
+};
+} // namespace
+
+void FunctionBuilder::cfi_advance() {
+  size_t delta = asm_.offset() - cfi_offset_;
+  HSTL_ASSERT(delta < 64);
+  cfi_.push_back(dwarf::DW_CFA_advance_loc | delta);
+  cfi_offset_ = asm_.offset();
+}
+
+void FunctionBuilder::prologue() {
+  asm_.push(RBP);
+  cfi_advance();
+  cfi_.insert(cfi_.end(), {dwarf::DW_CFA_def_cfa_offset, 16,
+                           dwarf::DW_CFA_offset | dwarf::RBP, 2});
+  asm_.mov(RBP, RSP);
+  cfi_advance();
+  cfi_.insert(cfi_.end(), {dwarf::DW_CFA_def_cfa_register, dwarf::RBP});
+
+  // Callee saved registers live at CFA - 24 and below. Saving four keeps the
+  // stack 16 byte aligned for calls.
+  const std::pair<Reg, uint8_t> saved[] = {{SP_ADDR_REG, dwarf::RBX},
+                                           {FRAME_REG, dwarf::R12},
+                                           {VM_REG, dwarf::R13},
+                                           {STACK_BASE_REG, dwarf::R14}};
+  uint8_t slot = 3;
+  for (auto [reg, dwarf_reg] : saved) {
+    asm_.push(reg);
+    cfi_advance();
+    cfi_.insert(cfi_.end(), {(uint8_t)(dwarf::DW_CFA_offset | dwarf_reg),
+                             slot++});
+  }
+
+  asm_.mov(VM_REG, ARG0);
+  asm_.mov_imm(SP_ADDR_REG, (uint64_t)vm_.stack_.sp_address());
+  asm_.mov_imm(STACK_BASE_REG, (uint64_t)vm_.stack_.base_address());
+  asm_.load(STACK_BASE_REG, STACK_BASE_REG, 0);
+  asm_.mov_imm(RAX, (uint64_t)vm_.call_stack_.sp_address());
+  asm_.load(FRAME_REG, RAX, 0);
+
+  // Bail out to the interpreter if we have been invalidated
+  asm_.mov_imm(RAX, (uint64_t)&vm_.code_epoch_);
+  asm_.load(RAX, RAX, 0);
+  asm_.mov_imm(RCX, (uint64_t)vm_.code_epoch_);
+  asm_.cmp(RAX, RCX);
+  deopt_jumps_.push_back(asm_.jcc(CC_NE));
+
+  // A frame which has been entered before is resumed after its last call
+  asm_.load(RAX, FRAME_REG, FRAME_IP_OFFSET);
+  asm_.cmp_imm(RAX, 0);
+  resume_jump_ = asm_.jcc(CC_NE);
+}
+
+void FunctionBuilder::epilogue() {
+  asm_.mov(RCX, FRAME_REG);
+  asm_.add_imm(RCX, sizeof(StackFrame));
+  asm_.mov_imm(RAX, (uint64_t)vm_.call_stack_.sp_address());
+  asm_.store(RAX, 0, RCX);
+
+  leave_offset_ = asm_.offset();
+  for (auto fixup : leave_jumps_) {
+    asm_.bind(fixup);
+  }
+  asm_.pop(STACK_BASE_REG);
+  asm_.pop(VM_REG);
+  asm_.pop(FRAME_REG);
+  asm_.pop(SP_ADDR_REG);
+  asm_.pop(RBP);
+  asm_.ret();
+}
+
+void FunctionBuilder::slow_paths() {
+  // Find the resume point for ip, which is still in RAX
+  asm_.bind(resume_jump_);
+  load_definition(RCX);
+  asm_.sub(RAX, RCX);
+  for (const ResumePoint& point : resume_points_) {
+    asm_.cmp_imm(RAX, (int32_t)(sizeof(Array) + point.index * sizeof(Cell)));
+    asm_.bind(asm_.jcc(CC_E), point.offset);
+  }
+
+  for (auto fixup : deopt_jumps_) {
+    asm_.bind(fixup);
+  }
+  asm_.mov(ARG0, VM_REG);
+  asm_.load(ARG1, FRAME_REG, FRAME_QUOTE_OFFSET);
+  call_native((const void*)&jit_deoptimize);
+  asm_.bind(asm_.jmp(), leave_offset_);
+
+  for (const OverflowSite& site : overflow_sites_) {
+    asm_.bind(site.jump);
+    // Pushed twice to keep the stack aligned for the call
+    asm_.push(site.value);
+    asm_.push(site.value);
+    asm_.mov(ARG0, VM_REG);
+    call_native((const void*)&jit_stack_grow);
+    asm_.pop(site.value);
+    asm_.pop(site.value);
+
+    // Growing moves the base of the stack
+    asm_.mov_imm(STACK_BASE_REG, (uint64_t)vm_.stack_.base_address());
+    asm_.load(STACK_BASE_REG, STACK_BASE_REG, 0);
+    asm_.bind(asm_.jmp(), site.retry);
+  }
+
+  for (auto fixup : underflow_jumps_) {
+    asm_.bind(fixup);
+  }
+  if (!underflow_jumps_.empty()) {
+    asm_.mov(ARG0, VM_REG);
+    call_native((const void*)&jit_stack_underflow);
+  }
+}
+
+void FunctionBuilder::load_definition(Reg dst) {
+  const auto definition_offset =
+      (int32_t)((uint8_t*)&quote_->definition - (uint8_t*)quote_);
+  // Frames hold the quote untagged
+  asm_.load(dst, FRAME_REG, FRAME_QUOTE_OFFSET);
+  asm_.load(dst, dst, definition_offset);
+  asm_.and_imm(dst, UNTAG_MASK);
+}
+
+void FunctionBuilder::load_definition_cell(Reg dst, size_t index) {
+  load_definition(dst);
+  asm_.load(dst, dst, (int32_t)(sizeof(Array) + index * sizeof(Cell)));
+}
+
+void FunctionBuilder::push_reg(Reg value) {
+  HSTL_ASSERT(value != RAX);
+  size_t retry = asm_.offset();
+  asm_.load(RAX, SP_ADDR_REG, 0);
+  asm_.cmp(RAX, STACK_BASE_REG);
+  overflow_sites_.push_back({asm_.jcc(CC_BE), value, retry});
+  asm_.sub_imm(RAX, sizeof(Cell));
+  asm_.store(RAX, 0, value);
+  asm_.store(SP_ADDR_REG, 0, RAX);
+}
+
+void FunctionBuilder::require(size_t count) {
+  // The top of the stack never moves, only its base
+  asm_.load(RAX, SP_ADDR_REG, 0);
+  asm_.mov_imm(RCX, (uint64_t)(vm_.stack_.end() - count));
+  asm_.cmp(RAX, RCX);
+  underflow_jumps_.push_back(asm_.jcc(CC_A));
+}
+
+void FunctionBuilder::call_native(const void* fn) {
+  asm_.mov_imm(RAX, (uint64_t)fn);
+  asm_.call(RAX);
+}
+
+void FunctionBuilder::push_immediate(Cell value) {
+  asm_.mov_imm(RCX, value.raw());
+  push_reg(RCX);
+}
+
+void FunctionBuilder::push_definition_cell(size_t index) {
+  load_definition_cell(RCX, index);
+  push_reg(RCX);
+}
+
+void FunctionBuilder::push_wrapped_cell(size_t index, Wrapper* wrapper) {
+  const auto wrapped_offset =
+      (int32_t)((uint8_t*)&wrapper->wrapped - (uint8_t*)wrapper);
+  load_definition_cell(RCX, index);
+  asm_.and_imm(RCX, UNTAG_MASK);
+  asm_.load(RCX, RCX, wrapped_offset);
+  push_reg(RCX);
+}
+
+void FunctionBuilder::call_primitive(Quotation::FuncType fn) {
+  asm_.mov(ARG0, VM_REG);
+  asm_.mov_imm(ARG1, 0);
+  call_native((const void*)fn);
+}
+
+bool FunctionBuilder::inline_shuffle(Opcode op) {
+  switch (op) {
+  case OP_DUP:
+    require(1);
+    asm_.load(RCX, RAX, 0);
+    push_reg(RCX);
+    return true;
+  case OP_DROP:
+    require(1);
+    asm_.add_imm(RAX, sizeof(Cell));
+    asm_.store(SP_ADDR_REG, 0, RAX);
+    return true;
+  case OP_SWAP:
+    require(2);
+    asm_.load(RCX, RAX, 0);
+    asm_.load(RDX, RAX, sizeof(Cell));
+    asm_.store(RAX, 0, RDX);
+    asm_.store(RAX, sizeof(Cell), RCX);
+    return true;
+  case OP_OVER:
+    require(2);
+    asm_.load(RCX, RAX, sizeof(Cell));
+    push_reg(RCX);
+    return true;
+  default:
+    return false;
+  }
+}
+
+void FunctionBuilder::push_local(intptr_t depth) {
+  asm_.load(RCX, FRAME_REG, FRAME_LOCALS_OFFSET);
+  asm_.load(RCX, RCX, (int32_t)(depth * sizeof(Cell)));
+  push_reg(RCX);
+}
+
+void FunctionBuilder::pop_local(intptr_t depth) {
+  require(1);
+  asm_.load(RCX, RAX, 0);
+  asm_.add_imm(RAX, sizeof(Cell));
+  asm_.store(SP_ADDR_REG, 0, RAX);
+  asm_.load(RDX, FRAME_REG, FRAME_LOCALS_OFFSET);
+  asm_.store(RDX, (int32_t)(depth * sizeof(Cell)), RCX);
+}
+
+void FunctionBuilder::call_interpreted(size_t index, bool is_tail) {
+  asm_.mov(ARG0, VM_REG);
+  asm_.mov_imm(ARG1, index + 1);
+  call_native((const void*)&jit_call);
+  leave_jumps_.push_back(asm_.jmp());
+  if (!is_tail) {
+    resume_points_.push_back({index + 1, asm_.offset()});
+  }
+}
+
+JIT::JIT(VM& vm, size_t cache_size)
+    : cache_(std::make_unique<CodeCache>(cache_size)),
+      epoch_(vm.code_epoch_) {
+  for (const char* name : FRAME_PRIMITIVES) {
+    Word* word = cast<Word>(vm.lookup_symbol(name));
+    frame_primitives_.insert(primitive_entry(word));
+  }
+}
+
+JIT::~JIT() = default;
+
+bool JIT::is_supported() { return HUSTLE_JIT_X86_64; }
+
+void JIT::mark_roots(Heap::MarkFunction fn) {
+  for (Cell& quote : compiled_) {
+    fn((cell_t*)&quote);
+  }
+}
+
+bool JIT::owns(Quotation::FuncType fn) const {
+  return cache_->contains((const void*)fn);
+}
+
+void JIT::flush() {
+  for (Cell cell : compiled_) {
+    Quotation* quote = cast<Quotation>(cell);
+    if (owns(quote->entry)) {
+      quote->entry = nullptr;
+    }
+  }
+  compiled_.clear();
+  cache_->clear();
+}
+
+bool JIT::is_direct_call(Word* word) const {
+  auto fn = primitive_entry(word);
+  return fn != nullptr && frame_primitives_.count(fn) == 0;
+}
+
+Quotation::FuncType JIT::install(VM& vm, const std::vector<uint8_t>& code,
+                                 const std::vector<uint8_t>& cfi) {
+  // Code compiled before the epoch changed can never run again
+  if (vm.native_depth_ == 0 && epoch_ != vm.code_epoch_) {
+    flush();
+    epoch_ = vm.code_epoch_;
+  }
+  void* fn = cache_->install(code, cfi);
+  if (fn == nullptr && vm.native_depth_ == 0 && cache_->used() != 0) {
+    flush();
+    fn = cache_->install(code, cfi);
+  }
+  return (Quotation::FuncType)fn;
+}
+
+/// Push the literal cell, found at index of the definition
+static void push_literal(FunctionBuilder& builder, Cell cell, size_t index) {
+  switch (cell.tag()) {
+  case CELL_WRAPPER: {
+    Wrapper* wrapper = cast<Wrapper>(cell);
+    if (wrapper->wrapped.is_a<intptr_t>()) {
+      builder.push_immediate(wrapper->wrapped);
+    } else {
+      builder.push_wrapped_cell(index, wrapper);
+    }
+    break;
+  }
+  case CELL_INT:
+    builder.push_immediate(cell);
+    break;
+  default:
+    builder.push_definition_cell(index);
+    break;
+  }
+}
+
+Quotation::FuncType JIT::compile(VM& vm, Quotation* quote) {
+  if (!is_supported() || quote->definition == nullptr) {
+    return nullptr;
+  }
+  Array* definition = quote->definition;
+
+  FunctionBuilder builder(vm, quote);
+  builder.prologue();
+  for (size_t i = 0; i < definition->count(); ++i) {
+    Cell cell = (*definition)[i];
+    const Cell* it = definition->begin() + i;
+    // Locals of our own frame are read and written in place. Quotation
+    // literals leave finding those of their word to the primitives.
+    const LocalWord local =
+        quote->scope == nullptr
+            ? match_local_word(vm, it, definition->end())
+            : LOCAL_MAX;
+    switch (local) {
+    case LOCAL_GET:
+      builder.push_local(cast<intptr_t>(cell));
+      ++i;
+      continue;
+    case LOCAL_SET:
+      builder.pop_local(cast<intptr_t>(cell));
+      ++i;
+      continue;
+    default:
+      break;
+    }
+    // Same pattern matching as the interpreter, so the same fused primitives
+    // are used
+    if (const SuperInstruction* super =
+            match_superinstruction(vm, it, definition->end())) {
+      for (size_t j = 0; j < super->pattern.size(); ++j) {
+        if (super->pattern[j].kind == SuperInstruction::Element::ANY) {
+          push_literal(builder, it[j], i + j);
+        }
+      }
+      builder.call_primitive(primitive_entry(super->word));
+      i += super->pattern.size() - 1;
+      continue;
+    }
+    if (!cell.is_a<Word>()) {
+      push_literal(builder, cell, i);
+    } else if (builder.inline_shuffle(inline_opcode(vm, cell))) {
+      // Done in place
+    } else if (is_direct_call(cast<Word>(cell))) {
+      builder.call_primitive(primitive_entry(cast<Word>(cell)));
+    } else {
+      builder.call_interpreted(i, i + 1 == definition->count());
+    }
+  }
+  builder.epilogue();
+  builder.slow_paths();
+
+  auto fn = install(vm, builder.code(), builder.cfi());
+  if (fn != nullptr) {
+    compiled_.push_back(Cell(quote));
+  }
+  return fn;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef HUSTLE_JIT_X86_ASSEMBLER_HPP
+#define HUSTLE_JIT_X86_ASSEMBLER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace hustle::jit {
+
+enum Reg : uint8_t {
+  RAX = 0,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15
+};
+
+enum Condition : uint8_t { CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7 };
+
+/**
+ * Minimal x86-64 encoder.
+ *
+ * Only supports the handful of instructions needed by the baseline JIT.
+ * Memory operands are always of the form [base + disp32].
+ */
+class X86Assembler {
+public:
+  /// Position in the buffer of a rel32 operand which needs to be patched
+  using Fixup = size_t;
+
+  const std::vector<uint8_t>& buffer() const { return buffer_; }
+  size_t offset() const { return buffer_.size(); }
+
+  void push(Reg r) {
+    rex(false, 0, r);
+    emit(0x50 + (r & 7));
+  }
+
+  void pop(Reg r) {
+    rex(false, 0, r);
+    emit(0x58 + (r & 7));
+  }
+
+  void mov(Reg dst, Reg src) {
+    rex(true, src, dst);
+    emit(0x89);
+    modrm(3, src, dst);
+  }
+
+  void mov_imm(Reg dst, uint64_t imm) {
+    rex(true, 0, dst);
+    emit(0xB8 + (dst & 7));
+    emit_bytes(&imm, sizeof(imm));
+  }
+
+  /// mov dst, [base + disp]
+  void load(Reg dst, Reg base, int32_t disp) {
+    rex(true, dst, base);
+    emit(0x8B);
+    mem_operand(dst, base, disp);
+  }
+
+  /// mov [base + disp], src
+  void store(Reg base, int32_t disp, Reg src) {
+    rex(true, src, base);
+    emit(0x89);
+    mem_operand(src, base, disp);
+  }
+
+  void add_imm(Reg dst, int32_t imm) { alu_imm(0, dst, imm); }
+  void and_imm(Reg dst, int32_t imm) { alu_imm(4, dst, imm); }
+  void sub_imm(Reg dst, int32_t imm) { alu_imm(5, dst, imm); }
+
+  /// sub dst, src
+  void sub(Reg dst, Reg src) {
+    rex(true, src, dst);
+    emit(0x29);
+    modrm(3, src, dst);
+  }
+
+  /// cmp lhs, rhs
+  void cmp(Reg lhs, Reg rhs) {
+    rex(true, rhs, lhs);
+    emit(0x39);
+    modrm(3, rhs, lhs);
+  }
+
+  /// cmp lhs, imm
+  void cmp_imm(Reg lhs, int32_t imm) { alu_imm(7, lhs, imm); }
+
+  void call(Reg target) {
+    rex(false, 0, target);
+    emit(0xFF);
+    modrm(3, 2, target);
+  }
+
+  void ret() { emit(0xC3); }
+
+  Fixup jcc(Condition cc) {
+    emit(0x0F);
+    emit(0x80 + cc);
+    return rel32();
+  }
+
+  Fixup jmp() {
+    emit(0xE9);
+    return rel32();
+  }
+
+  /// Point a previously emitted jump at the current position
+  void bind(Fixup fixup) { bind(fixup, offset()); }
+
+  /// Point a previously emitted jump at target
+  void bind(Fixup fixup, size_t target) {
+    int32_t rel = (int32_t)(target - (fixup + 4));
+    memcpy(&buffer_[fixup], &rel, sizeof(rel));
+  }
+
+private:
+  void emit(uint8_t byte) { buffer_.push_back(byte); }
+
+  void emit_bytes(const void* data, size_t sz) {
+    auto* bytes = (const uint8_t*)data;
+    buffer_.insert(buffer_.end(), bytes, bytes + sz);
+  }
+
+  void rex(bool wide, uint8_t reg, uint8_t rm) {
+    uint8_t prefix = 0x40;
+    if (wide) {
+      prefix |= 0x8;
+    }
+    if (reg & 8) {
+      prefix |= 0x4;
+    }
+    if (rm & 8) {
+      prefix |= 0x1;
+    }
+    if (prefix != 0x40) {
+      emit(prefix);
+    }
+  }
+
+  void modrm(uint8_t mod, uint8_t reg, uint8_t rm) {
+    emit((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  void mem_operand(uint8_t reg, Reg base, int32_t disp) {
+    modrm(2, reg, base);
+    if ((base & 7) == RSP) {
+      // rsp and r12 need a SIB byte
+      emit(0x24);
+    }
+    emit_bytes(&disp, sizeof(disp));
+  }
+
+  void alu_imm(uint8_t op, Reg dst, int32_t imm) {
+    rex(true, 0, dst);
+    emit(0x81);
+    modrm(3, op, dst);
+    emit_bytes(&imm, sizeof(imm));
+  }
+
+  Fixup rel32() {
+    Fixup pos = offset();
+    int32_t zero = 0;
+    emit_bytes(&zero, sizeof(zero));
+    return pos;
+  }
+
+  std::vector<uint8_t> buffer_;
+};
+
+} // namespace hustle::jit
+#endif
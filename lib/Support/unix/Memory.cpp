@@ -28,7 +28,14 @@
 
 #include "hustle/Support/Memory.hpp"
 #include "hustle/Support/Assert.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+
+#include <signal.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 using namespace hustle;
 /*
@@ -59,7 +66,11 @@ MemorySegment Memory::allocate(size_t size, unsigned flags) {
   const int prot = native_protection_flags(flags);
 
   // TODO round up to a page size;
-  void* addr = mmap(nullptr, size, prot, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  // Reserved address space is not counted against the commit limit until it
+  // is made accessible
+  const int map_flags =
+      MAP_ANONYMOUS | MAP_PRIVATE | (flags == 0 ? MAP_NORESERVE : 0);
+  void* addr = mmap(nullptr, size, prot, map_flags, -1, 0);
   HSTL_ASSERT(addr != (void*)-1);
   return MemorySegment(addr, size);
 }
@@ -79,3 +90,117 @@ void Memory::protect(void* addr, size_t size, unsigned flags) {
   int rc = mprotect(addr, size, native_protection_flags(flags));
   HSTL_ASSERT(rc == 0);
 }
+
+void Memory::decommit(void* addr, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  // Mapping fresh pages over the old ones drops them, whereas mprotect()
+  // alone would keep them resident
+  void* rc = mmap(addr, size, PROT_NONE,
+                  MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1,
+                  0);
+  HSTL_ASSERT(rc == addr);
+}
+
+size_t Memory::page_size() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+namespace {
+/// A region registered with Memory::add_guard()
+struct Guard {
+  /// Set last when adding a guard, so the other fields are valid when it is
+  /// seen from the signal handler
+  std::atomic<char*> begin{nullptr};
+  size_t size = 0;
+  Memory::FaultHandler handler = nullptr;
+  void* context = nullptr;
+};
+
+// Searched from the signal handler, so this can't be anything which allocates
+constexpr size_t MAX_GUARDS = 64;
+Guard guards[MAX_GUARDS];
+std::mutex guards_mutex;
+
+// OSX raises SIGBUS rather than SIGSEGV for protected pages
+constexpr int GUARD_SIGNALS[] = {SIGSEGV, SIGBUS};
+struct sigaction previous_actions[2];
+} // namespace
+
+static void guard_fault(int signal, siginfo_t* info, void* ucontext) {
+  char* addr = (char*)info->si_addr;
+  for (Guard& guard : guards) {
+    char* begin = guard.begin.load(std::memory_order_acquire);
+    if (begin != nullptr && addr >= begin && addr < begin + guard.size) {
+      // Either unwinds through the signal frame into the faulting code, or
+      // returns to retry the access
+      guard.handler(guard.context);
+      return;
+    }
+  }
+
+  // Not ours, so hand it on to whoever was installed before us
+  struct sigaction& previous = previous_actions[signal == SIGBUS];
+  if (previous.sa_flags & SA_SIGINFO) {
+    previous.sa_sigaction(signal, info, ucontext);
+  } else if (previous.sa_handler == SIG_DFL || previous.sa_handler == SIG_IGN) {
+    // Returning retries the access, which faults again with the old handler
+    sigaction(signal, &previous, nullptr);
+  } else {
+    previous.sa_handler(signal);
+  }
+}
+
+/// Install guard_fault(), unless it is already the current handler
+static void install_fault_handler() {
+  for (size_t i = 0; i < 2; i++) {
+    struct sigaction current;
+    sigaction(GUARD_SIGNALS[i], nullptr, &current);
+    if ((current.sa_flags & SA_SIGINFO) &&
+        current.sa_sigaction == guard_fault) {
+      continue;
+    }
+
+    struct sigaction action = {};
+    action.sa_sigaction = guard_fault;
+    // The handler exits by throwing, so never leave the signal blocked
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(GUARD_SIGNALS[i], &action, &previous_actions[i]);
+  }
+}
+
+void Memory::add_guard(void* addr, size_t size, FaultHandler handler,
+                       void* context) {
+  HSTL_ASSERT((uintptr_t)addr % page_size() == 0);
+  HSTL_ASSERT(size % page_size() == 0);
+  protect(addr, size, 0);
+
+  std::lock_guard<std::mutex> lock(guards_mutex);
+  // Re-checked on every call, since test harnesses install their own
+  // handlers and put back whatever they found afterwards
+  install_fault_handler();
+  for (Guard& guard : guards) {
+    if (guard.begin.load(std::memory_order_relaxed) == nullptr) {
+      guard.size = size;
+      guard.handler = handler;
+      guard.context = context;
+      guard.begin.store((char*)addr, std::memory_order_release);
+      return;
+    }
+  }
+  throw std::length_error("too many guard regions");
+}
+
+void Memory::remove_guard(void* addr) {
+  std::lock_guard<std::mutex> lock(guards_mutex);
+  for (Guard& guard : guards) {
+    if (guard.begin.load(std::memory_order_relaxed) == addr) {
+      guard.begin.store(nullptr, std::memory_order_release);
+      return;
+    }
+  }
+  HSTL_ASSERT(false && "not a guard region");
+}
@@ -72,8 +72,8 @@ MemorySegment Memory::allocate(size_t size, unsigned flags) {
 
   DWORD protection = native_flags(flags);
   // TODO round up to page size;
-  void* memory =
-      VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, protection);
+  DWORD type = flags == 0 ? MEM_RESERVE : MEM_COMMIT | MEM_RESERVE;
+  void* memory = VirtualAlloc(nullptr, size, type, protection);
   HSTL_ASSERT(memory != nullptr);
   return MemorySegment(memory, size);
   // return {nullptr, 0};
@@ -99,6 +99,11 @@ void Memory::release(MemorySegment& segment) {
 }
 
 void Memory::protect(void* addr, size_t size, unsigned flags) {
+  // Pages which were only reserved need committing before they can be used
+  if (flags != 0 &&
+      VirtualAlloc(addr, size, MEM_COMMIT, native_flags(flags)) != nullptr) {
+    return;
+  }
   DWORD old_flags = 0;
   if (!VirtualProtect(addr, size, native_flags(flags), &old_flags)) {
     // TODO: better integrate this error
@@ -112,3 +117,28 @@ void Memory::protect(void* addr, size_t size, unsigned flags) {
     HSTL_ASSERT(false);
   }
 }
+
+void Memory::decommit(void* addr, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  int rc = VirtualFree(addr, size, MEM_DECOMMIT);
+  HSTL_ASSERT(rc);
+}
+
+size_t Memory::page_size() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+}
+
+// TODO: dispatch faults to the handler from a vectored exception handler. For
+// now the guard only stops a stray access from corrupting adjacent memory.
+void Memory::add_guard(void* addr, size_t size, FaultHandler, void*) {
+  // Decommitting works whether or not the pages were ever committed, unlike
+  // VirtualProtect
+  int rc = VirtualFree(addr, size, MEM_DECOMMIT);
+  HSTL_ASSERT(rc);
+}
+
+void Memory::remove_guard(void*) {}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "hustle/VM/AOT.hpp"
+#include "hustle/Object.hpp"
+#include "hustle/VM.hpp"
+
+#include <cstring>
+
+using namespace hustle;
+
+void hustle::register_aot_words(VM& vm, const AOTModule& module) {
+  for (size_t i = 0; i < module.primitive_count; ++i) {
+    auto it = vm.symbol_table_.find(module.primitive_names[i]);
+    if (it == vm.symbol_table_.end() || !is_a<Word>(it->second)) {
+      throw Exception("Compiled word uses a missing primitive");
+    }
+    Quotation* definition = cast<Word>(it->second)->definition;
+    if (definition == nullptr || !definition->is_leaf) {
+      throw Exception("Compiled word uses a primitive which is not a leaf");
+    }
+    module.primitives[i] = definition->entry;
+  }
+
+  for (size_t i = 0; i < module.word_count; ++i) {
+    const AOTWord& word = module.words[i];
+    auto name = vm.make_handle(
+        vm.allocate<String>(word.name, std::strlen(word.name)));
+    Quotation* quote = vm.allocate<Quotation>(word.function);
+    quote->is_leaf = true;
+    quote->effect = word.effect;
+    vm.register_symbol(name, quote);
+  }
+  // Code built before now may have entered the old definitions directly
+  vm.invalidate_code();
+}
@@ -0,0 +1,638 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "hustle/VM/Bytecode.hpp"
+#include "hustle/VM/IR.hpp"
+#include "hustle/Object.hpp"
+#include "hustle/VM.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <fmt/ostream.h>
+#include <ostream>
+#include <sstream>
+
+using namespace hustle;
+
+/// Get the primitive entry point of a word, or null if it is not a primitive
+static Quotation::FuncType primitive_entry(Word* word) {
+  Quotation* definition = word->definition;
+  // Quotes compiled to native code expect a frame of their own
+  if (definition == nullptr || definition->definition != nullptr) {
+    return nullptr;
+  }
+  return definition->entry;
+}
+
+/// Emit a call to a word with a native entry point
+template <typename Emitter>
+static void emit_primitive_call(Emitter& emit, Word* word, bool is_tail) {
+  Quotation* definition = word->definition;
+  Cell fn = encode_native(definition->entry);
+  if (definition->is_leaf) {
+    emit(OP_CALL_LEAF, {fn, word});
+  } else {
+    emit(is_tail ? OP_TAIL_CALL_PRIMITIVE : OP_CALL_PRIMITIVE, {fn, word});
+  }
+}
+
+void hustle::add_superinstruction(VM& vm, const char* pattern,
+                                  Quotation::FuncType fn) {
+  SuperInstruction super;
+  // Allocate the word first, so the pattern cells can't be moved by a GC
+  // before they are visible to the VM. It is only reachable from the table,
+  // as nothing should be able to name it.
+  super.word = vm.make_primitive(pattern, fn);
+
+  std::istringstream tokens(pattern);
+  std::string token;
+  while (tokens >> token) {
+    SuperInstruction::Element element;
+    intptr_t value = 0;
+    auto [end, ec] =
+        std::from_chars(token.data(), token.data() + token.size(), value);
+    if (token == "_") {
+      element.kind = SuperInstruction::Element::ANY;
+    } else if (ec == std::errc() && end == token.data() + token.size()) {
+      element.kind = SuperInstruction::Element::LITERAL;
+      element.value = Cell::from_int(value);
+    } else {
+      element.kind = SuperInstruction::Element::WORD;
+      element.value = Cell::from_raw(vm.lookup_symbol(token));
+      element.entry = primitive_entry(cast<Word>(element.value));
+      HSTL_ASSERT(element.entry != nullptr);
+    }
+    super.pattern.push_back(element);
+  }
+  HSTL_ASSERT(super.pattern.size() > 1);
+
+  auto& table = vm.superinstructions_;
+  auto pos = std::find_if(table.begin(), table.end(), [&](const auto& other) {
+    return other.pattern.size() < super.pattern.size();
+  });
+  table.insert(pos, std::move(super));
+}
+
+void hustle::add_control_word(VM& vm, ControlWord kind, const char* name) {
+  auto& element = vm.control_words_[kind];
+  element.kind = SuperInstruction::Element::WORD;
+  element.value = Cell::from_raw(vm.lookup_symbol(name));
+  element.entry = primitive_entry(cast<Word>(element.value));
+  HSTL_ASSERT(element.entry != nullptr);
+}
+
+void hustle::add_local_word(VM& vm, LocalWord kind, const char* name) {
+  auto& element = vm.local_words_[kind];
+  element.kind = SuperInstruction::Element::WORD;
+  element.value = Cell::from_raw(vm.lookup_symbol(name));
+  element.entry = primitive_entry(cast<Word>(element.value));
+  HSTL_ASSERT(element.entry != nullptr);
+}
+
+void hustle::add_inline_word(VM& vm, Opcode op, const char* name) {
+  SuperInstruction::Element element;
+  element.kind = SuperInstruction::Element::WORD;
+  element.value = Cell::from_raw(vm.lookup_symbol(name));
+  element.entry = primitive_entry(cast<Word>(element.value));
+  HSTL_ASSERT(element.entry != nullptr);
+  // Only steps with a known effect end up in a checked run
+  HSTL_ASSERT(cast<Word>(element.value)->definition->effect.known());
+  vm.inline_words_.emplace_back(op, element);
+}
+
+Array* hustle::make_loop_code(VM& vm) {
+  Array* code = vm.allocate<Array>(OPCODE_SIZE[OP_LOOP_COND] +
+                                   OPCODE_SIZE[OP_LOOP_BODY]);
+  (*code)[0] = encode_opcode(OP_LOOP_COND);
+  (*code)[OPCODE_SIZE[OP_LOOP_COND]] = encode_opcode(OP_LOOP_BODY);
+  return code;
+}
+
+Array* hustle::make_restore_code(VM& vm) {
+  Array* code =
+      vm.allocate<Array>(OPCODE_SIZE[OP_RESTORE] + OPCODE_SIZE[OP_RETURN]);
+  (*code)[0] = encode_opcode(OP_RESTORE);
+  (*code)[OPCODE_SIZE[OP_RESTORE]] = encode_opcode(OP_RETURN);
+  return code;
+}
+
+static bool matches(const SuperInstruction::Element& element, Cell cell) {
+  switch (element.kind) {
+  case SuperInstruction::Element::WORD:
+    return cell == element.value &&
+           primitive_entry(cast<Word>(cell)) == element.entry;
+  case SuperInstruction::Element::LITERAL:
+    return cell == element.value;
+  case SuperInstruction::Element::ANY:
+    return !cell.is_a<Word>();
+  }
+  return false;
+}
+
+const SuperInstruction* hustle::match_superinstruction(VM& vm,
+                                                      const Cell* begin,
+                                                      const Cell* end) {
+  for (const auto& super : vm.superinstructions_) {
+    const auto& pattern = super.pattern;
+    if ((size_t)(end - begin) < pattern.size()) {
+      continue;
+    }
+    if (std::equal(pattern.begin(), pattern.end(), begin, matches)) {
+      return &super;
+    }
+  }
+  return nullptr;
+}
+
+/// Check if cell is a word which is still bound to the given control primitive
+static bool is_control_word(VM& vm, ControlWord kind, Cell cell) {
+  return matches(vm.control_words_[kind], cell);
+}
+
+LocalWord hustle::match_local_word(VM& vm, const Cell* it, const Cell* end) {
+  if (end - it < 2 || !it[0].is_a<intptr_t>() || cast<intptr_t>(it[0]) < 0) {
+    return LOCAL_MAX;
+  }
+  for (int kind = 0; kind < LOCAL_MAX; ++kind) {
+    if (matches(vm.local_words_[kind], it[1])) {
+      return (LocalWord)kind;
+    }
+  }
+  return LOCAL_MAX;
+}
+
+/// Instruction for each LocalWord
+constexpr Opcode LOCAL_OPCODE[] = {OP_LOCAL_GET, OP_LOCAL_SET, OP_ENTER_LOCALS,
+                                   OP_LEAVE_LOCALS};
+
+Opcode hustle::inline_opcode(VM& vm, Cell cell) {
+  for (const auto& [op, element] : vm.inline_words_) {
+    if (matches(element, cell)) {
+      return op;
+    }
+  }
+  return OP_MAX;
+}
+
+namespace {
+/// Control flow on quotation literals, which is lowered to branches and jumps
+enum ControlPattern { PATTERN_NONE, PATTERN_IF, PATTERN_LOOP, PATTERN_CALL };
+
+/// Number of cells matched by each ControlPattern
+constexpr size_t PATTERN_LENGTH[] = {0, 4, 3, 2};
+
+/// A group of cells which is lowered together
+struct Step {
+  ControlPattern control = PATTERN_NONE;
+  LocalWord local = LOCAL_MAX;
+  const SuperInstruction* super = nullptr;
+  size_t length = 1;
+};
+
+/// Counts the number of cells needed for an instruction stream
+struct SizeEmitter {
+  void operator()(Opcode op, std::initializer_list<Cell>) {
+    size += OPCODE_SIZE[op];
+  }
+  intptr_t offset() const { return size; }
+  size_t size = 0;
+};
+
+/// Writes an instruction stream
+struct CodeEmitter {
+  void operator()(Opcode op, std::initializer_list<Cell> operands) {
+    HSTL_ASSERT(operands.size() + 1 == OPCODE_SIZE[op]);
+    *out++ = encode_opcode(op);
+    out = std::copy(operands.begin(), operands.end(), out);
+  }
+  intptr_t offset() const { return out - begin; }
+  Cell* begin;
+  Cell* out;
+};
+} // namespace
+
+/**
+ * Match control flow with quotation literals starting at it.
+ *
+ * Handles "{ a } { b } ? call", "{ cond } { body } while" and "{ a } call".
+ */
+static ControlPattern match_control(VM& vm, const Cell* it, const Cell* end) {
+  auto remaining = end - it;
+  if (remaining >= 4 && it[0].is_a<Quotation>() && it[1].is_a<Quotation>() &&
+      is_control_word(vm, CONTROL_TERNARY, it[2]) &&
+      is_control_word(vm, CONTROL_CALL, it[3])) {
+    return PATTERN_IF;
+  }
+  if (remaining >= 3 && it[0].is_a<Quotation>() && it[1].is_a<Quotation>() &&
+      is_control_word(vm, CONTROL_WHILE, it[2])) {
+    return PATTERN_LOOP;
+  }
+  if (remaining >= 2 && it[0].is_a<Quotation>() &&
+      is_control_word(vm, CONTROL_CALL, it[1])) {
+    return PATTERN_CALL;
+  }
+  return PATTERN_NONE;
+}
+
+/// Find the group of cells starting at it
+static Step next_step(VM& vm, const Cell* it, const Cell* end) {
+  Step step;
+  step.control = match_control(vm, it, end);
+  if (step.control != PATTERN_NONE) {
+    step.length = PATTERN_LENGTH[step.control];
+  } else if ((step.local = match_local_word(vm, it, end)) != LOCAL_MAX) {
+    step.length = 2;
+  } else if ((step.super = match_superinstruction(vm, it, end))) {
+    step.length = step.super->pattern.size();
+  }
+  return step;
+}
+
+/// Number of literals pushed before a superinstruction is called
+static int32_t count_pushes(const SuperInstruction& super) {
+  return std::count_if(
+      super.pattern.begin(), super.pattern.end(),
+      [](const auto& e) { return e.kind == SuperInstruction::Element::ANY; });
+}
+
+/// Limit on how deeply nested quotation literals are followed
+static constexpr int MAX_INFER_DEPTH = 8;
+
+static StackEffect quote_effect(VM& vm, Quotation* quote, int depth);
+
+/// Effect of calling word, if it is resolved when code is lowered
+static StackEffect word_effect(Word* word) {
+  Quotation* definition = word->definition;
+  if (definition == nullptr || definition->entry == nullptr) {
+    return {};
+  }
+  return definition->effect;
+}
+
+static StackEffect step_effect(VM& vm, const Step& step, const Cell* it,
+                               int depth) {
+  // Popping the value tested by a branch
+  constexpr StackEffect test = StackEffect::of(1, 0);
+  switch (step.control) {
+  case PATTERN_IF: {
+    StackEffect a = quote_effect(vm, cast<Quotation>(it[0]), depth);
+    StackEffect b = quote_effect(vm, cast<Quotation>(it[1]), depth);
+    // Checking for the larger of the two could reject code which would have
+    // worked, so the branches have to agree
+    if (a.in != b.in || a.out != b.out) {
+      return {};
+    }
+    return test.then({a.in, a.out, std::max(a.growth, b.growth)});
+  }
+  case PATTERN_LOOP: {
+    StackEffect condition =
+        quote_effect(vm, cast<Quotation>(it[0]), depth).then(test);
+    StackEffect iteration =
+        condition.then(quote_effect(vm, cast<Quotation>(it[1]), depth));
+    // Every iteration has to start at the same depth, and the body can't need
+    // more than the condition, since it might never run
+    if (!iteration.known() || condition.net() != 0 || iteration.net() != 0 ||
+        iteration.in != condition.in) {
+      return {};
+    }
+    return iteration;
+  }
+  case PATTERN_CALL:
+    return quote_effect(vm, cast<Quotation>(it[0]), depth);
+  case PATTERN_NONE:
+    break;
+  }
+
+  switch (step.local) {
+  case LOCAL_GET:
+    return StackEffect::of(0, 1);
+  case LOCAL_SET:
+    return StackEffect::of(1, 0);
+  case LOCAL_ENTER:
+    return StackEffect::of(cast<intptr_t>(it[0]), 0);
+  case LOCAL_LEAVE:
+    return StackEffect::of(0, 0);
+  case LOCAL_MAX:
+    break;
+  }
+  if (step.super != nullptr) {
+    return StackEffect::of(0, count_pushes(*step.super))
+        .then(word_effect(step.super->word));
+  }
+  if (it->is_a<Word>()) {
+    return word_effect(cast<Word>(*it));
+  }
+  return StackEffect::of(0, 1);
+}
+
+static StackEffect quote_effect(VM& vm, Quotation* quote, int depth) {
+  if (quote->definition == nullptr) {
+    return quote->effect;
+  }
+  // Definitions can be made to contain themselves
+  if (depth >= MAX_INFER_DEPTH) {
+    return {};
+  }
+  StackEffect effect = StackEffect::of(0, 0);
+  const Cell* end = quote->definition->end();
+  for (const Cell* it = quote->definition->begin();
+       it != end && effect.known();) {
+    Step step = next_step(vm, it, end);
+    effect = effect.then(step_effect(vm, step, it, depth + 1));
+    it += step.length;
+  }
+  return effect;
+}
+
+StackEffect hustle::infer_effect(VM& vm, Quotation* quote) {
+  return quote_effect(vm, quote, 0);
+}
+
+/// Check if lowering step in a checked run saves any checks
+static bool step_skips_checks(VM& vm, const Step& step, const Cell* it) {
+  if (step.control != PATTERN_NONE) {
+    return false;
+  }
+  if (step.local != LOCAL_MAX) {
+    // Their instructions rely on the check
+    return true;
+  }
+  if (step.super != nullptr) {
+    return count_pushes(*step.super) != 0;
+  }
+  return !it->is_a<Word>() || inline_opcode(vm, *it) != OP_MAX;
+}
+
+namespace {
+/// Steps which are lowered after a single OP_CHECK_STACK
+struct CheckedRun {
+  const Cell* end;
+  StackEffect effect = StackEffect::of(0, 0);
+  /// Set if checking the run up front makes any other checks unnecessary
+  bool skips_checks = false;
+};
+} // namespace
+
+/// Find the longest run of steps starting at begin with a known stack effect
+static CheckedRun find_checked_run(VM& vm, const Cell* begin,
+                                   const Cell* end) {
+  CheckedRun run{begin};
+  for (const Cell* it = begin; it != end;) {
+    Step step = next_step(vm, it, end);
+    StackEffect effect = run.effect.then(step_effect(vm, step, it, 0));
+    if (!effect.known()) {
+      break;
+    }
+    run.effect = effect;
+    run.skips_checks |= step_skips_checks(vm, step, it);
+    it += step.length;
+    run.end = it;
+  }
+  return run;
+}
+
+template <typename Emitter>
+static void emit_push(Emitter& emit, Cell cell, bool checked) {
+  if (cell.is_a<Wrapper>()) {
+    cell = cast<Wrapper>(cell)->wrapped;
+  }
+  emit(checked ? OP_PUSH_UNCHECKED : OP_PUSH, {cell});
+}
+
+/// Lower control flow with quotation literals starting at it
+template <typename Emitter>
+static void lower_control(ControlPattern pattern, const Cell* it, bool is_tail,
+                          Emitter& emit) {
+  switch (pattern) {
+  case PATTERN_IF: {
+    const Opcode call = is_tail ? OP_TAIL_CALL_ANON : OP_CALL_ANON;
+    const intptr_t start = emit.offset();
+    // A tail call never falls through, so there is nothing to jump over
+    const intptr_t else_branch = start + OPCODE_SIZE[OP_BRANCH_FALSE] +
+                                 OPCODE_SIZE[call] +
+                                 (is_tail ? 0 : OPCODE_SIZE[OP_JUMP]);
+    const intptr_t done = else_branch + OPCODE_SIZE[call];
+    emit(OP_BRANCH_FALSE, {Cell::from_int(else_branch)});
+    emit(call, {it[0]});
+    if (!is_tail) {
+      emit(OP_JUMP, {Cell::from_int(done)});
+    }
+    emit(call, {it[1]});
+    break;
+  }
+  case PATTERN_LOOP: {
+    const intptr_t start = emit.offset();
+    const intptr_t done =
+        start + 2 * OPCODE_SIZE[OP_CALL_ANON] + OPCODE_SIZE[OP_BRANCH_FALSE] +
+        OPCODE_SIZE[OP_JUMP];
+    emit(OP_CALL_ANON, {it[0]});
+    emit(OP_BRANCH_FALSE, {Cell::from_int(done)});
+    emit(OP_CALL_ANON, {it[1]});
+    emit(OP_JUMP, {Cell::from_int(start)});
+    break;
+  }
+  case PATTERN_CALL:
+    emit(is_tail ? OP_TAIL_CALL_ANON : OP_CALL_ANON, {it[0]});
+    break;
+  case PATTERN_NONE:
+    HSTL_ASSERT(false);
+  }
+}
+
+/// Number of instructions emitted for the steps between begin and end
+static size_t count_instructions(VM& vm, const Cell* begin, const Cell* end) {
+  size_t count = 0;
+  for (const Cell* it = begin; it != end;) {
+    Step step = next_step(vm, it, end);
+    if (step.super != nullptr) {
+      count += count_pushes(*step.super) + 1;
+    } else {
+      count += step.local != LOCAL_MAX ? 1 : step.length;
+    }
+    it += step.length;
+  }
+  return count;
+}
+
+/**
+ * Lower the straight line run starting at it through the IR, if that gives
+ * fewer instructions than lowering it step by step.
+ *
+ * \returns the end of the lowered run, or it if nothing was lowered
+ */
+template <typename Emitter>
+static const Cell* lower_through_ir(VM& vm, const Cell* it, const Cell* end,
+                                    Emitter& emit) {
+  IRFunction ir;
+  const Cell* run_end = build_ir(vm, it, end, ir);
+  if (run_end - it < 2) {
+    return it;
+  }
+  optimize_ir(ir);
+  std::vector<IRLowered> code;
+  StackEffect effect;
+  if (!lower_ir(vm, ir, code, effect) ||
+      code.size() >= count_instructions(vm, it, run_end)) {
+    return it;
+  }
+
+  emit(OP_CHECK_STACK,
+       {Cell::from_int(effect.in), Cell::from_int(effect.growth)});
+  for (const IRLowered& instruction : code) {
+    const auto& operands = instruction.operands;
+    switch (OPCODE_SIZE[instruction.op]) {
+    case 1:
+      emit(instruction.op, {});
+      break;
+    case 2:
+      emit(instruction.op, {operands[0]});
+      break;
+    case 3:
+      emit(instruction.op, {operands[0], operands[1]});
+      break;
+    case 4:
+      emit(instruction.op, {operands[0], operands[1], operands[2]});
+      break;
+    default:
+      HSTL_ASSERT(false);
+    }
+  }
+  return run_end;
+}
+
+/// Lower a definition, passing each instruction to emit
+template <typename Emitter>
+static void lower(VM& vm, Array* definition, Emitter& emit) {
+  const Cell* end = definition->end();
+  CheckedRun run{definition->begin()};
+  for (const Cell* it = definition->begin(); it != end;) {
+    if (it >= run.end) {
+      const Cell* lowered = lower_through_ir(vm, it, end, emit);
+      if (lowered != it) {
+        it = lowered;
+        continue;
+      }
+      run = find_checked_run(vm, it, end);
+      if (run.skips_checks) {
+        emit(OP_CHECK_STACK, {Cell::from_int(run.effect.in),
+                              Cell::from_int(run.effect.growth)});
+      }
+    }
+    const bool checked = run.skips_checks;
+
+    Step step = next_step(vm, it, end);
+    // A call in the last position doesn't need to come back to us
+    const bool is_tail = (it + step.length == end);
+    if (step.control != PATTERN_NONE) {
+      lower_control(step.control, it, is_tail, emit);
+    } else if (step.local != LOCAL_MAX) {
+      HSTL_ASSERT(checked);
+      emit(LOCAL_OPCODE[step.local], {it[0]});
+    } else if (step.super != nullptr) {
+      for (size_t i = 0; i < step.length; ++i) {
+        if (step.super->pattern[i].kind == SuperInstruction::Element::ANY) {
+          emit_push(emit, it[i], checked);
+        }
+      }
+      emit_primitive_call(emit, step.super->word, is_tail);
+    } else if (is_control_word(vm, CONTROL_CALL, *it)) {
+      emit(is_tail ? OP_TAIL_CALL_DYNAMIC : OP_CALL_DYNAMIC, {});
+    } else if (is_control_word(vm, CONTROL_DIP, *it)) {
+      emit(OP_DIP, {});
+      emit(OP_RESTORE, {});
+    } else if (is_control_word(vm, CONTROL_WHILE, *it)) {
+      emit(OP_WHILE, {});
+    } else if (it->is_a<Word>()) {
+      Word* word = cast<Word>(*it);
+      Opcode op = checked ? inline_opcode(vm, *it) : OP_MAX;
+      if (op != OP_MAX) {
+        emit(op, {});
+      } else if (primitive_entry(word) != nullptr) {
+        emit_primitive_call(emit, word, is_tail);
+      } else {
+        emit(is_tail ? OP_TAIL_CALL : OP_CALL,
+             {*it, Cell::from_int(0), Cell::from_int(0)});
+      }
+    } else {
+      emit_push(emit, *it, checked);
+    }
+    it += step.length;
+  }
+  emit(OP_RETURN, {});
+}
+
+Array* hustle::compile_quotation(VM& vm, Quotation* quote_raw) {
+  auto quote = vm.make_handle<Quotation>(quote_raw);
+
+  if (vm.sequence_stats_ != nullptr) {
+    vm.sequence_stats_->record(quote->definition);
+  }
+
+  SizeEmitter sizer;
+  lower(vm, quote->definition, sizer);
+
+  Array* code = vm.allocate<Array>(sizer.size);
+  CodeEmitter writer{code->begin(), code->begin()};
+  lower(vm, quote->definition, writer);
+  HSTL_ASSERT(writer.out == code->end());
+
+  quote->code = code;
+  vm.heap_.write_barrier(quote);
+  quote->code_epoch = Cell::from_int(vm.code_epoch_);
+  return code;
+}
+
+static std::string sequence_name(Cell cell) {
+  if (cell.is_a<Word>()) {
+    return std::string(*cast<Word>(cell)->name);
+  }
+  if (cell.is_a<intptr_t>()) {
+    return std::to_string(cast<intptr_t>(cell));
+  }
+  return "_";
+}
+
+void SequenceStats::record(Array* definition) {
+  std::vector<std::string> names;
+  for (Cell cell : *definition) {
+    names.push_back(sequence_name(cell));
+  }
+
+  for (size_t length = 2; length <= 3; ++length) {
+    for (size_t i = 0; i + length <= names.size(); ++i) {
+      bool has_word = false;
+      std::string key;
+      for (size_t j = i; j < i + length; ++j) {
+        has_word |= (*definition)[j].is_a<Word>();
+        key += (j == i) ? "" : " ";
+        key += names[j];
+      }
+      // Sequences of plain literals can't be fused
+      if (has_word) {
+        ++counts_[length - 2][key];
+      }
+    }
+  }
+}
+
+void SequenceStats::dump(std::ostream& os, size_t max_entries) const {
+  const char* titles[] = {"pairs", "triples"};
+  for (size_t i = 0; i < 2; ++i) {
+    std::vector<std::pair<std::string, uint64_t>> sorted(counts_[i].begin(),
+                                                         counts_[i].end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+      return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    if (sorted.size() > max_entries) {
+      sorted.resize(max_entries);
+    }
+
+    fmt::print(os, "Most common {}:\n", titles[i]);
+    for (const auto& [sequence, count] : sorted) {
+      fmt::print(os, "{:>10} {}\n", count, sequence);
+    }
+  }
+}
@@ -0,0 +1,609 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "hustle/VM/IR.hpp"
+#include "hustle/Object.hpp"
+#include "hustle/VM.hpp"
+
+#include <algorithm>
+#include <fmt/ostream.h>
+#include <map>
+#include <ostream>
+#include <tuple>
+
+using namespace hustle;
+
+/// Most times the optimizations are repeated over one run
+static constexpr unsigned MAX_ROUNDS = 8;
+
+static Quotation::FuncType primitive_entry(Cell cell) {
+  Quotation* definition = cast<Word>(cell)->definition;
+  return definition == nullptr ? nullptr : definition->entry;
+}
+
+/// Check if cell is the word in element, still bound to its primitive
+static bool matches(const SuperInstruction::Element& element, Cell cell) {
+  return cell == element.value && primitive_entry(cell) == element.entry;
+}
+
+void hustle::add_shuffle_word(VM& vm, const char* name,
+                              std::initializer_list<uint8_t> out) {
+  ShuffleWord shuffle;
+  shuffle.word.kind = SuperInstruction::Element::WORD;
+  shuffle.word.value = Cell::from_raw(vm.lookup_symbol(name));
+  shuffle.word.entry = primitive_entry(shuffle.word.value);
+  HSTL_ASSERT(shuffle.word.entry != nullptr);
+  StackEffect effect = cast<Word>(shuffle.word.value)->definition->effect;
+  HSTL_ASSERT(effect.known() && (size_t)effect.out == out.size());
+  shuffle.in = effect.in;
+  shuffle.out = out;
+  HSTL_ASSERT(std::all_of(out.begin(), out.end(),
+                          [&](uint8_t i) { return i < shuffle.in; }));
+  vm.shuffle_words_.push_back(std::move(shuffle));
+}
+
+namespace {
+/// The stack while a run is translated. Inputs are created as they are reached.
+class ValueStack {
+public:
+  explicit ValueStack(IRFunction& ir) : ir_(ir) {}
+
+  IRValue pop() {
+    if (values_.empty()) {
+      IRInstruction input{IR_INPUT};
+      input.cell = Cell::from_int(ir_.inputs++);
+      return add(std::move(input), 1)[0];
+    }
+    IRValue value = values_.back();
+    values_.pop_back();
+    return value;
+  }
+
+  /// Pop count values, deepest first
+  std::vector<IRValue> pop(size_t count) {
+    std::vector<IRValue> values(count);
+    for (size_t i = count; i > 0; --i) {
+      values[i - 1] = pop();
+    }
+    return values;
+  }
+
+  void push(IRValue value) { values_.push_back(value); }
+
+  /// Append an instruction defining result_count values, and return them
+  const std::vector<IRValue>& add(IRInstruction instruction,
+                                  size_t result_count) {
+    for (size_t i = 0; i < result_count; ++i) {
+      instruction.results.push_back(ir_.value_count++);
+    }
+    // Inputs are only reached by popping everything above them, so they can
+    // go anywhere in the list
+    ir_.instructions.push_back(std::move(instruction));
+    return ir_.instructions.back().results;
+  }
+
+  /// Append an instruction, taking its operands and pushing its results
+  void apply(IRInstruction instruction, size_t in, size_t out) {
+    instruction.operands = pop(in);
+    for (IRValue value : add(std::move(instruction), out)) {
+      push(value);
+    }
+  }
+
+  const std::vector<IRValue>& values() const { return values_; }
+
+private:
+  IRFunction& ir_;
+  /// Deepest first
+  std::vector<IRValue> values_;
+};
+} // namespace
+
+/// Instruction for an arithmetic word, or IR_CALL if it isn't one
+static IROp arithmetic_op(VM& vm, Cell cell) {
+  for (const auto& [op, element] : vm.inline_words_) {
+    if (!matches(element, cell)) {
+      continue;
+    }
+    switch (op) {
+    case OP_ADD:
+      return IR_ADD;
+    case OP_SUB:
+      return IR_SUB;
+    case OP_LT:
+      return IR_LT;
+    case OP_GT:
+      return IR_GT;
+    default:
+      break;
+    }
+  }
+  return IR_CALL;
+}
+
+const Cell* hustle::build_ir(VM& vm, const Cell* begin, const Cell* end,
+                             IRFunction& ir) {
+  ValueStack stack(ir);
+  const Cell* it = begin;
+  for (; it != end; ++it) {
+    Cell cell = *it;
+    LocalWord local = match_local_word(vm, it, end);
+    if (local == LOCAL_ENTER || local == LOCAL_LEAVE) {
+      // Lowered on their own
+      break;
+    }
+    if (local == LOCAL_GET || local == LOCAL_SET) {
+      const bool is_get = local == LOCAL_GET;
+      IRInstruction access{is_get ? IR_LOCAL_GET : IR_LOCAL_SET};
+      access.cell = *it++;
+      access.is_pure = is_get;
+      stack.apply(std::move(access), is_get ? 0 : 1, is_get ? 1 : 0);
+      continue;
+    }
+    if (!cell.is_a<Word>()) {
+      // Quotation literals are usually control flow, which is lowered on its
+      // own
+      if (cell.is_a<Quotation>()) {
+        break;
+      }
+      if (cell.is_a<Wrapper>()) {
+        cell = cast<Wrapper>(cell)->wrapped;
+      }
+      IRInstruction constant{IR_CONST};
+      constant.cell = cell;
+      constant.is_pure = true;
+      stack.apply(std::move(constant), 0, 1);
+      continue;
+    }
+
+    auto shuffle = std::find_if(
+        vm.shuffle_words_.begin(), vm.shuffle_words_.end(),
+        [&](const ShuffleWord& shuffle) { return matches(shuffle.word, cell); });
+    if (shuffle != vm.shuffle_words_.end()) {
+      std::vector<IRValue> inputs = stack.pop(shuffle->in);
+      for (uint8_t index : shuffle->out) {
+        stack.push(inputs[index]);
+      }
+      continue;
+    }
+
+    Quotation* definition = cast<Word>(cell)->definition;
+    if (definition == nullptr || definition->entry == nullptr ||
+        !definition->is_leaf || !definition->effect.known()) {
+      break;
+    }
+    IRInstruction instruction{arithmetic_op(vm, cell)};
+    instruction.cell = cell;
+    instruction.is_pure = definition->is_pure;
+    instruction.checks_tags = instruction.op != IR_CALL;
+    stack.apply(std::move(instruction), definition->effect.in,
+                definition->effect.out);
+  }
+
+  // Inputs which were never reached are left alone
+  ir.outputs = stack.values();
+  return it;
+}
+
+/// Replace uses of values with their entry in replacement
+static void replace_values(IRFunction& ir,
+                           const std::vector<IRValue>& replacement) {
+  for (IRInstruction& instruction : ir.instructions) {
+    for (IRValue& value : instruction.operands) {
+      value = replacement[value];
+    }
+  }
+  for (IRValue& value : ir.outputs) {
+    value = replacement[value];
+  }
+}
+
+bool hustle::number_values(IRFunction& ir) {
+  using Key = std::tuple<IROp, std::vector<IRValue>, cell_t>;
+  // Results of the first instruction with each key
+  std::map<Key, std::vector<IRValue>> seen;
+  std::vector<IRValue> replacement(ir.value_count);
+  for (IRValue i = 0; i < ir.value_count; ++i) {
+    replacement[i] = i;
+  }
+
+  std::vector<IRInstruction> kept;
+  kept.reserve(ir.instructions.size());
+  bool changed = false;
+  for (IRInstruction& instruction : ir.instructions) {
+    for (IRValue& value : instruction.operands) {
+      value = replacement[value];
+    }
+    if (instruction.op == IR_LOCAL_SET) {
+      // Later reads see the new value
+      seen.erase(Key{IR_LOCAL_GET, {}, instruction.cell.raw()});
+    }
+    if (!instruction.is_pure) {
+      kept.push_back(std::move(instruction));
+      continue;
+    }
+    std::vector<IRValue> operands = instruction.operands;
+    if (instruction.op == IR_ADD) {
+      std::sort(operands.begin(), operands.end());
+    }
+    Key key{instruction.op, std::move(operands), instruction.cell.raw()};
+    auto [it, inserted] = seen.emplace(std::move(key), instruction.results);
+    if (!inserted) {
+      for (size_t i = 0; i < instruction.results.size(); ++i) {
+        replacement[instruction.results[i]] = it->second[i];
+      }
+      changed = true;
+      continue;
+    }
+    kept.push_back(std::move(instruction));
+  }
+  ir.instructions = std::move(kept);
+  if (changed) {
+    replace_values(ir, replacement);
+  }
+  return changed;
+}
+
+bool hustle::eliminate_dead_code(IRFunction& ir) {
+  std::vector<bool> live(ir.value_count);
+  for (IRValue value : ir.outputs) {
+    live[value] = true;
+  }
+  bool changed = false;
+  for (size_t i = ir.instructions.size(); i > 0; --i) {
+    IRInstruction& instruction = ir.instructions[i - 1];
+    bool needed = !instruction.is_pure || instruction.op == IR_INPUT ||
+                  std::any_of(instruction.results.begin(),
+                              instruction.results.end(),
+                              [&](IRValue value) { return live[value]; });
+    if (!needed) {
+      ir.instructions.erase(ir.instructions.begin() + (i - 1));
+      changed = true;
+      continue;
+    }
+    for (IRValue value : instruction.operands) {
+      live[value] = true;
+    }
+  }
+  return changed;
+}
+
+bool hustle::eliminate_tag_checks(IRFunction& ir) {
+  std::vector<bool> fixnum(ir.value_count);
+  bool changed = false;
+  for (IRInstruction& instruction : ir.instructions) {
+    switch (instruction.op) {
+    case IR_CONST:
+      fixnum[instruction.results[0]] = instruction.cell.is_a<intptr_t>();
+      break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_LT:
+    case IR_GT: {
+      bool known = std::all_of(instruction.operands.begin(),
+                               instruction.operands.end(),
+                               [&](IRValue value) { return fixnum[value]; });
+      if (known && instruction.checks_tags) {
+        instruction.checks_tags = false;
+        changed = true;
+      }
+      // Past here the operands have been checked
+      for (IRValue value : instruction.operands) {
+        fixnum[value] = true;
+      }
+      if (instruction.op == IR_ADD || instruction.op == IR_SUB) {
+        fixnum[instruction.results[0]] = true;
+      }
+      break;
+    }
+    case IR_INPUT:
+    case IR_CALL:
+    case IR_LOCAL_GET:
+    case IR_LOCAL_SET:
+      break;
+    }
+  }
+  return changed;
+}
+
+void hustle::optimize_ir(IRFunction& ir) {
+  for (unsigned round = 0; round < MAX_ROUNDS; ++round) {
+    bool changed = number_values(ir);
+    changed |= eliminate_dead_code(ir);
+    changed |= eliminate_tag_checks(ir);
+    if (!changed) {
+      break;
+    }
+  }
+}
+
+namespace {
+/// Tracks which value is in each stack slot while the IR is lowered
+class Scheduler {
+public:
+  Scheduler(const IRFunction& ir, std::vector<IRLowered>& code)
+      : code_(code), stack_(ir.inputs), uses_(ir.value_count) {
+    for (const IRInstruction& instruction : ir.instructions) {
+      if (instruction.op == IR_INPUT) {
+        intptr_t depth = cast<intptr_t>(instruction.cell);
+        stack_[ir.inputs - 1 - depth] = instruction.results[0];
+      }
+      for (IRValue value : instruction.operands) {
+        ++uses_[value];
+      }
+    }
+    for (IRValue value : ir.outputs) {
+      ++uses_[value];
+    }
+    highest_ = stack_.size();
+  }
+
+  void emit(Opcode op, std::initializer_list<Cell> operands = {}) {
+    IRLowered lowered{op};
+    std::copy(operands.begin(), operands.end(), lowered.operands.begin());
+    code_.push_back(lowered);
+  }
+
+  void push(IRValue value) {
+    stack_.push_back(value);
+    highest_ = std::max(highest_, stack_.size());
+  }
+
+  /// Put the operands of instruction on top of the stack, in order
+  bool gather(const std::vector<IRValue>& operands);
+
+  /// Remove the operands of an instruction from the top of the stack
+  void consume(const std::vector<IRValue>& operands) {
+    for (IRValue value : operands) {
+      --uses_[value];
+    }
+    stack_.resize(stack_.size() - operands.size());
+  }
+
+  /// Replace the stack with outputs
+  bool finish(const std::vector<IRValue>& outputs);
+
+  size_t highest() const { return highest_; }
+
+private:
+  /// Check if the top count slots can be taken by operands
+  bool can_take(size_t count, const std::vector<IRValue>& operands) const;
+
+  /// Emit an OP_SHUFFLE of the top in slots, leaving values
+  bool shuffle(size_t in, const std::vector<IRValue>& values);
+
+  std::vector<IRLowered>& code_;
+  /// Deepest first
+  std::vector<IRValue> stack_;
+  /// Remaining uses of each value
+  std::vector<uint32_t> uses_;
+  size_t highest_;
+};
+} // namespace
+
+bool Scheduler::can_take(size_t count,
+                         const std::vector<IRValue>& operands) const {
+  auto top = stack_.end() - count;
+  return std::all_of(top, stack_.end(), [&](IRValue value) {
+    size_t used = std::count(operands.begin(), operands.end(), value);
+    // Fine if nothing else needs it, or a copy is left below
+    return uses_[value] == used ||
+           std::find(stack_.begin(), top, value) != top;
+  });
+}
+
+bool Scheduler::shuffle(size_t in, const std::vector<IRValue>& values) {
+  if (in > MAX_SHUFFLE || values.size() > MAX_SHUFFLE) {
+    return false;
+  }
+  const size_t base = stack_.size() - in;
+  intptr_t map = 0;
+  for (size_t i = 0; i < values.size(); ++i) {
+    auto slot = std::find(stack_.begin() + base, stack_.end(), values[i]);
+    HSTL_ASSERT(slot != stack_.end());
+    map |= (intptr_t)(slot - stack_.begin() - base)
+           << (i * SHUFFLE_INDEX_BITS);
+  }
+  emit(OP_SHUFFLE, {Cell::from_int(in), Cell::from_int(values.size()),
+                    Cell::from_int(map)});
+  stack_.resize(base);
+  for (IRValue value : values) {
+    push(value);
+  }
+  return true;
+}
+
+bool Scheduler::gather(const std::vector<IRValue>& operands) {
+  const size_t count = operands.size();
+
+  // Operands which are already in place at the bottom of the list
+  size_t in_place = std::min(count, stack_.size());
+  while (in_place > 0 &&
+         !(std::equal(operands.begin(), operands.begin() + in_place,
+                       stack_.end() - in_place) &&
+           can_take(in_place, operands))) {
+    --in_place;
+  }
+  if (in_place == count) {
+    return true;
+  }
+
+  // Operands which are on top, but out of order
+  if (stack_.size() >= count &&
+      std::is_permutation(stack_.end() - count, stack_.end(),
+                          operands.begin()) &&
+      can_take(count, operands)) {
+    if (count == 2) {
+      emit(OP_SWAP);
+      std::swap(stack_[stack_.size() - 1], stack_[stack_.size() - 2]);
+      return true;
+    }
+    return shuffle(count, operands);
+  }
+
+  for (size_t i = in_place; i < count; ++i) {
+    auto slot = std::find(stack_.rbegin(), stack_.rend(), operands[i]);
+    HSTL_ASSERT(slot != stack_.rend());
+    size_t depth = slot - stack_.rbegin();
+    if (depth == 0) {
+      emit(OP_DUP);
+    } else if (depth == 1) {
+      emit(OP_OVER);
+    } else {
+      emit(OP_PICK, {Cell::from_int(depth)});
+    }
+    push(operands[i]);
+  }
+  return true;
+}
+
+bool Scheduler::finish(const std::vector<IRValue>& outputs) {
+  // Cells at the bottom which are already where they belong are left alone
+  size_t kept = 0;
+  while (kept < stack_.size() && kept < outputs.size() &&
+         stack_[kept] == outputs[kept]) {
+    ++kept;
+  }
+  const size_t in = stack_.size() - kept;
+  std::vector<IRValue> rest(outputs.begin() + kept, outputs.end());
+  if (in == 0 && rest.empty()) {
+    return true;
+  }
+  if (in == rest.size() + 1 &&
+      std::equal(rest.begin(), rest.end(), stack_.begin() + kept)) {
+    emit(OP_DROP);
+    stack_.pop_back();
+    return true;
+  }
+  if (in == 2 && rest.size() == 2 && rest[0] == stack_.back() &&
+      rest[1] == stack_[kept]) {
+    emit(OP_SWAP);
+    std::swap(stack_[kept], stack_[kept + 1]);
+    return true;
+  }
+  return shuffle(in, rest);
+}
+
+bool hustle::lower_ir(VM& vm, const IRFunction& ir,
+                      std::vector<IRLowered>& code, StackEffect& effect) {
+  Scheduler scheduler(ir, code);
+  for (const IRInstruction& instruction : ir.instructions) {
+    switch (instruction.op) {
+    case IR_INPUT:
+      continue;
+    case IR_CONST:
+      scheduler.emit(OP_PUSH_UNCHECKED, {instruction.cell});
+      scheduler.push(instruction.results[0]);
+      continue;
+    default:
+      break;
+    }
+
+    if (!scheduler.gather(instruction.operands)) {
+      return false;
+    }
+    const bool checked = instruction.checks_tags;
+    switch (instruction.op) {
+    case IR_ADD:
+      scheduler.emit(checked ? OP_ADD : OP_ADD_FIXNUM);
+      break;
+    case IR_SUB:
+      scheduler.emit(checked ? OP_SUB : OP_SUB_FIXNUM);
+      break;
+    case IR_LT:
+      scheduler.emit(checked ? OP_LT : OP_LT_FIXNUM);
+      break;
+    case IR_GT:
+      scheduler.emit(checked ? OP_GT : OP_GT_FIXNUM);
+      break;
+    case IR_CALL:
+      scheduler.emit(OP_CALL_LEAF,
+                     {encode_native(primitive_entry(instruction.cell)),
+                      instruction.cell});
+      break;
+    case IR_LOCAL_GET:
+      scheduler.emit(OP_LOCAL_GET, {instruction.cell});
+      break;
+    case IR_LOCAL_SET:
+      scheduler.emit(OP_LOCAL_SET, {instruction.cell});
+      break;
+    case IR_INPUT:
+    case IR_CONST:
+      HSTL_ASSERT(false);
+    }
+    scheduler.consume(instruction.operands);
+    for (IRValue value : instruction.results) {
+      scheduler.push(value);
+    }
+  }
+  if (!scheduler.finish(ir.outputs)) {
+    return false;
+  }
+
+  effect.in = ir.inputs;
+  effect.out = ir.outputs.size();
+  effect.growth = scheduler.highest() - ir.inputs;
+  return true;
+}
+
+static const char* op_name(IROp op) {
+  switch (op) {
+  case IR_INPUT:
+    return "input";
+  case IR_CONST:
+    return "const";
+  case IR_ADD:
+    return "add";
+  case IR_SUB:
+    return "sub";
+  case IR_LT:
+    return "lt";
+  case IR_GT:
+    return "gt";
+  case IR_CALL:
+    return "call";
+  case IR_LOCAL_GET:
+    return "local@";
+  case IR_LOCAL_SET:
+    return "local!";
+  }
+  return "?";
+}
+
+static std::string describe(Cell cell) {
+  if (cell.is_a<intptr_t>()) {
+    return std::to_string(cast<intptr_t>(cell));
+  }
+  if (cell.is_a<Word>()) {
+    return std::string(*cast<Word>(cell)->name);
+  }
+  return "_";
+}
+
+void hustle::dump_ir(std::ostream& os, const IRFunction& ir) {
+  for (const IRInstruction& instruction : ir.instructions) {
+    for (IRValue value : instruction.results) {
+      fmt::print(os, "v{} ", value);
+    }
+    fmt::print(os, "= {}", op_name(instruction.op));
+    if (instruction.op != IR_ADD && instruction.op != IR_SUB &&
+        instruction.op != IR_LT && instruction.op != IR_GT) {
+      fmt::print(os, " {}", describe(instruction.cell));
+    }
+    for (IRValue value : instruction.operands) {
+      fmt::print(os, " v{}", value);
+    }
+    if (instruction.checks_tags) {
+      os << " (checked)";
+    }
+    os << "\n";
+  }
+  os << "outputs:";
+  for (IRValue value : ir.outputs) {
+    fmt::print(os, " v{}", value);
+  }
+  os << "\n";
+}
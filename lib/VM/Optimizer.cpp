@@ -0,0 +1,544 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "hustle/VM/Optimizer.hpp"
+#include "hustle/Object.hpp"
+#include "hustle/VM.hpp"
+
+#include <algorithm>
+#include <fmt/ostream.h>
+#include <optional>
+#include <ostream>
+#include <unordered_set>
+
+using namespace hustle;
+
+/// Cells other than words push themselves, or what they wrap
+static bool is_literal(Cell cell) { return !cell.is_a<Word>(); }
+
+/// Check if cell calls a word which is still bound to the primitive entry
+static bool is_primitive(Cell cell, Quotation::FuncType entry) {
+  if (!cell.is_a<Word>()) {
+    return false;
+  }
+  Quotation* definition = cast<Word>(cell)->definition;
+  return definition != nullptr && definition->entry == entry;
+}
+
+/// A literal which pushes value, if there is one to hand
+static std::optional<Cell> as_literal(VM& vm, Cell value) {
+  if (value.is_a<intptr_t>()) {
+    return value;
+  }
+  if (value == vm.globals.True || value == vm.globals.False) {
+    // Symbols are defined by a wrapper which pushes the symbol itself
+    return (*cast<Word>(value)->definition->definition)[0];
+  }
+  return std::nullopt;
+}
+
+/// Throw away anything built from the current definition of quote
+static void discard_code(Quotation* quote) {
+  quote->code = nullptr;
+  quote->native_failed = false;
+  if (quote->entry != nullptr) {
+    quote->entry = nullptr;
+    quote->invocations = 0;
+  }
+}
+
+/// Find the word defined by quote, if there is one
+static Word* word_defined_by(Quotation* quote) {
+  Word* word = quote->word;
+  if (word == nullptr || (Quotation*)word->definition != quote) {
+    return nullptr;
+  }
+  return word;
+}
+
+namespace {
+/// Replace calls to short words with their definition
+class Inliner : public OptimizerPass {
+public:
+  const char* name() const override { return "inline"; }
+  bool run(VM& vm, std::vector<Cell>& cells) override;
+
+private:
+  static bool can_inline(VM& vm, Word* word);
+};
+
+/// Replace calls to pure primitives on fixnum literals with their result
+class ConstantFolding : public OptimizerPass {
+public:
+  const char* name() const override { return "constant-folding"; }
+  bool run(VM& vm, std::vector<Cell>& cells) override;
+
+private:
+  /// Run primitive on inputs, returning false if it can't be folded
+  static bool evaluate(VM& vm, Quotation* primitive, const Cell* inputs,
+                       std::vector<Cell>& results);
+};
+
+/// Simplify stack shuffles, and shuffles of literals
+class Peephole : public OptimizerPass {
+public:
+  explicit Peephole(VM& vm);
+  const char* name() const override { return "peephole"; }
+  bool run(VM& vm, std::vector<Cell>& cells) override;
+
+private:
+  Quotation::FuncType dup_, drop_, swap_, over_;
+};
+
+/// Remove literals which are dropped straight away
+class DeadPushes : public OptimizerPass {
+public:
+  explicit DeadPushes(VM& vm);
+  const char* name() const override { return "dead-pushes"; }
+  bool run(VM& vm, std::vector<Cell>& cells) override;
+
+private:
+  Quotation::FuncType drop_;
+};
+} // namespace
+
+static Quotation::FuncType primitive_entry(VM& vm, const char* name) {
+  Quotation* definition =
+      cast<Word>(Cell::from_raw(vm.lookup_symbol(name)))->definition;
+  HSTL_ASSERT(definition->entry != nullptr);
+  return definition->entry;
+}
+
+bool Inliner::can_inline(VM& vm, Word* word) {
+  const Optimizer& optimizer = vm.optimizer_;
+  Quotation* definition = word->definition;
+  Word* defining = optimizer.defining();
+  if (word == defining || word->is_parse_word || definition == nullptr ||
+      definition->definition == nullptr ||
+      definition->definition->count() > Optimizer::INLINE_LIMIT) {
+    return false;
+  }
+  // Recursive calls, and calls back into the word being (re)defined, must
+  // stay calls so they pick up its new definition. Locals belong to the frame
+  // of the word which declares them, so "::" words stay calls too.
+  Array* body = definition->definition;
+  for (const Cell* it = body->begin(); it != body->end(); ++it) {
+    if (*it == Cell(word) || (defining != nullptr && *it == Cell(defining)) ||
+        match_local_word(vm, it, body->end()) != LOCAL_MAX) {
+      return false;
+    }
+  }
+  return defining == nullptr || !optimizer.relies_on(definition, defining);
+}
+
+bool Inliner::run(VM& vm, std::vector<Cell>& cells) {
+  bool changed = false;
+  for (size_t i = 0; i < cells.size();) {
+    if (!cells[i].is_a<Word>() ||
+        !can_inline(vm, cast<Word>(cells[i]))) {
+      ++i;
+      continue;
+    }
+    Word* word = cast<Word>(cells[i]);
+    Array* body = word->definition->definition;
+    vm.optimizer_.depend_on(word);
+    cells.erase(cells.begin() + i);
+    cells.insert(cells.begin() + i, body->begin(), body->end());
+    i += body->count();
+    changed = true;
+  }
+  return changed;
+}
+
+bool ConstantFolding::evaluate(VM& vm, Quotation* primitive,
+                               const Cell* inputs,
+                               std::vector<Cell>& results) {
+  const StackEffect effect = primitive->effect;
+  const size_t depth = vm.stack_.depth();
+  vm.stack_.reserve(std::max(effect.in, effect.out));
+  for (int32_t i = 0; i < effect.in; i++) {
+    vm.push(inputs[i]);
+  }
+
+  bool folded = true;
+  try {
+    primitive->entry(&vm, primitive);
+  } catch (const Exception&) {
+    // Leave it to fail when the word runs
+    folded = false;
+  }
+  folded &= vm.stack_.depth() == depth + effect.out;
+
+  const size_t count = std::max(effect.out, 0);
+  results.resize(count);
+  for (size_t i = 0; i < count && folded; ++i) {
+    std::optional<Cell> literal = as_literal(vm, vm.stack_.top(count - 1 - i));
+    folded &= literal.has_value();
+    if (literal) {
+      results[i] = *literal;
+    }
+  }
+  while (vm.stack_.depth() > depth) {
+    vm.pop();
+  }
+  return folded;
+}
+
+bool ConstantFolding::run(VM& vm, std::vector<Cell>& cells) {
+  bool changed = false;
+  std::vector<Cell> results;
+  for (size_t i = 0; i < cells.size();) {
+    if (!cells[i].is_a<Word>()) {
+      ++i;
+      continue;
+    }
+    // Pure primitives don't allocate, so calling them here is safe
+    Quotation* definition = cast<Word>(cells[i])->definition;
+    if (definition == nullptr || !definition->is_pure ||
+        !definition->effect.known() || i < (size_t)definition->effect.in) {
+      ++i;
+      continue;
+    }
+    const size_t first = i - definition->effect.in;
+    const bool all_fixnums =
+        std::all_of(cells.begin() + first, cells.begin() + i,
+                    [](Cell cell) { return cell.is_a<intptr_t>(); });
+    if (!all_fixnums || !evaluate(vm, definition, &cells[first], results)) {
+      ++i;
+      continue;
+    }
+
+    vm.optimizer_.depend_on(cast<Word>(cells[i]));
+    cells.erase(cells.begin() + first, cells.begin() + i + 1);
+    cells.insert(cells.begin() + first, results.begin(), results.end());
+    i = first + results.size();
+    changed = true;
+  }
+  return changed;
+}
+
+Peephole::Peephole(VM& vm)
+    : dup_(primitive_entry(vm, "dup")), drop_(primitive_entry(vm, "drop")),
+      swap_(primitive_entry(vm, "swap")), over_(primitive_entry(vm, "over")) {}
+
+bool Peephole::run(VM& vm, std::vector<Cell>& cells) {
+  Optimizer& optimizer = vm.optimizer_;
+  bool changed = false;
+  for (size_t i = 0; i + 1 < cells.size();) {
+    Cell a = cells[i];
+    Cell b = cells[i + 1];
+    const bool has_third = i + 2 < cells.size();
+    Cell c = has_third ? cells[i + 2] : Cell::from_int(0);
+
+    if ((is_primitive(a, dup_) && is_primitive(b, drop_)) ||
+        (is_primitive(a, swap_) && is_primitive(b, swap_)) ||
+        (is_primitive(a, over_) && is_primitive(b, drop_))) {
+      // Shuffles which cancel out
+      optimizer.depend_on(cast<Word>(a));
+      optimizer.depend_on(cast<Word>(b));
+      cells.erase(cells.begin() + i, cells.begin() + i + 2);
+    } else if (is_literal(a) && is_primitive(b, dup_)) {
+      // L dup -> L L
+      optimizer.depend_on(cast<Word>(b));
+      cells[i + 1] = a;
+    } else if (has_third && is_literal(a) && is_literal(b) &&
+               is_primitive(c, swap_)) {
+      // L1 L2 swap -> L2 L1
+      optimizer.depend_on(cast<Word>(c));
+      cells[i] = b;
+      cells[i + 1] = a;
+      cells.erase(cells.begin() + i + 2);
+    } else if (has_third && is_literal(a) && is_literal(b) &&
+               is_primitive(c, over_)) {
+      // L1 L2 over -> L1 L2 L1
+      optimizer.depend_on(cast<Word>(c));
+      cells[i + 2] = a;
+    } else {
+      ++i;
+      continue;
+    }
+    // A rewrite can complete a pattern which started earlier
+    i = i >= 2 ? i - 2 : 0;
+    changed = true;
+  }
+  return changed;
+}
+
+DeadPushes::DeadPushes(VM& vm) : drop_(primitive_entry(vm, "drop")) {}
+
+bool DeadPushes::run(VM& vm, std::vector<Cell>& cells) {
+  bool changed = false;
+  for (size_t i = 0; i + 1 < cells.size();) {
+    if (is_literal(cells[i]) && is_primitive(cells[i + 1], drop_)) {
+      vm.optimizer_.depend_on(cast<Word>(cells[i + 1]));
+      cells.erase(cells.begin() + i, cells.begin() + i + 2);
+      i = i >= 1 ? i - 1 : 0;
+      changed = true;
+    } else {
+      ++i;
+    }
+  }
+  return changed;
+}
+
+void hustle::add_default_passes(VM& vm, Optimizer& optimizer) {
+  optimizer.add_pass(std::make_unique<Inliner>());
+  optimizer.add_pass(std::make_unique<ConstantFolding>());
+  optimizer.add_pass(std::make_unique<Peephole>(vm));
+  optimizer.add_pass(std::make_unique<DeadPushes>(vm));
+}
+
+static std::string dump_cells(const Cell* begin, const Cell* end);
+
+/// Describe a cell for optimizer dumps
+static std::string dump_cell(Cell cell) {
+  if (cell.is_a<intptr_t>()) {
+    return std::to_string(cast<intptr_t>(cell));
+  }
+  if (cell.is_a<Word>()) {
+    return std::string(*cast<Word>(cell)->name);
+  }
+  if (cell.is_a<String>()) {
+    return fmt::format("\"{}\"", std::string_view(*cast<String>(cell)));
+  }
+  if (cell.is_a<Wrapper>()) {
+    return "\\ " + dump_cell(cast<Wrapper>(cell)->wrapped);
+  }
+  if (cell.is_a<Array>()) {
+    Array* array = cast<Array>(cell);
+    return "[ " + dump_cells(array->begin(), array->end()) + "]";
+  }
+  if (cell.is_a<Quotation>()) {
+    Array* definition = cast<Quotation>(cell)->definition;
+    if (definition == nullptr) {
+      return "{ <primitive> }";
+    }
+    return "{ " + dump_cells(definition->begin(), definition->end()) + "}";
+  }
+  return "_";
+}
+
+static std::string dump_cells(const Cell* begin, const Cell* end) {
+  std::string result;
+  for (const Cell* it = begin; it != end; ++it) {
+    result += dump_cell(*it) + " ";
+  }
+  return result;
+}
+
+void Optimizer::optimize(VM& vm, Quotation* quote_raw, std::string_view name) {
+  auto quote = vm.make_handle(quote_raw);
+  // When a word is redefined, its old definition must not leak into the new
+  auto existing = vm.symbol_table_.find(std::string(name));
+  if (existing != vm.symbol_table_.end() && is_a<Word>(existing->second)) {
+    defining_ = cast<Word>(existing->second);
+  }
+  optimize(vm, quote, name);
+  defining_ = nullptr;
+}
+
+void Optimizer::optimize(VM& vm, Handle<Quotation>& quote,
+                         std::string_view name) {
+  if (quote->definition == nullptr || quote->source != nullptr) {
+    return;
+  }
+  // Set first, so a quote which contains itself isn't optimized forever
+  quote->source = quote->definition;
+  vm.heap_.write_barrier(quote);
+
+  for (size_t i = 0; i < quote->definition->count(); ++i) {
+    Cell cell = (*quote->definition)[i];
+    if (cell.is_a<Quotation>()) {
+      auto inner = vm.make_handle(cast<Quotation>(cell));
+      optimize(vm, inner, name);
+    }
+  }
+
+  Array* source = quote->source;
+  std::vector<Cell> cells(source->begin(), source->end());
+  std::string applied;
+  current_ = quote;
+  for (unsigned round = 0; round < MAX_ROUNDS; ++round) {
+    bool progress = false;
+    for (const auto& pass : passes_) {
+      if (pass->run(vm, cells)) {
+        progress = true;
+        if (applied.find(pass->name()) == std::string::npos) {
+          applied += applied.empty() ? "" : ", ";
+          applied += pass->name();
+        }
+      }
+    }
+    if (!progress) {
+      break;
+    }
+  }
+  current_ = nullptr;
+
+  if (dump != nullptr) {
+    fmt::print(*dump, "{}:\n  before: {}\n  after:  {}{}\n", name,
+               dump_cells(source->begin(), source->end()),
+               dump_cells(cells.data(), cells.data() + cells.size()),
+               applied.empty() ? "(unchanged)" : "(" + applied + ")");
+  }
+  if (applied.empty()) {
+    return;
+  }
+
+  // The data stack keeps the cells alive while the new definition is
+  // allocated
+  vm.stack_.reserve(cells.size());
+  for (Cell cell : cells) {
+    vm.push(cell);
+  }
+  Array* optimized = vm.allocate<Array>(cells.size());
+  for (size_t i = cells.size(); i-- > 0;) {
+    (*optimized)[i] = vm.pop();
+  }
+  quote->definition = optimized;
+  vm.heap_.write_barrier(quote);
+  discard_code(quote);
+}
+
+void Optimizer::redefined(VM& vm, Word* word) {
+  // Find everything which relied on word, directly or through the words it
+  // defines. Nothing allocates until all of it is found.
+  HSTL_ASSERT(rebuilding_.empty());
+  std::unordered_set<Quotation*> found;
+  std::vector<Word*> pending{word};
+  while (!pending.empty()) {
+    Word* next = pending.back();
+    pending.pop_back();
+    auto [begin, end] = users_.equal_range(next);
+    for (auto it = begin; it != end; ++it) {
+      Quotation* user = it->second;
+      if (!found.insert(user).second) {
+        continue;
+      }
+      rebuilding_.push_back(user);
+      if (Word* user_word = word_defined_by(user)) {
+        pending.push_back(user_word);
+      }
+    }
+  }
+  if (rebuilding_.empty()) {
+    return;
+  }
+
+  for (Cell cell : rebuilding_) {
+    Quotation* user = cast<Quotation>(cell);
+    // Everything the old result relied on is recorded again as it is rebuilt
+    forget_dependencies(user);
+    user->definition = user->source;
+    user->source = nullptr;
+    vm.heap_.write_barrier(user);
+    discard_code(user);
+  }
+
+  // rebuilding_ is a root, so it can be walked while optimizing allocates
+  for (size_t i = 0; i < rebuilding_.size(); ++i) {
+    auto user = vm.make_handle(cast<Quotation>(rebuilding_[i]));
+    Word* user_word = word_defined_by(user);
+    std::string name =
+        user_word != nullptr ? std::string(*user_word->name) : "<quotation>";
+    defining_ = user_word;
+    optimize(vm, user, name);
+    defining_ = nullptr;
+  }
+  rebuilding_.clear();
+  vm.invalidate_code();
+}
+
+void Optimizer::forget_dependencies(Quotation* quote) {
+  auto [begin, end] = uses_.equal_range(quote);
+  for (auto it = begin; it != end; ++it) {
+    auto [users_begin, users_end] = users_.equal_range(it->second);
+    for (auto user = users_begin; user != users_end; ++user) {
+      if (user->second == quote) {
+        users_.erase(user);
+        break;
+      }
+    }
+  }
+  uses_.erase(quote);
+}
+
+void Optimizer::forget(Quotation* quote) {
+  std::unordered_set<Quotation*> visited;
+  std::vector<Quotation*> pending{quote};
+  while (!pending.empty()) {
+    Quotation* next = pending.back();
+    pending.pop_back();
+    if (!visited.insert(next).second) {
+      continue;
+    }
+    forget_dependencies(next);
+    if (next->definition == nullptr) {
+      continue;
+    }
+    for (Cell cell : *next->definition) {
+      if (cell.is_a<Quotation>()) {
+        pending.push_back(cast<Quotation>(cell));
+      }
+    }
+  }
+}
+
+void Optimizer::depend_on(Word* word) {
+  HSTL_ASSERT(current_ != nullptr);
+  auto [begin, end] = uses_.equal_range(current_);
+  for (auto it = begin; it != end; ++it) {
+    if (it->second == word) {
+      return;
+    }
+  }
+  uses_.emplace(current_, word);
+  users_.emplace(word, current_);
+}
+
+bool Optimizer::relies_on(Quotation* quote, Word* word) const {
+  std::unordered_set<Quotation*> visited;
+  std::vector<Quotation*> pending{quote};
+  while (!pending.empty()) {
+    Quotation* next = pending.back();
+    pending.pop_back();
+    if (!visited.insert(next).second) {
+      continue;
+    }
+    auto [begin, end] = uses_.equal_range(next);
+    for (auto it = begin; it != end; ++it) {
+      if (it->second == word) {
+        return true;
+      }
+      if (Quotation* definition = it->second->definition) {
+        pending.push_back(definition);
+      }
+    }
+  }
+  return false;
+}
+
+void Optimizer::mark_roots(Heap::MarkFunction fn) {
+  // Both maps are keyed by address, so they are rebuilt from the moved
+  // pointers
+  std::vector<std::pair<Cell, Cell>> dependencies;
+  dependencies.reserve(users_.size());
+  for (const auto& [word, user] : users_) {
+    dependencies.emplace_back(word, user);
+  }
+  users_.clear();
+  uses_.clear();
+  for (auto& [word, user] : dependencies) {
+    fn((cell_t*)&word);
+    fn((cell_t*)&user);
+    users_.emplace(cast<Word>(word), cast<Quotation>(user));
+    uses_.emplace(cast<Quotation>(user), cast<Word>(word));
+  }
+  for (Cell& cell : rebuilding_) {
+    fn((cell_t*)&cell);
+  }
+  fn((cell_t*)&defining_);
+}
@@ -11,45 +11,94 @@
 #include <new>
 using namespace hustle;
 
-Stack::Stack(size_t sz) {
-  base_ = (Cell*)malloc(sizeof(Cell) * sz);
-  if (base_ == nullptr) {
-    throw std::bad_alloc();
-  }
-  top_ = base_ + sz;
+/// Size of the inaccessible region below each stack
+static size_t guard_size() {
+#if HUSTLE_GUARD_PAGES
+  return Memory::page_size();
+#else
+  return 0;
+#endif
+}
+
+/// Round a stack address down to the start of its page
+static Cell* page_floor(Cell* addr) {
+  return (Cell*)((uintptr_t)addr & ~(uintptr_t)(Memory::page_size() - 1));
+}
+
+/// Reserve space for limit cells, preceded by the guard
+static MemorySegment reserve_stack(size_t limit) {
+  size_t page = Memory::page_size();
+  size_t bytes = std::max<size_t>(limit * sizeof(Cell), 1);
+  bytes = (bytes + page - 1) / page * page;
+  return Memory::allocate(guard_size() + bytes, 0);
+}
+
+// Fresh pages are zeroed, so unlike malloc there is no need to clear them
+Stack::Stack(size_t initial, size_t limit) : memory_(reserve_stack(limit)) {
+  HSTL_ASSERT(initial <= limit);
+  limit_ = pointer_add<Cell>(memory_.base(), guard_size());
+  top_ = limit_ + limit;
   sp_ = top_;
-  memset(base_, 0, sizeof(Cell) * sz);
+
+  // limit_ is page aligned, so this never passes it
+  base_ = page_floor(top_ - initial);
+  void* end = pointer_add<void>(memory_.base(), memory_.size());
+  Memory::protect(base_, (char*)end - (char*)base_,
+                  Memory::MEM_READ | Memory::MEM_WRITE);
+#if HUSTLE_GUARD_PAGES
+  // Everything below the committed pages, including space the stack can
+  // grow into
+  Memory::add_guard(memory_.base(), (char*)base_ - (char*)memory_.base(),
+                    guard_fault, this);
+#endif
+}
+
+Stack::~Stack() {
+#if HUSTLE_GUARD_PAGES
+  Memory::remove_guard(memory_.base());
+#endif
 }
 
-Stack::~Stack() { free(base_); }
+void Stack::grow(size_t count) {
+  size_t available = sp_ - base_;
+  if (available >= count) {
+    return;
+  }
+  size_t needed = count - available;
+  size_t reserved = base_ - limit_;
+  if (needed > reserved) {
+    overflow();
+  }
+
+  // Doubling keeps the number of times a deep stack grows small
+  size_t cells = std::min(std::max(needed, capacity()), reserved);
+  Cell* new_base = page_floor(base_ - cells);
+  Memory::protect(new_base, (char*)base_ - (char*)new_base,
+                  Memory::MEM_READ | Memory::MEM_WRITE);
+  base_ = new_base;
+}
 
 void Stack::clear() {
   std::fill(begin(), end(), Cell::from_int(0));
   sp_ = top_;
 }
 
-void Stack::push(Cell cell) {
-  if (sp_ <= base_) {
-    throw Exception("Stack overflow");
-  }
-  HSTL_ASSERT(sp_ <= top_);
-  *--sp_ = cell;
-}
+void Stack::overflow() { throw Exception("Stack overflow"); }
 
-Cell Stack::pop() {
-  if (sp_ >= top_) {
-    throw Exception("stack underflow");
-  }
-  HSTL_ASSERT(sp_ >= base_);
-  Cell cell = *sp_;
-  *sp_++ = Cell::from_raw(0);
-  return cell;
+void Stack::guard_fault(void* stack) {
+  // Only pushes write below base_, and they store before moving the stack
+  // pointer. Once there is at least one more cell the push is retried;
+  // otherwise the overflow leaves the stack intact.
+  Stack* self = static_cast<Stack*>(stack);
+  HSTL_ASSERT(self->sp_ >= self->base_);
+  self->grow(self->sp_ - self->base_ + 1);
 }
 
-Cell Stack::peek() const {
-  if (sp_ >= top_) {
-    throw Exception("stack underflow");
+void Stack::underflow() { throw Exception("stack underflow"); }
+
+size_t StackFrame::offset() const {
+  if (ip == nullptr) {
+    return 0;
   }
-  HSTL_ASSERT(sp_ >= base_);
-  return *sp_;
+  return ip - code->begin();
 }
@@ -8,8 +8,13 @@
 #include "city.h"
 #include "hustle/Object.hpp"
 #include "hustle/Parser/BootstrapLexer.hpp"
+#include "hustle/Support/Compiler.hpp"
+#include "hustle/VM/Bytecode.hpp"
+#include <algorithm>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,24 +33,28 @@ struct DebuggerInterface {
 DebuggerInterface dbg_interface;
 } // namespace hustle
 
-static constexpr size_t MAX_CALL_FRAMES = 1024;
+/// Frames usable on the call stack before it first grows
+static constexpr size_t CALL_FRAMES = 1024;
 
 static TypedCell<Word> make_symbol_no_register(VM& vm, const char* n) {
   auto definition = vm.allocate_handle<Array>(1);
 
   auto word = vm.allocate_handle<Word>();
   word->name = vm.allocate<String>(n, strlen(n));
+  vm.heap_.write_barrier(word);
 
   Quotation* quote = vm.allocate<Quotation>();
   quote->definition = definition;
   quote->entry = nullptr;
 
   word->definition = quote;
+  vm.heap_.write_barrier(word);
 
   Wrapper* wrapper = vm.allocate<Wrapper>();
   wrapper->wrapped = Cell::from_raw(make_cell(word));
   // TODO: this is gross
   *(definition->begin()) = Cell::from_raw(make_cell(wrapper));
+  vm.heap_.write_barrier(definition);
 
   // TODO: should this conversion be done implicitly?
   return TypedCell<Word>(word);
@@ -57,22 +66,34 @@ static TypedCell<Word> make_symbol(VM& vm, const char* name) {
   return word;
 }
 
-Word* VM::register_primitive(const char* name, CallType handler,
-                             bool is_parse) {
+Word* VM::make_primitive(const char* name, CallType handler, bool is_parse) {
   size_t name_len = strlen(name);
   auto word = allocate_handle<Word>();
   word->name = allocate<String>(name, name_len);
+  heap_.write_barrier(word);
   word->definition = allocate<Quotation>(handler);
+  heap_.write_barrier(word);
   word->is_parse_word = is_parse;
+  return word;
+}
+
+Word* VM::register_primitive(const char* name, CallType handler,
+                             bool is_parse) {
+  Word* word = make_primitive(name, handler, is_parse);
   symbol_table_.emplace(std::string(name), make_cell(word));
   return word;
 }
 
 thread_local VM* hustle::current_vm = nullptr;
 
-VM::VM()
-    : stack_(STACK_SIZE), call_stack_(MAX_CALL_FRAMES), lexer_(*this),
-      heap_([this](Heap::MarkFunction fn) { mark_roots(fn); }) {
+VM::VM(const VMOptions& options)
+    : stack_(std::min(STACK_SIZE, options.stack_size), options.stack_size),
+      call_stack_(std::min(CALL_FRAMES, options.call_depth),
+                  options.call_depth),
+      locals_(std::min(STACK_SIZE, options.locals_size), options.locals_size),
+      lexer_(*this),
+      heap_([this](Heap::MarkFunction fn) { mark_roots(fn); },
+            options.heap_initial, options.heap_max, options.gc_threads) {
   HSTL_ASSERT(current_vm == nullptr);
   current_vm = this;
   // memset(stack_, 0, STACK_SIZE);
@@ -84,6 +105,8 @@ VM::VM()
   globals.Mark = make_symbol_no_register(*this, "<MARK>");
 
   register_primitives(*this);
+  loop_code_ = make_loop_code(*this);
+  restore_code_ = make_restore_code(*this);
 }
 
 VM::~VM() {
@@ -106,9 +129,6 @@ void VM::evaluate(Cell cell) {
 void VM::call(Cell cell) {
   current_vm = this;
   StackFrame frame;
-  frame.word = nullptr;
-  frame.quote = TypedCell<Quotation>(nullptr);
-  frame.offset = Cell::from_int(0);
   call_stack_.push(frame);
 
   switch (cell.tag()) {
@@ -120,12 +140,12 @@ void VM::call(Cell cell) {
     return;
   }
   case CELL_WORD:
-    frame.word = cell;
-    cell = cast<Word>(cell)->definition;
+    frame.word = cast<Word>(cell);
+    cell = frame.word->definition;
 
     // Fall through
   case CELL_QUOTE: {
-    frame.quote = cell;
+    frame.quote = cast<Quotation>(cell);
     call_stack_.push(frame);
     interpreter_loop();
     return;
@@ -149,12 +169,41 @@ cell_t VM::lookup_symbol(const std::string& name) {
 
 void VM::register_symbol(String* string_raw, Quotation* quote_raw,
                          bool parseword) {
+  std::string sys_name(string_raw->data(),
+                       string_raw->data() + string_raw->length());
+  auto it = symbol_table_.find(sys_name);
+  if (it != symbol_table_.end() && is_a<Word>(it->second)) {
+    // Redefine the existing word in place, so code which has already been
+    // parsed sees the new definition.
+    Word* word = cast<Word>(it->second);
+    Quotation* old_definition = word->definition;
+    word->definition = quote_raw;
+    heap_.write_barrier(word);
+    quote_raw->word = word;
+    heap_.write_barrier(quote_raw);
+    word->is_parse_word = parseword;
+    word->version = Cell::from_int(cast<intptr_t>(word->version) + 1);
+    // Specialised call sites check the version, but entry points are resolved
+    // when code is compiled, so those need to be thrown away
+    if (old_definition == nullptr || old_definition->entry != nullptr) {
+      invalidate_code();
+    }
+    // Definitions which inlined or folded the old one are rebuilt
+    if (old_definition != nullptr) {
+      optimizer_.forget(old_definition);
+    }
+    optimizer_.redefined(*this, word);
+    return;
+  }
+
   Handle<String> string = make_handle<String>(string_raw);
   Handle<Quotation> quote = make_handle<Quotation>(quote_raw);
   Word* word = allocate<Word>();
   word->name = string;
   word->definition = quote;
   word->is_parse_word = parseword;
+  quote->word = word;
+  heap_.write_barrier(quote);
   register_symbol(string, word);
 }
 
@@ -202,62 +251,800 @@ void VM::step_hook() {
   }
 }
 
-void VM::interpreter_loop() {
+Array* VM::quotation_code(Quotation* quote) {
+  if (quote->code != nullptr &&
+      quote->code_epoch == Cell::from_int(code_epoch_)) {
+    return quote->code;
+  }
+  return compile_quotation(*this, quote);
+}
+
+Array* VM::direct_code(Quotation* quote) {
+  if (quote->entry != nullptr || quote->code == nullptr ||
+      quote->code_epoch != Cell::from_int(code_epoch_)) {
+    return nullptr;
+  }
+  return quote->code;
+}
+
+bool VM::tier_up(Word* word, Quotation* quote) {
+  ++quote->invocations;
+  if (jit_ == nullptr || quote->native_failed ||
+      quote->invocations + quote->back_edges < jit_threshold) {
+    return false;
+  }
+  quote->invocations = 0;
+  quote->back_edges = 0;
+  quote->entry = jit_->compile(*this, quote);
+  if (quote->entry == nullptr) {
+    quote->native_failed = true;
+    return false;
+  }
+  record_tier(word, quote, TIER_NATIVE);
+  return true;
+}
+
+void VM::record_tier(Word* word, Quotation* quote, Tier tier) {
+  if (tier_events_.size() == MAX_TIER_EVENTS) {
+    tier_events_.pop_front();
+  }
+  tier_events_.push_back({word != nullptr ? Cell(word) : Cell(quote), tier});
+}
+
+Cell* VM::scope_locals(Quotation* scope) {
+  for (StackFrame& frame : call_stack_) {
+    if (frame.quote == scope && frame.locals != nullptr) {
+      return frame.locals;
+    }
+  }
+  throw Exception("Locals used after their word returned");
+}
+
+namespace {
+/**
+ * Drops the locals of "::" words unwound by an exception.
+ *
+ * Their frames are left on the call stack for debugging, but nothing will
+ * leave their locals, so the next call would otherwise start above them.
+ */
+class LocalsUnwinder {
+public:
+  explicit LocalsUnwinder(Stack& locals)
+      : locals_(locals), depth_(locals.depth()),
+        exceptions_(std::uncaught_exceptions()) {}
+  ~LocalsUnwinder() {
+    if (std::uncaught_exceptions() > exceptions_ && locals_.depth() > depth_) {
+      locals_.drop(locals_.depth() - depth_);
+    }
+  }
+
+private:
+  Stack& locals_;
+  const size_t depth_;
+  const int exceptions_;
+};
+
+/// Counts a native entry point as running for as long as it is in scope
+class NativeActivation {
+public:
+  explicit NativeActivation(uint32_t& depth) : depth_(depth) { ++depth_; }
+  ~NativeActivation() { --depth_; }
+
+private:
+  uint32_t& depth_;
+};
+} // namespace
+
+/// Build a frame for calling quote, optionally through word
+static StackFrame make_frame(Word* word, Quotation* quote) {
+  StackFrame frame;
+  frame.word = word;
+  frame.quote = quote;
+  return frame;
+}
+
+bool VM::call_word(Word* word, bool tail) {
+  Quotation* definition = word->definition;
+  if (definition->definition != nullptr) {
+    if (tail) {
+      call_stack_.top() = make_frame(word, definition);
+    } else {
+      call_stack_.push(make_frame(word, definition));
+    }
+    return true;
+  }
+  if (definition->is_leaf) {
+    definition->entry(this, nullptr);
+    return false;
+  }
+  // Same as OP_CALL_PRIMITIVE and OP_TAIL_CALL_PRIMITIVE
+  const Cell* caller_sp = call_stack_.sp();
+  if (tail) {
+    call_stack_.top() = make_frame(word, definition);
+  } else {
+    call_stack_.push(make_frame(word, definition));
+  }
+  definition->entry(this, definition);
+  call_stack_.pop();
+  return tail || call_stack_.sp() != caller_sp;
+}
+
+/// Build a frame for calling a word or quotation taken from the stack
+static StackFrame callable_frame(Cell callable) {
+  if (callable.is_a<Word>()) {
+    Word* word = cast<Word>(callable);
+    return make_frame(word, word->definition);
+  }
+  if (callable.is_a<Quotation>()) {
+    return make_frame(nullptr, cast<Quotation>(callable));
+  }
+  throw Exception("Value is not callable");
+}
+
+template <bool Debuggable>
+void VM::run_interpreter() {
+#if HUSTLE_COMPUTED_GOTO
+  static const void* const dispatch_table[] = {
+      &&op_push,
+      &&op_call,
+      &&op_call_quote,
+      &&op_call_primitive,
+      &&op_call_leaf,
+      &&op_tail_call,
+      &&op_tail_call_quote,
+      &&op_tail_call_primitive,
+      &&op_return,
+      &&op_call_anon,
+      &&op_tail_call_anon,
+      &&op_call_dynamic,
+      &&op_tail_call_dynamic,
+      &&op_jump,
+      &&op_branch_false,
+      &&op_dip,
+      &&op_restore,
+      &&op_while,
+      &&op_loop_cond,
+      &&op_loop_body,
+      &&op_check_stack,
+      &&op_push_unchecked,
+      &&op_dup,
+      &&op_drop,
+      &&op_swap,
+      &&op_over,
+      &&op_add,
+      &&op_sub,
+      &&op_lt,
+      &&op_gt,
+      &&op_pick,
+      &&op_shuffle,
+      &&op_add_fixnum,
+      &&op_sub_fixnum,
+      &&op_lt_fixnum,
+      &&op_gt_fixnum,
+      &&op_enter_locals,
+      &&op_leave_locals,
+      &&op_local_get,
+      &&op_local_set,
+  };
+  static_assert(std::size(dispatch_table) == OP_MAX);
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if constexpr (Debuggable) {                                                \
+      step_hook();                                                             \
+    }                                                                          \
+    goto* dispatch_table[decode_opcode(*ip)];                                  \
+  } while (0)
+#else
+#define DISPATCH() goto dispatch
+#endif
+
+  // Interpreter state for the current frame. This is only written back to
+  // the call stack when we leave the frame.
+  Array* code = nullptr;
+  Cell* ip = nullptr;
+  const Cell* frame_sp = nullptr;
+
+  // Callee for push_frame and replace_frame
+  StackFrame next_frame;
+
+  LocalsUnwinder unwinder(locals_);
+
   while (call_stack_.begin() != call_stack_.end()) {
   loop_entry:
-    auto frame = call_stack_[0];
-    intptr_t offset = frame.offset.cast<intptr_t>();
-    HSTL_ASSERT(offset >= 0);
-    Quotation* quote = cast<Quotation>(frame.quote);
+    StackFrame& frame = call_stack_.top();
+    Quotation* quote = frame.quote;
     if (quote == nullptr) {
       call_stack_.pop();
       return;
     }
-    if (quote->entry != nullptr) {
-      HSTL_ASSERT(offset == 0);
-      quote->entry(this, nullptr);
-      call_stack_.pop();
-      continue;
+    if (frame.walking) {
+      if constexpr (!Debuggable) {
+        // Native code which left to make a call picks up where it left off
+        if (frame.native && quote->entry != nullptr &&
+            frame.code == quote->definition) {
+          NativeActivation active(native_depth_);
+          quote->entry(this, quote);
+          continue;
+        }
+      }
+      frame.native = false;
+      goto walk;
+    }
+    if (frame.code != nullptr) {
+      code = frame.code;
+      ip = frame.ip;
+    } else {
+      if constexpr (!Debuggable) {
+        // Native code has no debugging hooks, so only compile when there is
+        // no debugger attached
+        if (quote->entry == nullptr) {
+          tier_up(frame.word, quote);
+        }
+        // Cold code runs straight from its definition. Stepping works on
+        // instructions, so the debugger always sees lowered code.
+        if (quote->entry == nullptr && quote->code == nullptr &&
+            quote->invocations < bytecode_threshold) {
+          frame.code = quote->definition;
+          frame.ip = frame.code->begin();
+          frame.walking = true;
+          goto walk;
+        }
+      }
+      if (quote->entry != nullptr) {
+        HSTL_ASSERT(frame.ip == nullptr);
+        // Pops the frame itself, unless it leaves it to make a call
+        NativeActivation active(native_depth_);
+        quote->entry(this, quote);
+        continue;
+      }
+      if (quote->code == nullptr) {
+        record_tier(frame.word, quote, TIER_BYTECODE);
+      }
+      code = quotation_code(quote);
+      frame.code = code;
+      ip = code->begin();
     }
 
-    Array* arr = cast<Quotation>(frame.quote)->definition;
-    auto size = arr->count();
-    HSTL_ASSERT(size <= INTPTR_MAX);
-    for (; (uintptr_t)offset < size; ++offset) {
+    frame_sp = call_stack_.sp();
+    HSTL_ASSERT(ip >= code->begin() && ip < code->end());
+    DISPATCH();
+
+#if !HUSTLE_COMPUTED_GOTO
+  dispatch:
+    if constexpr (Debuggable) {
       step_hook();
-      auto cell = (*arr)[offset];
-      switch (cell.tag()) {
-      case CELL_WORD: {
-        // TODO need to do tail call recursion properly
-        call_stack_.update_offset(offset + 1);
-        StackFrame frame;
-        frame.offset = Cell::from_int(0);
-        frame.word = cell;
-        frame.quote = cast<Word>(cell)->definition;
-        call_stack_.push(frame);
-        goto loop_entry;
+    }
+    switch (decode_opcode(*ip)) {
+    case OP_PUSH:
+      goto op_push;
+    case OP_CALL:
+      goto op_call;
+    case OP_CALL_QUOTE:
+      goto op_call_quote;
+    case OP_CALL_PRIMITIVE:
+      goto op_call_primitive;
+    case OP_CALL_LEAF:
+      goto op_call_leaf;
+    case OP_TAIL_CALL:
+      goto op_tail_call;
+    case OP_TAIL_CALL_QUOTE:
+      goto op_tail_call_quote;
+    case OP_TAIL_CALL_PRIMITIVE:
+      goto op_tail_call_primitive;
+    case OP_RETURN:
+      goto op_return;
+    case OP_CALL_ANON:
+      goto op_call_anon;
+    case OP_TAIL_CALL_ANON:
+      goto op_tail_call_anon;
+    case OP_CALL_DYNAMIC:
+      goto op_call_dynamic;
+    case OP_TAIL_CALL_DYNAMIC:
+      goto op_tail_call_dynamic;
+    case OP_JUMP:
+      goto op_jump;
+    case OP_BRANCH_FALSE:
+      goto op_branch_false;
+    case OP_DIP:
+      goto op_dip;
+    case OP_RESTORE:
+      goto op_restore;
+    case OP_WHILE:
+      goto op_while;
+    case OP_LOOP_COND:
+      goto op_loop_cond;
+    case OP_LOOP_BODY:
+      goto op_loop_body;
+    case OP_CHECK_STACK:
+      goto op_check_stack;
+    case OP_PUSH_UNCHECKED:
+      goto op_push_unchecked;
+    case OP_DUP:
+      goto op_dup;
+    case OP_DROP:
+      goto op_drop;
+    case OP_SWAP:
+      goto op_swap;
+    case OP_OVER:
+      goto op_over;
+    case OP_ADD:
+      goto op_add;
+    case OP_SUB:
+      goto op_sub;
+    case OP_LT:
+      goto op_lt;
+    case OP_GT:
+      goto op_gt;
+    case OP_PICK:
+      goto op_pick;
+    case OP_SHUFFLE:
+      goto op_shuffle;
+    case OP_ADD_FIXNUM:
+      goto op_add_fixnum;
+    case OP_SUB_FIXNUM:
+      goto op_sub_fixnum;
+    case OP_LT_FIXNUM:
+      goto op_lt_fixnum;
+    case OP_GT_FIXNUM:
+      goto op_gt_fixnum;
+    case OP_ENTER_LOCALS:
+      goto op_enter_locals;
+    case OP_LEAVE_LOCALS:
+      goto op_leave_locals;
+    case OP_LOCAL_GET:
+      goto op_local_get;
+    case OP_LOCAL_SET:
+      goto op_local_set;
+    default:
+      HSTL_ASSERT(false);
+    }
+#endif
+
+  op_push:
+    push(ip[1]);
+    ip += OPCODE_SIZE[OP_PUSH];
+    DISPATCH();
+
+  op_call: {
+    Word* word = cast<Word>(ip[1]);
+    Quotation* definition = word->definition;
+    if (definition->entry == nullptr) {
+      // Remember the definition, so later calls can skip the lookup
+      ip[0] = encode_opcode(OP_CALL_QUOTE);
+      ip[2] = definition;
+      ip[3] = word->version;
+      heap_.write_barrier_slot(&ip[2]);
+      goto op_call_quote;
+    }
+    call_stack_.top().ip = ip + OPCODE_SIZE[OP_CALL];
+    StackFrame callee;
+    callee.word = word;
+    callee.quote = definition;
+    call_stack_.push(callee);
+    goto loop_entry;
+  }
+
+  op_call_quote: {
+    if (cast<Word>(ip[1])->version != ip[3]) {
+      // Redefined since we were specialised
+      ip[0] = encode_opcode(OP_CALL);
+      goto op_call;
+    }
+    call_stack_.top().ip = ip + OPCODE_SIZE[OP_CALL_QUOTE];
+    next_frame = make_frame(cast<Word>(ip[1]), cast<Quotation>(ip[2]));
+    goto push_frame;
+  }
+
+  push_frame: {
+    // Enter next_frame, without going back through loop_entry if its code is
+    // ready to run
+    Quotation* callee = next_frame.quote;
+    next_frame.code = direct_code(callee);
+    if constexpr (!Debuggable) {
+      // loop_entry does the counting when we can't skip it
+      if (next_frame.code != nullptr && tier_up(next_frame.word, callee)) {
+        next_frame.code = nullptr;
+      }
+    }
+    call_stack_.push(next_frame);
+    if (next_frame.code == nullptr) {
+      goto loop_entry;
+    }
+    code = next_frame.code;
+    frame_sp = call_stack_.sp();
+    ip = code->begin();
+    DISPATCH();
+  }
+
+  replace_frame: {
+    // Same as push_frame, but the callee takes over the current frame
+    Quotation* callee = next_frame.quote;
+    next_frame.code = direct_code(callee);
+    if constexpr (!Debuggable) {
+      if (next_frame.code != nullptr && tier_up(next_frame.word, callee)) {
+        next_frame.code = nullptr;
       }
-      case CELL_WRAPPER:
-        push(cast<Wrapper>(cell)->wrapped);
-        break;
+    }
+    call_stack_.top() = next_frame;
+    if (next_frame.code == nullptr) {
+      goto loop_entry;
+    }
+    // Reusing our frame leaves the call stack depth unchanged
+    code = next_frame.code;
+    ip = code->begin();
+    DISPATCH();
+  }
+
+  op_call_primitive: {
+    auto fn = decode_native(ip[1]);
+    Word* word = cast<Word>(ip[2]);
+    call_stack_.top().ip = ip + OPCODE_SIZE[OP_CALL_PRIMITIVE];
+    StackFrame callee;
+    callee.word = word;
+    callee.quote = word->definition;
+    call_stack_.push(callee);
+    fn(this, callee.quote);
+    call_stack_.pop();
+    if (call_stack_.sp() != frame_sp) {
+      // The primitive pushed a frame (eg call), so run that next
+      goto loop_entry;
+    }
+    // The primitive may have caused a GC, which moves our frame's code
+    code = call_stack_.top().code;
+    ip = call_stack_.top().ip;
+    DISPATCH();
+  }
+
+  op_call_leaf: {
+    auto fn = decode_native(ip[1]);
+    // Also needed for backtraces, since we don't get a frame of our own
+    call_stack_.top().ip = ip + OPCODE_SIZE[OP_CALL_LEAF];
+    fn(this, nullptr);
+    HSTL_ASSERT(call_stack_.sp() == frame_sp);
+    // The primitive may have caused a GC, which moves our frame's code
+    code = call_stack_.top().code;
+    ip = call_stack_.top().ip;
+    DISPATCH();
+  }
+
+  op_tail_call: {
+    Word* word = cast<Word>(ip[1]);
+    Quotation* definition = word->definition;
+    if (definition->entry == nullptr) {
+      ip[0] = encode_opcode(OP_TAIL_CALL_QUOTE);
+      ip[2] = definition;
+      ip[3] = word->version;
+      heap_.write_barrier_slot(&ip[2]);
+      goto op_tail_call_quote;
+    }
+    StackFrame callee;
+    callee.word = word;
+    callee.quote = definition;
+    call_stack_.top() = callee;
+    goto loop_entry;
+  }
+
+  op_tail_call_quote: {
+    if (cast<Word>(ip[1])->version != ip[3]) {
+      ip[0] = encode_opcode(OP_TAIL_CALL);
+      goto op_tail_call;
+    }
+    next_frame = make_frame(cast<Word>(ip[1]), cast<Quotation>(ip[2]));
+    goto replace_frame;
+  }
+
+  op_tail_call_primitive: {
+    auto fn = decode_native(ip[1]);
+    Word* word = cast<Word>(ip[2]);
+    StackFrame callee;
+    callee.word = word;
+    callee.quote = word->definition;
+    call_stack_.top() = callee;
+    fn(this, callee.quote);
+    call_stack_.pop();
+    goto loop_entry;
+  }
+
+  op_call_anon:
+    call_stack_.top().ip = ip + OPCODE_SIZE[OP_CALL_ANON];
+    next_frame = make_frame(nullptr, cast<Quotation>(ip[1]));
+    goto push_frame;
+
+  op_tail_call_anon:
+    next_frame = make_frame(nullptr, cast<Quotation>(ip[1]));
+    goto replace_frame;
+
+  op_call_dynamic: {
+    Cell callable = pop();
+    call_stack_.top().ip = ip + OPCODE_SIZE[OP_CALL_DYNAMIC];
+    next_frame = callable_frame(callable);
+    goto push_frame;
+  }
+
+  op_tail_call_dynamic:
+    next_frame = callable_frame(pop());
+    goto replace_frame;
+
+  op_jump: {
+    Cell* target = code->begin() + cast<intptr_t>(ip[1]);
+    if (target < ip) {
+      // Loops count towards compiling the quote they are in
+      ++call_stack_.top().quote->back_edges;
+    }
+    ip = target;
+    DISPATCH();
+  }
+
+  op_branch_false:
+    if (pop() == globals.False) {
+      ip = code->begin() + cast<intptr_t>(ip[1]);
+    } else {
+      ip += OPCODE_SIZE[OP_BRANCH_FALSE];
+    }
+    DISPATCH();
+
+  op_dip: {
+    Cell callable = pop();
+    Cell value = pop();
+    StackFrame& self = call_stack_.top();
+    self.ip = ip + OPCODE_SIZE[OP_DIP];
+    self.retain = value;
+    next_frame = callable_frame(callable);
+    goto push_frame;
+  }
+
+  op_restore: {
+    StackFrame& self = call_stack_.top();
+    push(self.retain);
+    self.retain = Cell::from_int(0);
+    ip += OPCODE_SIZE[OP_RESTORE];
+    DISPATCH();
+  }
+
+  op_while: {
+    Cell body = pop();
+    Cell condition = pop();
+    call_stack_.top().ip = ip + OPCODE_SIZE[OP_WHILE];
+    next_frame = make_frame(nullptr, cast<Quotation>(condition));
+    next_frame.retain = TypedCell<Quotation>(cast<Quotation>(body));
+    next_frame.code = loop_code_;
+    call_stack_.push(next_frame);
+    code = loop_code_;
+    frame_sp = call_stack_.sp();
+    ip = code->begin();
+    DISPATCH();
+  }
+
+  op_loop_cond: {
+    StackFrame& self = call_stack_.top();
+    self.ip = code->begin() + OPCODE_SIZE[OP_LOOP_COND];
+    next_frame = make_frame(nullptr, self.quote);
+    goto push_frame;
+  }
+
+  op_loop_body: {
+    if (pop() == globals.False) {
+      goto op_return;
+    }
+    StackFrame& self = call_stack_.top();
+    // Come back to the condition once the body is done
+    self.ip = code->begin();
+    next_frame = make_frame(nullptr, cast<Quotation>(self.retain));
+    goto push_frame;
+  }
+
+  // Instructions in a checked run. The stack was checked for all of them by
+  // the OP_CHECK_STACK which starts the run.
+  op_check_stack:
+    stack_.require(cast<intptr_t>(ip[1]));
+    stack_.reserve(cast<intptr_t>(ip[2]));
+    ip += OPCODE_SIZE[OP_CHECK_STACK];
+    DISPATCH();
+
+  op_push_unchecked:
+    stack_.push_unchecked(ip[1]);
+    ip += OPCODE_SIZE[OP_PUSH_UNCHECKED];
+    DISPATCH();
+
+  op_dup: {
+    Cell a = stack_.top();
+    stack_.push_unchecked(a);
+    ip += OPCODE_SIZE[OP_DUP];
+    DISPATCH();
+  }
+
+  op_drop:
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_DROP];
+    DISPATCH();
+
+  op_swap:
+    std::swap(stack_.top(0), stack_.top(1));
+    ip += OPCODE_SIZE[OP_SWAP];
+    DISPATCH();
+
+  op_over: {
+    Cell a = stack_.top(1);
+    stack_.push_unchecked(a);
+    ip += OPCODE_SIZE[OP_OVER];
+    DISPATCH();
+  }
+
+  op_add:
+    stack_.top(1) = Cell::from_int(cast<intptr_t>(stack_.top(1)) +
+                                   cast<intptr_t>(stack_.top(0)));
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_ADD];
+    DISPATCH();
 
-      default:
-        push(cell);
-        break;
+  op_sub:
+    stack_.top(1) = Cell::from_int(cast<intptr_t>(stack_.top(1)) -
+                                   cast<intptr_t>(stack_.top(0)));
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_SUB];
+    DISPATCH();
+
+  op_lt:
+    stack_.top(1) = cast<intptr_t>(stack_.top(1)) <
+                            cast<intptr_t>(stack_.top(0))
+                        ? globals.True
+                        : globals.False;
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_LT];
+    DISPATCH();
+
+  op_gt:
+    stack_.top(1) = cast<intptr_t>(stack_.top(1)) >
+                            cast<intptr_t>(stack_.top(0))
+                        ? globals.True
+                        : globals.False;
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_GT];
+    DISPATCH();
+
+  op_pick: {
+    Cell a = stack_.top(cast<intptr_t>(ip[1]));
+    stack_.push_unchecked(a);
+    ip += OPCODE_SIZE[OP_PICK];
+    DISPATCH();
+  }
+
+  op_shuffle: {
+    const intptr_t in = cast<intptr_t>(ip[1]);
+    const intptr_t out = cast<intptr_t>(ip[2]);
+    intptr_t map = cast<intptr_t>(ip[3]);
+    Cell cells[MAX_SHUFFLE];
+    for (intptr_t i = 0; i < in; ++i) {
+      cells[i] = stack_.top(in - 1 - i);
+    }
+    stack_.drop(in);
+    for (intptr_t i = 0; i < out; ++i) {
+      stack_.push_unchecked(cells[map & ((1 << SHUFFLE_INDEX_BITS) - 1)]);
+      map >>= SHUFFLE_INDEX_BITS;
+    }
+    ip += OPCODE_SIZE[OP_SHUFFLE];
+    DISPATCH();
+  }
+
+  // Fixnums have a tag of zero, so these work on the raw cells
+  op_add_fixnum:
+    stack_.top(1) = Cell::from_raw(stack_.top(1).raw() + stack_.top(0).raw());
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_ADD_FIXNUM];
+    DISPATCH();
+
+  op_sub_fixnum:
+    stack_.top(1) = Cell::from_raw(stack_.top(1).raw() - stack_.top(0).raw());
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_SUB_FIXNUM];
+    DISPATCH();
+
+  op_lt_fixnum:
+    stack_.top(1) = (intptr_t)stack_.top(1).raw() < (intptr_t)stack_.top(0).raw()
+                        ? globals.True
+                        : globals.False;
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_LT_FIXNUM];
+    DISPATCH();
+
+  op_gt_fixnum:
+    stack_.top(1) = (intptr_t)stack_.top(1).raw() > (intptr_t)stack_.top(0).raw()
+                        ? globals.True
+                        : globals.False;
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_GT_FIXNUM];
+    DISPATCH();
+
+  op_enter_locals: {
+    const intptr_t count = cast<intptr_t>(ip[1]);
+    locals_.reserve(count);
+    for (intptr_t i = count; i > 0; --i) {
+      locals_.push_unchecked(stack_.top(i - 1));
+    }
+    stack_.drop(count);
+    call_stack_.top().locals = locals_.begin();
+    ip += OPCODE_SIZE[OP_ENTER_LOCALS];
+    DISPATCH();
+  }
+
+  op_leave_locals: {
+    const intptr_t count = cast<intptr_t>(ip[1]);
+    locals_.require(count);
+    locals_.drop(count);
+    ip += OPCODE_SIZE[OP_LEAVE_LOCALS];
+    DISPATCH();
+  }
+
+  op_local_get:
+    stack_.push_unchecked(current_locals()[cast<intptr_t>(ip[1])]);
+    ip += OPCODE_SIZE[OP_LOCAL_GET];
+    DISPATCH();
+
+  op_local_set:
+    current_locals()[cast<intptr_t>(ip[1])] = stack_.top(0);
+    stack_.drop(1);
+    ip += OPCODE_SIZE[OP_LOCAL_SET];
+    DISPATCH();
+
+  walk:
+    // Walk the definition in the frame on top, with ip kept in the frame
+    // since primitives may move the definition. Calls push frames rather than
+    // recursing, so cold code gets the same call depth limit and tail calls
+    // as lowered code.
+    while (true) {
+      StackFrame& self = call_stack_.top();
+      Cell* it = self.ip;
+      if (it == self.code->end()) {
+        goto op_return;
+      }
+      const bool tail = it + 1 == self.code->end();
+      self.ip = it + 1;
+      Cell cell = *it;
+      if (!cell.is_a<Word>()) {
+        push(cell.is_a<Wrapper>() ? cast<Wrapper>(cell)->wrapped : cell);
+        continue;
+      }
+      if (call_word(cast<Word>(cell), tail)) {
+        goto loop_entry;
       }
     }
+
+  op_return:
     call_stack_.pop();
   }
+#undef DISPATCH
 }
 
 bool VM::is_parse_word(Word* w) const { return w->is_parse_word; }
 
+VM::DebugListener VM::set_debug_listener(DebugListener new_listener) {
+  auto old_listener = debug_listener_;
+  debug_listener_ = new_listener;
+  if (new_listener != nullptr) {
+    interpreter_ = &VM::run_interpreter<true>;
+  } else {
+    interpreter_ = &VM::run_interpreter<false>;
+  }
+  return old_listener;
+}
+
 void VM::interpreter_break() {
   if (debug_listener_ != nullptr) {
     debug_listener_();
   }
 }
 
+/// Mark an untagged pointer, such as those held by call frames
+template <typename T>
+static void mark_pointer(const Heap::MarkFunction& fn, T*& pointer) {
+  if (pointer == nullptr) {
+    return;
+  }
+  cell_t cell = make_cell(pointer);
+  fn(&cell);
+  pointer = cast<T>(Cell::from_raw(cell));
+}
+
 void VM::mark_roots(Heap::MarkFunction fn) {
 
   fn((cell_t*)&globals.True);
@@ -268,18 +1055,51 @@ void VM::mark_roots(Heap::MarkFunction fn) {
   for (Cell& slot : stack_) {
     fn((cell_t*)&slot);
   }
+  for (Cell& slot : locals_) {
+    fn((cell_t*)&slot);
+  }
   for (auto& p : symbol_table_) {
-    auto old = p.second;
     fn(&p.second);
-    HSTL_ASSERT(p.second != old);
   }
   for (auto& frame : call_stack_) {
-    auto old_word = frame.word;
-    auto old_quote = frame.quote;
-    fn((cell_t*)&frame.word);
-    fn((cell_t*)&frame.quote);
-    HSTL_ASSERT(old_word == nullptr || old_word != frame.word);
-    HSTL_ASSERT(old_quote == nullptr || old_quote != frame.quote);
+    // ip points into code, so moves with it
+    const size_t offset = frame.offset();
+    mark_pointer(fn, frame.word);
+    mark_pointer(fn, frame.quote);
+    mark_pointer(fn, frame.code);
+    if (frame.ip != nullptr) {
+      frame.ip = frame.code->begin() + offset;
+    }
+    fn((cell_t*)&frame.retain);
+  }
+  for (auto& control : control_words_) {
+    fn((cell_t*)&control.value);
+  }
+  for (auto& local : local_words_) {
+    fn((cell_t*)&local.value);
+  }
+  for (auto& [op, element] : inline_words_) {
+    fn((cell_t*)&element.value);
+  }
+  for (auto& shuffle : shuffle_words_) {
+    fn((cell_t*)&shuffle.word.value);
+  }
+  fn((cell_t*)&loop_code_);
+  fn((cell_t*)&restore_code_);
+  for (auto& super : superinstructions_) {
+    fn((cell_t*)&super.word);
+    for (auto& element : super.pattern) {
+      if (element.kind == SuperInstruction::Element::WORD) {
+        fn((cell_t*)&element.value);
+      }
+    }
+  }
+  for (auto& event : tier_events_) {
+    fn((cell_t*)&event.callable);
+  }
+  optimizer_.mark_roots(fn);
+  if (jit_ != nullptr) {
+    jit_->mark_roots(fn);
   }
   handle_manager_.mark_handles(fn);
 }
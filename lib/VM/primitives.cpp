@@ -9,11 +9,14 @@
 #include <hustle/Support/Utility.hpp>
 #include <utility>
 
+#include <algorithm>
 #include <city.h>
 #include <fmt/core.h>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 using namespace hustle;
 using namespace std::literals;
@@ -30,16 +33,86 @@ void register_primitives(VM& vm) {
   for (auto x : parse_primitives) {
     vm.register_primitive(x.first, x.second, true);
   }
+  for (auto x : superinstructions) {
+    add_superinstruction(vm, x.first, x.second);
+  }
+  add_control_word(vm, CONTROL_CALL, "call");
+  add_control_word(vm, CONTROL_TERNARY, "?");
+  add_control_word(vm, CONTROL_WHILE, "while");
+  add_control_word(vm, CONTROL_DIP, "dip");
+  add_local_word(vm, LOCAL_GET, "local@");
+  add_local_word(vm, LOCAL_SET, "local!");
+  add_local_word(vm, LOCAL_ENTER, "enter-locals");
+  add_local_word(vm, LOCAL_LEAVE, "leave-locals");
+
+  std::unordered_set<VM::CallType> leaves(std::begin(leaf_primitives),
+                                          std::end(leaf_primitives));
+  std::unordered_set<VM::CallType> pure(std::begin(pure_primitives),
+                                        std::end(pure_primitives));
+  std::unordered_map<VM::CallType, StackEffect> effects(
+      std::begin(primitive_effects), std::end(primitive_effects));
+  auto annotate = [&](Word* word) {
+    Quotation* definition = word->definition;
+    if (definition == nullptr) {
+      return;
+    }
+    if (leaves.count(definition->entry) != 0) {
+      definition->is_leaf = true;
+    }
+    if (pure.count(definition->entry) != 0) {
+      definition->is_pure = true;
+    }
+    auto effect = effects.find(definition->entry);
+    if (effect != effects.end()) {
+      definition->effect = effect->second;
+    }
+  };
+  for (const auto& [name, cell] : vm.symbol_table_) {
+    if (is_a<Word>(cell)) {
+      annotate(cast<Word>(cell));
+    }
+  }
+  for (auto& super : vm.superinstructions_) {
+    annotate(super.word);
+  }
+
+  add_inline_word(vm, OP_DUP, "dup");
+  add_inline_word(vm, OP_DROP, "drop");
+  add_inline_word(vm, OP_SWAP, "swap");
+  add_inline_word(vm, OP_OVER, "over");
+  add_inline_word(vm, OP_ADD, "+");
+  add_inline_word(vm, OP_SUB, "-");
+  add_inline_word(vm, OP_LT, "<");
+  add_inline_word(vm, OP_GT, ">");
+
+  add_shuffle_word(vm, "dup", {0, 0});
+  add_shuffle_word(vm, "drop", {});
+  add_shuffle_word(vm, "swap", {1, 0});
+  add_shuffle_word(vm, "over", {0, 1, 0});
+  add_shuffle_word(vm, "rot", {2, 0, 1});
+  add_shuffle_word(vm, "pick", {0, 1, 2, 0});
+
+  add_default_passes(vm, vm.optimizer_);
 }
 } // namespace hustle
 
+/// Optimize the quote on top of the stack, which is being defined as a word
+static void optimize_definition(VM* vm) {
+  vm->stack_.require(2);
+  // Both stay on the stack, so they are rooted while the optimizer allocates
+  std::string name(std::string_view(*cast<String>(vm->stack_.top(1))));
+  vm->optimizer_.optimize(*vm, cast<Quotation>(vm->stack_.top(0)), name);
+}
+
 static void prim_def(VM* vm, Quotation*) {
+  optimize_definition(vm);
   auto definition = vm->pop();
   auto name = vm->pop();
   vm->register_symbol(cast<String>(name), cast<Quotation>(definition));
 }
 
 static void prim_defp(VM* vm, Quotation*) {
+  optimize_definition(vm);
   auto definition = vm->pop();
   auto name = vm->pop();
   vm->register_symbol(cast<String>(name), cast<Quotation>(definition), true);
@@ -134,6 +207,7 @@ static void prim_make_sym(VM* vm, Quotation*) {
   wrapper->wrapped = Cell::from_raw(make_cell(word));
   *(definition->begin()) =
       Cell::from_raw(make_cell(wrapper)); // TODO: this is really gross
+  vm->heap_.write_barrier(definition);
   vm->register_symbol(name, word);
 }
 
@@ -145,6 +219,7 @@ static void prim_set_all(VM* vm, Quotation*) {
   for (size_t i = 0; i < arr_size; ++i) {
     arr[i] = value;
   }
+  vm->heap_.write_barrier(arr_ptr);
 }
 
 static void prim_print(VM* vm, Quotation*) {
@@ -185,15 +260,18 @@ static void prim_is_string(VM* vm, Quotation*) {
 
 /* #region  Control flow primitives */
 static void prim_while(VM* vm, Quotation*) {
-  auto body = vm->make_handle<Quotation>(cast<Quotation>(vm->pop()));
-  auto condition = vm->make_handle<Quotation>(cast<Quotation>(vm->pop()));
-  while (true) {
-    vm->call(condition.cell());
-    auto result = vm->pop();
-    if (result == vm->globals.False)
-      break;
-    vm->call(body.cell());
-  }
+  Quotation* body = cast<Quotation>(vm->pop());
+  Quotation* condition = cast<Quotation>(vm->pop());
+
+  // Turn our own frame into the loop frame OP_WHILE would push, and leave a
+  // copy for the interpreter to discard, the same as call.
+  StackFrame& frame = vm->call_stack_[0];
+  frame.word = nullptr;
+  frame.quote = condition;
+  frame.code = vm->loop_code_;
+  frame.ip = frame.code->begin();
+  frame.retain = TypedCell<Quotation>(body);
+  vm->call_stack_.push(frame);
 }
 
 static void prim_ternary(VM* vm, Quotation*) {
@@ -205,26 +283,30 @@ static void prim_ternary(VM* vm, Quotation*) {
 
 static void prim_exit(VM* vm, Quotation*) { exit(0); }
 
-static void prim_call(VM* vm, Quotation*) {
+/// Build the frame for calling a word or quotation popped by call or dip
+static StackFrame callee_frame(VM* vm, Cell arg) {
   StackFrame frame;
-  frame.word = nullptr;
-  // Quotation* quote = vm->pop().cast<Quotation>();
-  auto arg = vm->pop();
   if (arg.is_a<Word>()) {
-    frame.word = arg;
-    frame.quote = cast<Word>(arg)->definition;
+    frame.word = cast<Word>(arg);
+    frame.quote = frame.word->definition;
   } else if (arg.is_a<Quotation>()) {
-    frame.quote = arg;
+    frame.quote = cast<Quotation>(arg);
   } else {
     prim_backtrace(vm, nullptr);
     HSTL_ASSERT(false);
   }
-  HSTL_ASSERT(frame.quote.is_a<Quotation>());
-  frame.offset = Cell::from_int(0);
+  HSTL_ASSERT(frame.quote != nullptr);
+  return frame;
+}
 
-  vm->call_stack_.pop();
+static void prim_call(VM* vm, Quotation*) {
+  StackFrame frame = callee_frame(vm, vm->pop());
 
-  vm->call_stack_.push(frame);
+  // Replace our own frame with the callee, so it returns directly to whoever
+  // called us. If we were tail called, this means the callee also reuses our
+  // caller's frame. The interpreter pops the frame of a primitive once it
+  // returns, so push a second copy for it to discard.
+  vm->call_stack_[0] = frame;
   vm->call_stack_.push(frame);
 
   return;
@@ -233,133 +315,191 @@ static void prim_call(VM* vm, Quotation*) {
 
 /* #region  Stack Primitives */
 static void prim_swap(VM* vm, Quotation*) {
-  auto a = vm->pop();
-  auto b = vm->pop();
-  vm->push(a);
-  vm->push(b);
+  Stack& stack = vm->stack_;
+  stack.require(2);
+  std::swap(stack.top(0), stack.top(1));
 }
 
 static void prim_over(VM* vm, Quotation*) {
-  auto a = vm->pop();
-  auto b = vm->peek();
-  vm->push(a);
-  vm->push(b);
+  Stack& stack = vm->stack_;
+  stack.require(2);
+  stack.push(stack.top(1));
 }
 
 static void prim_dup(VM* vm, Quotation*) { vm->push(vm->peek()); }
 
 static void prim_rot(VM* vm, Quotation*) {
-  auto c = vm->pop();
-  auto b = vm->pop();
-  auto a = vm->pop();
-  vm->push(c);
-  vm->push(a);
-  vm->push(b);
+  Stack& stack = vm->stack_;
+  stack.require(3);
+  Cell c = stack.top(0);
+  Cell b = stack.top(1);
+  Cell a = stack.top(2);
+  stack.top(2) = c;
+  stack.top(1) = a;
+  stack.top(0) = b;
 }
 
 static void prim_pick(VM* vm, Quotation*) { vm->push(vm->stack_[2]); }
 
 static void prim_dip(VM* vm, Quotation*) {
-  auto quote = vm->pop();
-  auto x = vm->make_handle(vm->pop());
-  vm->call(quote);
-  vm->push(x.cell());
+  StackFrame callee = callee_frame(vm, vm->pop());
+  auto x = vm->pop();
+
+  // Keep our own frame, which pushes x again once the callee returns to it.
+  // The callee goes on top, with a copy for the interpreter to discard as
+  // with call.
+  StackFrame& frame = vm->call_stack_[0];
+  frame.code = vm->restore_code_;
+  frame.ip = frame.code->begin();
+  frame.retain = x;
+  vm->call_stack_.push(callee);
+  vm->call_stack_.push(callee);
 }
 
 static void prim_drop(VM* vm, Quotation*) { vm->pop(); }
 
 /* #endregion */
 
+/* #region  Locals */
+
+// Normally each of these is lowered to a single instruction along with the
+// literal before it (see OP_LOCAL_GET), so these only run in cold code. They
+// are leaves, so the frame on top is the one of the quote using the locals.
+
+/// Get the locals of the caller, which has to be using some
+static Cell* caller_locals(VM* vm) {
+  Cell* locals = vm->current_locals();
+  if (locals == nullptr) {
+    throw Exception("No locals in scope");
+  }
+  return locals;
+}
+
+static void prim_enter_locals(VM* vm, Quotation*) {
+  const intptr_t count = cast<intptr_t>(vm->pop());
+  vm->stack_.require(count);
+  vm->locals_.reserve(count);
+  for (intptr_t i = count; i > 0; --i) {
+    vm->locals_.push_unchecked(vm->stack_.top(i - 1));
+  }
+  vm->stack_.drop(count);
+  vm->call_stack_.top().locals = vm->locals_.begin();
+}
+
+static void prim_leave_locals(VM* vm, Quotation*) {
+  const intptr_t count = cast<intptr_t>(vm->pop());
+  vm->locals_.require(count);
+  vm->locals_.drop(count);
+}
+
+static void prim_local_get(VM* vm, Quotation*) {
+  const intptr_t depth = cast<intptr_t>(vm->pop());
+  vm->push(caller_locals(vm)[depth]);
+}
+
+static void prim_local_set(VM* vm, Quotation*) {
+  const intptr_t depth = cast<intptr_t>(vm->pop());
+  Cell* locals = caller_locals(vm);
+  locals[depth] = vm->pop();
+}
+
+/* #endregion */
+
 /* #region  Arithmetic primitives */
+
+/**
+ * Replace ( a b -- ) with op(a, b).
+ *
+ * The operands are read with a single depth check and the result is written
+ * over a, so the stack pointer only moves once.
+ */
+template <typename Op>
+static void binary_op(VM* vm, Op op) {
+  Stack& stack = vm->stack_;
+  stack.require(2);
+  Cell result = op(stack.top(1), stack.top(0));
+  stack.drop(1);
+  stack.top() = result;
+}
+
+/// binary_op for operations on two integers
+template <typename Op>
+static void integer_op(VM* vm, Op op) {
+  binary_op(vm, [op](Cell a, Cell b) {
+    return Cell::from_int(op(cast<intptr_t>(a), cast<intptr_t>(b)));
+  });
+}
+
+/// binary_op for comparisons of two integers
+template <typename Compare>
+static void integer_compare(VM* vm, Compare compare) {
+  binary_op(vm, [vm, compare](Cell a, Cell b) -> Cell {
+    if (compare(cast<intptr_t>(a), cast<intptr_t>(b))) {
+      return vm->globals.True;
+    }
+    return vm->globals.False;
+  });
+}
+
 static void prim_lt(VM* vm, Quotation*) {
-  intptr_t b = cast<intptr_t>(vm->pop());
-  intptr_t a = cast<intptr_t>(vm->pop());
-  if (a < b) {
-    vm->push(vm->globals.True);
-  } else {
-    vm->push(vm->globals.False);
-  }
+  integer_compare(vm, [](intptr_t a, intptr_t b) { return a < b; });
 }
 
 static void prim_gt(VM* vm, Quotation*) {
-  intptr_t b = cast<intptr_t>(vm->pop());
-  intptr_t a = cast<intptr_t>(vm->pop());
-  if (a > b) {
-    vm->push(vm->globals.True);
-  } else {
-    vm->push(vm->globals.False);
-  }
+  integer_compare(vm, [](intptr_t a, intptr_t b) { return a > b; });
 }
 
 static void prim_mult(VM* vm, Quotation*) {
-  auto a = cast<intptr_t>(vm->pop());
-  auto b = cast<intptr_t>(vm->pop());
-  vm->push(Cell::from_int(a * b));
+  integer_op(vm, [](intptr_t a, intptr_t b) { return a * b; });
 }
 
 static void prim_div(VM* vm, Quotation*) {
-  auto b = cast<intptr_t>(vm->pop());
-  auto a = cast<intptr_t>(vm->pop());
-  vm->push(Cell::from_int(a / b));
+  integer_op(vm, [](intptr_t a, intptr_t b) { return a / b; });
 }
 
 static void prim_and(VM* vm, Quotation*) {
-  auto a = cast<intptr_t>(vm->pop());
-  auto b = cast<intptr_t>(vm->pop());
-  vm->push(Cell::from_int(a & b));
+  integer_op(vm, [](intptr_t a, intptr_t b) { return a & b; });
 }
 
 static void prim_or(VM* vm, Quotation*) {
-  auto a = cast<intptr_t>(vm->pop());
-  auto b = cast<intptr_t>(vm->pop());
-  vm->push(Cell::from_int(a | b));
+  integer_op(vm, [](intptr_t a, intptr_t b) { return a | b; });
 }
 
 static void prim_mod(VM* vm, Quotation*) {
-  intptr_t b = cast<intptr_t>(vm->pop());
-  intptr_t a = cast<intptr_t>(vm->pop());
-  vm->push(Cell::from_int(a % b));
+  integer_op(vm, [](intptr_t a, intptr_t b) { return a % b; });
 }
 
 // TODO figure out semantics, is this identity or value based?
-static void prim_eq(VM* vm, Quotation*) {
-  auto b = vm->pop();
-  auto a = vm->pop();
+static bool cells_equal(Cell a, Cell b) {
   if (a == b) {
-    vm->push(vm->globals.True);
-    return;
+    return true;
   }
-  // TODO we maybe want to keep these on the stack in case we gc
-  // but at the moment we cant gc
   if (is_a<String>(a)) {
     if (is_a<String>(b)) {
       String* str_a = cast<String>(a);
       String* str_b = cast<String>(b);
       if (str_a->length() == str_b->length()) {
-        if (memcmp(str_a->data(), str_b->data(), str_a->length()) == 0) {
-          vm->push(vm->globals.True);
-          return;
-        }
+        return memcmp(str_a->data(), str_b->data(), str_a->length()) == 0;
       }
     }
   }
-  vm->push(vm->globals.False);
+  return false;
+}
+
+static void prim_eq(VM* vm, Quotation*) {
+  binary_op(vm, [vm](Cell a, Cell b) -> Cell {
+    return cells_equal(a, b) ? vm->globals.True : vm->globals.False;
+  });
 }
 
 static void prim_add(VM* vm, Quotation*) {
-  auto b = vm->pop();
-  auto a = vm->pop();
   // TODO allow other types
-  intptr_t result = cast<intptr_t>(a) + cast<intptr_t>(b);
-  vm->push(Cell::from_int(result));
+  integer_op(vm, [](intptr_t a, intptr_t b) { return a + b; });
 }
 
 static void prim_sub(VM* vm, Quotation*) {
-  auto b = vm->pop();
-  auto a = vm->pop();
   // TODO allow other types
-  intptr_t result = cast<intptr_t>(a) - cast<intptr_t>(b);
-  vm->push(Cell::from_int(result));
+  integer_op(vm, [](intptr_t a, intptr_t b) { return a - b; });
 }
 
 static void prim_bool(VM* vm, Quotation*) {
@@ -383,6 +523,15 @@ static void prim_set_raw_slot(VM* vm, Quotation*) {
   HSTL_ASSERT((uintptr_t)idx < sz);
 
   ((Cell*)obj)[idx] = value;
+  vm->heap_.write_barrier_slot(&((Cell*)obj)[idx]);
+  if (obj->tag() == CELL_WORD) {
+    Word* word = static_cast<Word*>(obj);
+    word->version = Cell::from_int(cast<intptr_t>(word->version) + 1);
+  }
+  if (obj->tag() == CELL_WORD || obj->tag() == CELL_QUOTE) {
+    // We may have changed the definition of something
+    vm->invalidate_code();
+  }
 }
 
 static void prim_raw_slot(VM* vm, Quotation*) {
@@ -406,11 +555,11 @@ static void prim_backtrace(VM* vm, Quotation*) {
   for (auto* frame = vm->call_stack_.begin(); frame < end; ++frame) {
     std::string_view word_name;
     if (frame->word != nullptr) {
-      word_name = *cast<Word>(frame->word)->name;
+      word_name = *frame->word->name;
     } else {
       word_name = "<Anonymous>"sv;
     }
-    fmt::print("{}+{}\n", word_name, cast<intptr_t>(frame->offset));
+    fmt::print("{}+{}\n", word_name, frame->offset());
   }
 
   // for ()
@@ -434,6 +583,63 @@ static void prim_assert(VM* vm, Quotation* q) {
   }
 }
 
+static void prim_sequence_stats(VM* vm, Quotation*) {
+  if (vm->sequence_stats_ == nullptr) {
+    std::cerr << "Sequence statistics are not being collected\n";
+    return;
+  }
+  vm->sequence_stats_->dump(std::cout);
+}
+
+/// Print the quotations which moved up a tier since the last call
+static void prim_tier_events(VM* vm, Quotation*) {
+  static const char* const TIER_NAMES[] = {"interpreted", "bytecode",
+                                           "native"};
+  for (const TierEvent& event : vm->tier_events_) {
+    std::string_view name = "<quotation>";
+    if (event.callable.is_a<Word>()) {
+      name = *cast<Word>(event.callable)->name;
+    }
+    fmt::print("{} -> {}\n", name, TIER_NAMES[event.tier]);
+  }
+  vm->tier_events_.clear();
+}
+
+/* #endregion */
+
+/* #region  Superinstructions */
+
+static void prim_over_over(VM* vm, Quotation*) {
+  Stack& stack = vm->stack_;
+  stack.require(2);
+  Cell b = stack.top(0);
+  Cell a = stack.top(1);
+  stack.push(a);
+  stack.push(b);
+}
+
+static void prim_nip(VM* vm, Quotation*) {
+  Stack& stack = vm->stack_;
+  stack.require(2);
+  stack.top(1) = stack.top(0);
+  stack.drop(1);
+}
+
+static void prim_dup_add(VM* vm, Quotation*) {
+  Cell& a = vm->stack_[0];
+  a = Cell::from_int(cast<intptr_t>(a) * 2);
+}
+
+static void prim_inc(VM* vm, Quotation*) {
+  Cell& a = vm->stack_[0];
+  a = Cell::from_int(cast<intptr_t>(a) + 1);
+}
+
+static void prim_dec(VM* vm, Quotation*) {
+  Cell& a = vm->stack_[0];
+  a = Cell::from_int(cast<intptr_t>(a) - 1);
+}
+
 /* #endregion */
 
 /* #region  Parsing primitives */
@@ -532,6 +738,30 @@ static void prim_lookup(VM* vm, Quotation*) {
   std::string str(vm_str->data(), vm_str->length());
   vm->push(Cell::from_raw(vm->lookup_symbol(str)));
 }*/
+/**
+ * Push the code for a reference to a local in scope.
+ *
+ * "name" reads the local, and "name!" writes it.
+ *
+ * \returns false if name isn't a local
+ */
+static bool parse_local(VM* vm, std::string_view name) {
+  LocalWord kind = LOCAL_GET;
+  if (name.size() > 1 && name.back() == '!') {
+    name.remove_suffix(1);
+    kind = LOCAL_SET;
+  }
+  const auto& locals = vm->parse_locals_;
+  auto it = std::find(locals.begin(), locals.end(), name);
+  if (it == locals.end()) {
+    return false;
+  }
+  // The last input ends up on top of the locals stack
+  vm->push(Cell::from_int(locals.end() - it - 1));
+  vm->push(vm->local_words_[kind].value);
+  return true;
+}
+
 static void parse_until(VM* vm, Quotation* q, std::string_view term) {
   while (true) {
     prim_lex_token(vm, q);
@@ -543,6 +773,9 @@ static void parse_until(VM* vm, Quotation* q, std::string_view term) {
       }
 
       std::string str(vm_str->data(), vm_str->length());
+      if (parse_local(vm, str)) {
+        continue;
+      }
       TypedCell<Word> word = cast<Word>(vm->lookup_symbol(str));
       HSTL_ASSERT(word != nullptr);
       if (word->is_parse_word) {
@@ -567,6 +800,100 @@ static void prim_quote_bootstrap(VM* vm, Quotation* q) {
   prim_arr_to_quote(vm, q);
 }
 
+/// Read the next token, which has to be a name
+static std::string expect_name(VM* vm) {
+  auto token = vm->lexer_.token(true);
+  if (!std::holds_alternative<std::string>(token)) {
+    throw Exception("Expected a name");
+  }
+  return std::get<std::string>(std::move(token));
+}
+
+/**
+ * Point the quotation literals in definition which use locals at scope, the
+ * definition of the "::" word they were parsed in.
+ *
+ * \returns true if definition uses locals, itself or through its literals
+ */
+static bool scope_literals(VM* vm, Quotation* scope, Array* definition) {
+  bool uses_locals = false;
+  for (const Cell* it = definition->begin(); it != definition->end(); ++it) {
+    if (match_local_word(*vm, it, definition->end()) != LOCAL_MAX) {
+      uses_locals = true;
+      continue;
+    }
+    if (!it->is_a<Quotation>()) {
+      continue;
+    }
+    Quotation* literal = cast<Quotation>(*it);
+    if (literal->scope == nullptr && literal->definition != nullptr &&
+        scope_literals(vm, scope, literal->definition)) {
+      literal->scope = scope;
+      vm->heap_.write_barrier(literal);
+      uses_locals = true;
+    }
+  }
+  return uses_locals;
+}
+
+/**
+ * Define a word whose inputs are bound to locals:
+ *
+ *     :: name ( a b -- c ) body ;
+ *
+ * The inputs are moved to VM::locals_ when the word is entered, and the body
+ * reads them by name, or writes them with "name!". Quotation literals in the
+ * body can use them too, as long as they run before the word returns. They
+ * use the locals of the innermost call of the word still running. The
+ * outputs are only documentation.
+ *
+ * Leaving the locals is the last thing the word does, so its final call is
+ * not a tail call.
+ */
+static void prim_define_with_locals(VM* vm, Quotation* q) {
+  // The name stays on the stack, so it is rooted while the body is parsed
+  prim_lex_token(vm, q);
+  if (!vm->peek().is_a<String>()) {
+    throw Exception("Expected a name");
+  }
+
+  if (expect_name(vm) != "(") {
+    throw Exception("Expected a stack effect");
+  }
+  std::vector<std::string> inputs;
+  std::string token = expect_name(vm);
+  for (; token != "--" && token != ")"; token = expect_name(vm)) {
+    inputs.push_back(std::move(token));
+  }
+  while (token != ")") {
+    token = expect_name(vm);
+  }
+
+  std::vector<std::string> outer = std::exchange(vm->parse_locals_, inputs);
+  struct RestoreScope {
+    ~RestoreScope() { vm->parse_locals_ = std::move(outer); }
+    VM* vm;
+    std::vector<std::string>& outer;
+  } restore{vm, outer};
+
+  const Cell count = Cell::from_int(inputs.size());
+  prim_mark_stack(vm, q);
+  if (!inputs.empty()) {
+    vm->push(count);
+    vm->push(vm->local_words_[LOCAL_ENTER].value);
+  }
+  parse_until(vm, q, ";"sv);
+  if (!inputs.empty()) {
+    vm->push(count);
+    vm->push(vm->local_words_[LOCAL_LEAVE].value);
+  }
+  prim_mark_to_array(vm, q);
+  prim_arr_to_quote(vm, q);
+  Quotation* definition = cast<Quotation>(vm->peek());
+  scope_literals(vm, definition, definition->definition);
+  prim_def(vm, q);
+}
+
 static void prim_parse_string(VM* vm, Quotation* q) {
   std::string s = vm->lexer_.read_until('"');
   auto vm_str = vm->allocate<String>(s.length() + 1);
@@ -26,6 +26,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <hustle/JIT/JIT.hpp>
 #include <hustle/Object.hpp>
 #include <hustle/Parser/BootstrapLexer.hpp>
 #include <hustle/Parser/Lexer.hpp>
@@ -138,12 +139,59 @@ int main(int argc, char** argv) {
 
   bool no_kernel = false;
   bool old_repl = false;
+  bool use_jit = false;
+  bool sequence_stats = false;
+  bool dump_optimizer = false;
+  uint32_t bytecode_threshold = 0;
+  uint32_t jit_threshold = 0;
+  VMOptions options;
   app.add_flag("--no-kernel", no_kernel, "Do not include the kernel");
   app.add_flag("--old-repl", old_repl, "Start up with the old repl");
+  app.add_flag("--jit,!--no-jit", use_jit,
+               "Compile hot quotations to native code (default: off)");
+  app.add_flag("--sequence-stats", sequence_stats,
+               "Collect statistics on common sequences of words. Print them "
+               "with sequence-stats");
+  app.add_flag("--dump-optimizer", dump_optimizer,
+               "Print every definition before and after it is optimized");
+  app.add_option("--bytecode-threshold", bytecode_threshold,
+                 "Invocation on which a quotation is lowered to bytecode");
+  app.add_option("--jit-threshold", jit_threshold,
+                 "Invocations before a quotation is compiled to native code");
+  app.add_option("--stack-size", options.stack_size,
+                 "Maximum depth of the data stack, in cells");
+  app.add_option("--call-depth", options.call_depth,
+                 "Maximum depth of the call stack, in frames");
+  app.add_option("--heap-initial", options.heap_initial,
+                 "Initial size of the old generation, in bytes. Accepts KB, "
+                 "MB and GB suffixes")
+      ->transform(CLI::AsSizeValue(false));
+  app.add_option("--heap-max", options.heap_max,
+                 "Size the old generation can grow to, in bytes. Accepts KB, "
+                 "MB and GB suffixes")
+      ->transform(CLI::AsSizeValue(false));
+  app.add_option("--gc-threads", options.gc_threads,
+                 "Threads copying objects in a full collection (default: 1)")
+      ->check(CLI::Range(1u, 256u));
 
   CLI11_PARSE(app, argc, argv);
 
-  VM vm;
+  VM vm(options);
+  if (bytecode_threshold != 0) {
+    vm.bytecode_threshold = bytecode_threshold;
+  }
+  if (jit_threshold != 0) {
+    vm.jit_threshold = jit_threshold;
+  }
+  if (use_jit && JIT::is_supported()) {
+    vm.set_jit(std::make_unique<JIT>(vm));
+  }
+  if (sequence_stats) {
+    vm.sequence_stats_ = std::make_unique<SequenceStats>();
+  }
+  if (dump_optimizer) {
+    vm.optimizer_.dump = &std::cerr;
+  }
   if (!no_kernel) {
     vm.load_kernel();
   }
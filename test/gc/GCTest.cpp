@@ -8,6 +8,7 @@
 #include <hustle/GC.hpp>
 #include <hustle/VM.hpp>
 #include <iterator>
+#include <string.h>
 
 using namespace hustle;
 TEST_CASE("Bogus", "[gc]") { CHECK(1 == 1); }
@@ -95,3 +96,260 @@ TEST_CASE("ObjectForwarding") {
   CHECK(o.is_forwarding());
   CHECK(o.get_forwarding() == &o2);
 }
+
+static String* make_string(Heap& heap, const char* str) {
+  size_t len = strlen(str);
+  return new (heap.allocate(object_allocation_size((String*)nullptr, str, len)))
+      String(str, len);
+}
+
+static Array* make_array(Heap& heap, size_t count) {
+  return new (heap.allocate(object_allocation_size((Array*)nullptr, count)))
+      Array(count);
+}
+
+TEST_CASE("Objects are promoted after surviving minor collections", "[gc]") {
+  Cell root;
+  Heap heap([&](Heap::MarkFunction fn) { fn((cell_t*)&root); });
+
+  root = make_string(heap, "young");
+  for (unsigned i = 1; i < Heap::TENURE_AGE; ++i) {
+    String* before = root.cast<String>();
+    heap.minor_gc();
+    CHECK(root.cast<String>() != before);
+    CHECK(heap.is_young(root.cast<String>()));
+  }
+  heap.minor_gc();
+  CHECK(heap.is_old(root.cast<String>()));
+
+  // Old objects stay put until a full collection
+  String* old = root.cast<String>();
+  heap.minor_gc();
+  CHECK(root.cast<String>() == old);
+  CHECK(std::string_view(*old) == "young");
+  CHECK(heap.major_collections == 0);
+  CHECK(heap.minor_collections == Heap::TENURE_AGE + 1);
+
+  heap.gc();
+  CHECK(root.cast<String>() != old);
+  CHECK(std::string_view(*root.cast<String>()) == "young");
+}
+
+TEST_CASE("Stores into old objects are found through the cards", "[gc]") {
+  Cell root;
+  Heap heap([&](Heap::MarkFunction fn) { fn((cell_t*)&root); });
+
+  root = make_array(heap, 2);
+  for (unsigned i = 0; i < Heap::TENURE_AGE; ++i) {
+    heap.minor_gc();
+  }
+  Array* array = root.cast<Array>();
+  REQUIRE(heap.is_old(array));
+
+  // The string is only reachable from the old array
+  (*array)[1] = make_string(heap, "only from old");
+  heap.write_barrier(array);
+  for (unsigned i = 0; i <= Heap::TENURE_AGE; ++i) {
+    heap.minor_gc();
+    REQUIRE(root.cast<Array>() == array);
+    CHECK(std::string_view(*(*array)[1].cast<String>()) == "only from old");
+  }
+  CHECK(heap.is_old((*array)[1].cast<String>()));
+
+  SECTION("after a full collection") {
+    heap.gc();
+    array = root.cast<Array>();
+    (*array)[0] = make_string(heap, "after a full collection");
+    heap.write_barrier_slot(&(*array)[0]);
+    heap.minor_gc();
+    CHECK(std::string_view(*(*array)[0].cast<String>()) ==
+          "after a full collection");
+  }
+}
+
+TEST_CASE("Large objects are not moved", "[gc]") {
+  Cell root;
+  Heap heap([&](Heap::MarkFunction fn) { fn((cell_t*)&root); });
+
+  const size_t count = Heap::LARGE_OBJECT_SIZE / sizeof(Cell);
+  Array* array = make_array(heap, count);
+  root = array;
+  CHECK(heap.is_large(array));
+
+  // The cards of a new large object start out marked, so it can be filled in
+  // without a write barrier
+  (*array)[count - 1] = make_string(heap, "last");
+  heap.minor_gc();
+  CHECK(root.cast<Array>() == array);
+
+  (*array)[0] = make_string(heap, "first");
+  heap.write_barrier_slot(&(*array)[0]);
+  for (unsigned i = 0; i <= Heap::TENURE_AGE; ++i) {
+    heap.minor_gc();
+  }
+  heap.gc();
+  CHECK(root.cast<Array>() == array);
+  CHECK(std::string_view(*(*array)[0].cast<String>()) == "first");
+  CHECK(std::string_view(*(*array)[count - 1].cast<String>()) == "last");
+
+  // Unreachable ones are freed
+  root = Cell::from_int(0);
+  heap.gc();
+  CHECK(heap.large_object_count() == 0);
+
+  SECTION("even when bigger than the old generation") {
+    const size_t big = 2 * Heap::DEFAULT_INITIAL_SIZE / sizeof(Cell);
+    // Nothing else was allocated, so collecting first wouldn't make room
+    const size_t collections = heap.major_collections;
+    root = make_array(heap, big);
+    CHECK(heap.major_collections == collections);
+    (*root.cast<Array>())[big - 1] = Cell::from_int(1);
+    heap.gc();
+    CHECK((*root.cast<Array>())[big - 1] == Cell::from_int(1));
+  }
+}
+
+TEST_CASE("The old generation grows and shrinks with the live set", "[gc]") {
+  std::vector<Cell> roots;
+  Heap heap(
+      [&](Heap::MarkFunction fn) {
+        for (Cell& root : roots) {
+          fn((cell_t*)&root);
+        }
+      },
+      Heap::DEFAULT_INITIAL_SIZE, 64 * 1024 * 1024);
+  const size_t initial = heap.capacity();
+
+  // Much more than the initial size stays live
+  const size_t count = 1024;
+  const size_t size = object_allocation_size((Array*)nullptr, count);
+  for (size_t i = 0; i < 4 * initial / size; ++i) {
+    roots.push_back(make_array(heap, count));
+  }
+  heap.gc();
+  CHECK(heap.capacity() > initial);
+  CHECK(heap.capacity() >= 2 * roots.size() * size);
+
+  // Memory is handed back once it has been mostly empty for a while
+  roots.clear();
+  for (unsigned i = 0; i < Heap::SHRINK_AFTER; ++i) {
+    heap.gc();
+  }
+  CHECK(heap.capacity() == initial);
+
+  SECTION("but not past its maximum size") {
+    CHECK_THROWS_AS(make_array(heap, 128 * 1024 * 1024 / sizeof(Cell)),
+                    Exception);
+  }
+}
+
+TEST_CASE("A full heap throws instead of collecting on every allocation",
+          "[gc]") {
+  // Copying threads need some room of their own, which mustn't come out of
+  // the maximum size
+  const unsigned threads = GENERATE(1u, 4u);
+  std::vector<Cell> roots;
+  Heap heap(
+      [&](Heap::MarkFunction fn) {
+        for (Cell& root : roots) {
+          fn((cell_t*)&root);
+        }
+      },
+      Heap::DEFAULT_INITIAL_SIZE, 8 * 1024 * 1024, threads);
+
+  auto fill = [&] {
+    while (true) {
+      roots.push_back(make_array(heap, 1024));
+    }
+  };
+  CHECK_THROWS_AS(fill(), Exception);
+  CHECK(heap.major_collections <= 4);
+
+  // Everything allocated before then is intact
+  for (size_t i = 0; i < roots.size(); ++i) {
+    CHECK(roots[i].cast<Array>()->count() == 1024);
+  }
+
+  // and dropping it makes room again
+  roots.clear();
+  heap.gc();
+  CHECK_NOTHROW(make_array(heap, 1024));
+}
+
+TEST_CASE("Collections copy objects breadth first", "[gc]") {
+  Cell root;
+  Heap heap([&](Heap::MarkFunction fn) { fn((cell_t*)&root); });
+
+  // root -> (left -> "left leaf", right -> "right leaf")
+  Array* left = make_array(heap, 1);
+  (*left)[0] = make_string(heap, "left leaf");
+  Array* right = make_array(heap, 1);
+  (*right)[0] = make_string(heap, "right leaf");
+  Array* array = make_array(heap, 2);
+  (*array)[0] = left;
+  (*array)[1] = right;
+  root = array;
+
+  auto check_order = [&] {
+    Array* copied = root.cast<Array>();
+    Array* copied_left = (*copied)[0].cast<Array>();
+    Array* copied_right = (*copied)[1].cast<Array>();
+    String* left_leaf = (*copied_left)[0].cast<String>();
+    String* right_leaf = (*copied_right)[0].cast<String>();
+    CHECK(std::string_view(*left_leaf) == "left leaf");
+    CHECK(std::string_view(*right_leaf) == "right leaf");
+    CHECK((void*)copied < (void*)copied_left);
+    CHECK((void*)copied_left < (void*)copied_right);
+    CHECK((void*)copied_right < (void*)left_leaf);
+    CHECK((void*)left_leaf < (void*)right_leaf);
+  };
+  heap.minor_gc();
+  check_order();
+  heap.gc();
+  check_order();
+}
+
+TEST_CASE("Major collections can copy with several threads", "[gc]") {
+  Cell root;
+  Heap heap([&](Heap::MarkFunction fn) { fn((cell_t*)&root); },
+            Heap::DEFAULT_INITIAL_SIZE, Heap::DEFAULT_MAX_SIZE, 4);
+  CHECK(heap.gc_threads() == 4);
+
+  // Nodes share children, so threads race to copy them
+  const size_t count = 20000;
+  auto child = [](size_t node, size_t k) { return (node * 7 + k) % node; };
+  root = make_array(heap, count);
+  REQUIRE(heap.is_large(root.cast<Array>()));
+  for (size_t i = 0; i < count; ++i) {
+    Array* node = make_array(heap, 4);
+    (*node)[0] = Cell::from_int(i);
+    for (size_t k = 1; k < 4 && i > 0; ++k) {
+      (*node)[k] = (*root.cast<Array>())[child(i, k)];
+    }
+    (*root.cast<Array>())[i] = node;
+    heap.write_barrier_slot(&(*root.cast<Array>())[i]);
+  }
+
+  auto check_nodes = [&] {
+    Array* table = root.cast<Array>();
+    for (size_t i = 0; i < count; ++i) {
+      Array* node = (*table)[i].cast<Array>();
+      REQUIRE((*node)[0] == Cell::from_int(i));
+      for (size_t k = 1; k < 4 && i > 0; ++k) {
+        REQUIRE((*node)[k] == (*table)[child(i, k)]);
+      }
+    }
+  };
+  for (int i = 0; i < 3; ++i) {
+    heap.gc();
+    check_nodes();
+  }
+
+  // The old generation can still be walked through its cards
+  Array* table = root.cast<Array>();
+  (*(*table)[1].cast<Array>())[1] = make_string(heap, "young");
+  heap.write_barrier_slot(&(*(*table)[1].cast<Array>())[1]);
+  heap.minor_gc();
+  CHECK(std::string_view(*(*(*table)[1].cast<Array>())[1].cast<String>()) ==
+        "young");
+}
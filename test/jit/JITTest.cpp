@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <catch2/catch.hpp>
+#include <hustle/JIT/JIT.hpp>
+#include <hustle/VM.hpp>
+
+#include <sstream>
+
+using namespace hustle;
+using namespace std::literals;
+
+static Quotation* make_quote(VM& vm, std::initializer_list<Cell> cells) {
+  auto definition = vm.allocate_handle<Array>(cells.size());
+  std::copy(cells.begin(), cells.end(), definition->begin());
+  Quotation* quote = vm.allocate<Quotation>();
+  quote->definition = definition;
+  quote->entry = nullptr;
+  return quote;
+}
+
+static Cell word(VM& vm, const char* name) {
+  return Cell::from_raw(vm.lookup_symbol(name));
+}
+
+static void evaluate(VM& vm, const char* source) {
+  vm.lexer_.add_stream(std::make_unique<std::istringstream>(source));
+  vm.run();
+}
+
+static void enable_jit(VM& vm, uint32_t threshold) {
+  vm.set_jit(std::make_unique<JIT>(vm));
+  vm.jit_threshold = threshold;
+}
+
+TEST_CASE("Hot quotations are compiled", "[jit]") {
+  if (!JIT::is_supported()) {
+    return;
+  }
+  VM vm;
+  enable_jit(vm, 2);
+  auto quote = vm.make_handle(make_quote(vm, {Cell::from_int(2), word(vm, "+"),
+                                              Cell::from_int(3),
+                                              word(vm, "*")}));
+
+  vm.push(Cell::from_int(5));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(21));
+  REQUIRE(quote->entry == nullptr);
+
+  for (int i = 0; i < 3; ++i) {
+    vm.push(Cell::from_int(i));
+    vm.call(quote.cell());
+    REQUIRE(vm.pop() == Cell::from_int((i + 2) * 3));
+    REQUIRE(quote->entry != nullptr);
+  }
+  REQUIRE(vm.stack_.depth() == 0);
+  REQUIRE(vm.call_stack_.begin() == vm.call_stack_.end());
+  REQUIRE(!vm.tier_events_.empty());
+  CHECK(vm.tier_events_.back().callable == quote.cell());
+  CHECK(vm.tier_events_.back().tier == TIER_NATIVE);
+}
+
+TEST_CASE("Compiled code reloads heap literals after a GC", "[jit]") {
+  if (!JIT::is_supported()) {
+    return;
+  }
+  VM vm;
+  enable_jit(vm, 1);
+
+  auto name = vm.allocate_handle<String>("foo", 3);
+  auto wrapped_word = vm.allocate_handle<Wrapper>();
+  wrapped_word->wrapped = word(vm, "dup");
+  auto wrapped_int = vm.allocate_handle<Wrapper>();
+  wrapped_int->wrapped = Cell::from_int(7);
+  auto quote = vm.make_handle(make_quote(
+      vm, {name.cell(), word(vm, "mark-stack"), Cell::from_int(1),
+           word(vm, "mark>array"), wrapped_word.cell(), wrapped_int.cell()}));
+
+  // Collect on every allocation, so the quote moves while its code is running
+  vm.heap_.debug_alloc = true;
+  vm.heap_.debug_alloc_major = GENERATE(false, true);
+
+  for (int i = 0; i < 2; ++i) {
+    vm.call(quote.cell());
+    REQUIRE(quote->entry != nullptr);
+    REQUIRE(vm.pop() == Cell::from_int(7));
+    REQUIRE(vm.pop() == word(vm, "dup"));
+    REQUIRE(vm.pop().is_a<Array>());
+    REQUIRE(std::string_view(*vm.pop().cast<String>()) == "foo"sv);
+  }
+}
+
+TEST_CASE("Exceptions propagate through compiled code", "[jit]") {
+  if (!JIT::is_supported()) {
+    return;
+  }
+  VM vm;
+  enable_jit(vm, 1);
+  auto quote = vm.make_handle(
+      make_quote(vm, {word(vm, "drop"), Cell::from_int(1)}));
+
+  REQUIRE_THROWS_AS(vm.call(quote.cell()), Exception);
+  REQUIRE(quote->entry != nullptr);
+}
+
+TEST_CASE("Compiled code is discarded when a primitive is redefined", "[jit]") {
+  if (!JIT::is_supported()) {
+    return;
+  }
+  VM vm;
+  enable_jit(vm, 1);
+  auto quote = vm.make_handle(make_quote(
+      vm, {Cell::from_int(1), word(vm, "+"), Cell::from_int(0)}));
+
+  vm.push(Cell::from_int(5));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(0));
+  REQUIRE(vm.pop() == Cell::from_int(6));
+  REQUIRE(quote->entry != nullptr);
+
+  vm.push(vm.allocate<String>("+", 1));
+  vm.push(make_quote(vm, {word(vm, "-")}));
+  vm.call(word(vm, "def"));
+
+  vm.push(Cell::from_int(5));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(0));
+  REQUIRE(vm.pop() == Cell::from_int(4));
+}
+
+TEST_CASE("Compiled code grows the stack", "[jit]") {
+  if (!JIT::is_supported()) {
+    return;
+  }
+  VMOptions options;
+  options.stack_size = 3 * VM::STACK_SIZE;
+  VM vm(options);
+  enable_jit(vm, 1);
+  auto quote = vm.make_handle(make_quote(
+      vm, {Cell::from_int(1), Cell::from_int(2), Cell::from_int(3)}));
+
+  const size_t calls = 2 * VM::STACK_SIZE / 3;
+  for (size_t i = 0; i < calls; ++i) {
+    vm.call(quote.cell());
+  }
+  REQUIRE(quote->entry != nullptr);
+  CHECK(vm.stack_.depth() == calls * 3);
+  CHECK(vm.stack_.capacity() > VM::STACK_SIZE);
+  CHECK(vm.pop() == Cell::from_int(3));
+  CHECK(vm.pop() == Cell::from_int(2));
+  CHECK(vm.pop() == Cell::from_int(1));
+
+  CHECK_THROWS_WITH(
+      [&] {
+        for (;;) {
+          vm.call(quote.cell());
+        }
+      }(),
+      "Stack overflow");
+  CHECK(vm.stack_.depth() == vm.stack_.limit());
+}
+
+TEST_CASE("Compiled code uses the locals of its word", "[jit]") {
+  if (!JIT::is_supported()) {
+    return;
+  }
+  VM vm;
+  enable_jit(vm, 1);
+  evaluate(vm, ":: with-10 ( q -- ) 10 q call ; "
+               ":: add-to ( n -- r ) { n + } with-10 ; "
+               ":: set-to-10 ( n -- r ) { n! } with-10 n ;");
+  for (int i = 0; i < 3; ++i) {
+    vm.push(Cell::from_int(5));
+    vm.call(word(vm, "add-to"));
+    CHECK(vm.pop() == Cell::from_int(15));
+    vm.push(Cell::from_int(5));
+    vm.call(word(vm, "set-to-10"));
+    CHECK(vm.pop() == Cell::from_int(10));
+  }
+  CHECK(cast<Word>(word(vm, "add-to"))->definition->entry != nullptr);
+  CHECK(vm.stack_.depth() == 0);
+  CHECK(vm.locals_.depth() == 0);
+}
@@ -5,9 +5,11 @@
  */
 
 #include "hustle/Support/Memory.hpp"
+#include "hustle/config.h"
 
 #include <catch2/catch.hpp>
 #include <signal.h>
+#include <stdexcept>
 #include <stdio.h>
 #ifdef _WIN32
 
@@ -94,3 +96,30 @@ TEST_CASE("Basic allocation test", "[memory]") {
                                                     [=] { data[0] = 1; });
   CHECK(handler_triggered == true);
 }
+
+#if HUSTLE_GUARD_PAGES
+TEST_CASE("Touching a guard calls its handler", "[memory]") {
+  const size_t page = Memory::page_size();
+  auto segment =
+      Memory::allocate(2 * page, Memory::MEM_READ | Memory::MEM_WRITE);
+  int calls = 0;
+  Memory::add_guard(
+      segment.base(), page,
+      [](void* context) {
+        ++*static_cast<int*>(context);
+        throw std::runtime_error("guard");
+      },
+      &calls);
+
+  volatile char* guard = (char*)segment.base();
+  volatile char* open = guard + page;
+  for (int i = 1; i <= 2; i++) {
+    CHECK_THROWS_WITH(guard[page - 1] = 1, "guard");
+    CHECK(calls == i);
+  }
+  open[0] = 1;
+  CHECK(open[0] == 1);
+
+  Memory::remove_guard(segment.base());
+}
+#endif
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <hustle/JIT/JIT.hpp>
 #include <hustle/Object.hpp>
 #include <hustle/Parser/BootstrapLexer.hpp>
 #include <hustle/Support/Assert.hpp>
@@ -121,6 +122,8 @@ int main(int argc, char** argv) {
   std::string input_file;
   std::string xml_out;
   std::string suite_name;
+  bool use_jit = false;
+  bool major_gc = false;
   CLI::App app{"hustle-test"};
   app.add_option("test_suite", input_file, "Input test suite to run")
       ->check(CLI::ExistingFile)
@@ -129,6 +132,11 @@ int main(int argc, char** argv) {
 
   app.add_option("--xml", xml_out, "File to output xml results")
       ->needs(name_option);
+  app.add_flag("--jit", use_jit,
+               "Compile quotations to native code on first use");
+  app.add_flag("--major-gc", major_gc,
+               "Run a full collection before every allocation, instead of a "
+               "minor one");
 
   CLI11_PARSE(app, argc, argv);
 
@@ -137,9 +145,14 @@ int main(int argc, char** argv) {
   }
 
   VM vm;
+  if (use_jit && JIT::is_supported()) {
+    vm.set_jit(std::make_unique<JIT>(vm));
+    vm.jit_threshold = 1;
+  }
   vm.load_kernel();
 
   vm.heap_.debug_alloc = true;
+  vm.heap_.debug_alloc_major = major_gc;
   vm.register_primitive("check", check_handler);
 
   // std::ifstream fstream(input_file);
@@ -166,11 +179,11 @@ int main(int argc, char** argv) {
     for (auto* frame = vm.call_stack_.begin(); frame < end; ++frame) {
       std::string_view word_name;
       if (frame->word != nullptr) {
-        word_name = *cast<Word>(frame->word)->name;
+        word_name = *frame->word->name;
       } else {
         word_name = "<Anonymous>"sv;
       }
-      fmt::print("{}+{}\n", word_name, cast<intptr_t>(frame->offset));
+      fmt::print("{}+{}\n", word_name, frame->offset());
     }
   }
 
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <catch2/catch.hpp>
+#include <hustle/VM.hpp>
+#include <hustle/VM/AOT.hpp>
+
+using namespace hustle;
+
+// Generated from aot_words.hsl
+namespace hustle {
+void register_aot_test_words(VM& vm);
+}
+
+static Word* word(VM& vm, const char* name) {
+  return cast<Word>(Cell::from_raw(vm.lookup_symbol(name)));
+}
+
+static Cell run(VM& vm, const char* name) {
+  vm.call(word(vm, name));
+  REQUIRE(vm.stack_.depth() == 1);
+  return vm.pop();
+}
+
+TEST_CASE("Words compiled ahead of time can be registered", "[aot]") {
+  VM vm;
+  register_aot_test_words(vm);
+
+  Quotation* square = word(vm, "aot-square")->definition;
+  CHECK(square->is_leaf);
+  CHECK(square->entry != nullptr);
+  CHECK(square->definition == nullptr);
+  CHECK(square->effect.in == 1);
+  CHECK(square->effect.out == 1);
+
+  vm.push(Cell::from_int(3));
+  CHECK(run(vm, "aot-cube") == Cell::from_int(27));
+  vm.push(Cell::from_int(-7));
+  CHECK(run(vm, "aot-abs") == Cell::from_int(7));
+  vm.push(Cell::from_int(7));
+  CHECK(run(vm, "aot-abs") == Cell::from_int(7));
+  vm.push(Cell::from_int(100));
+  CHECK(run(vm, "aot-sum-to") == Cell::from_int(5050));
+
+  // Cells held across calls must survive collections
+  vm.heap_.debug_alloc = true;
+  vm.heap_.debug_alloc_major = GENERATE(false, true);
+  vm.push(Cell::from_int(1));
+  vm.push(Cell::from_int(5));
+  vm.call(word(vm, "aot-under-inc"));
+  CHECK(vm.pop() == Cell::from_int(5));
+  CHECK(vm.pop() == Cell::from_int(2));
+
+  SECTION("but not if they need the interpreter") {
+    CHECK(vm.symbol_table_.count("aot-greeting") == 0);
+    CHECK(vm.symbol_table_.count("aot-fact") == 0);
+  }
+
+  SECTION("over existing definitions") {
+    auto before = vm.make_handle(word(vm, "aot-square"));
+    Cell version = before->version;
+    register_aot_test_words(vm);
+    CHECK(word(vm, "aot-square") == (Word*)before);
+    CHECK(before->version != version);
+    vm.push(Cell::from_int(4));
+    CHECK(run(vm, "aot-square") == Cell::from_int(16));
+  }
+}
+
+static void use_primitive(VM* vm, Quotation*) {}
+
+TEST_CASE("Compiled words only use leaf primitives", "[aot]") {
+  VM vm;
+  const AOTWord words[] = {{"aot-use", &use_primitive, StackEffect{}}};
+  VM::CallType entries[1];
+
+  const char* const leaf[] = {"dup"};
+  register_aot_words(vm, {words, 1, leaf, entries, 1});
+  CHECK(entries[0] == word(vm, "dup")->definition->entry);
+  CHECK(word(vm, "aot-use")->definition->entry == &use_primitive);
+
+  const char* const missing[] = {"no-such-primitive"};
+  CHECK_THROWS_AS(register_aot_words(vm, {words, 1, missing, entries, 1}),
+                  Exception);
+
+  const char* const not_leaf[] = {"call"};
+  CHECK_THROWS_AS(register_aot_words(vm, {words, 1, not_leaf, entries, 1}),
+                  Exception);
+}
@@ -54,3 +54,525 @@ TEST_CASE("Can define function", "[function]") {
   vm.call(Cell::from_raw(add3_func));
   REQUIRE(vm.pop() == Cell::from_int(8));
 }
+
+// Build an anonymous quotation from a list of cells
+static Quotation* make_quote(VM& vm, std::initializer_list<Cell> cells) {
+  auto definition = vm.allocate_handle<Array>(cells.size());
+  std::copy(cells.begin(), cells.end(), definition->begin());
+  Quotation* quote = vm.allocate<Quotation>();
+  quote->definition = definition;
+  quote->entry = nullptr;
+  return quote;
+}
+
+static Cell word(VM& vm, const char* name) {
+  return Cell::from_raw(vm.lookup_symbol(name));
+}
+
+// Find the fused word for a superinstruction pattern
+static Cell super_word(VM& vm, std::string_view pattern) {
+  for (auto& super : vm.superinstructions_) {
+    if (std::string_view(*super.word->name) == pattern) {
+      return super.word;
+    }
+  }
+  FAIL("No superinstruction " << pattern);
+  return Cell::from_int(0);
+}
+
+// Count the instructions with a given opcode in an instruction stream
+static size_t count_opcode(Array* code, Opcode op) {
+  size_t count = 0;
+  for (Cell* ip = code->begin(); ip != code->end();) {
+    Opcode current = decode_opcode(*ip);
+    count += (current == op);
+    ip += OPCODE_SIZE[current];
+  }
+  return count;
+}
+
+static void define(VM& vm, std::string_view name,
+                   std::initializer_list<Cell> cells) {
+  auto quote = vm.make_handle(make_quote(vm, cells));
+  vm.push(allocate_string(vm, name));
+  vm.push(quote.cell());
+  vm.call(word(vm, "def"));
+}
+
+TEST_CASE("Quotations are compiled once they are warm", "[function]") {
+  VM vm;
+  auto quote =
+      vm.make_handle(make_quote(vm, {Cell::from_int(2), word(vm, "+")}));
+  REQUIRE(quote->code == nullptr);
+
+  // Interpreted until the call which reaches bytecode_threshold
+  REQUIRE(vm.bytecode_threshold == 2);
+  vm.push(Cell::from_int(4));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(6));
+  REQUIRE(quote->code == nullptr);
+
+  vm.push(Cell::from_int(5));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(7));
+  REQUIRE(quote->code != nullptr);
+
+  vm.heap_.gc();
+  vm.push(Cell::from_int(1));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(3));
+}
+
+TEST_CASE("Redefining a word updates existing callers", "[function]") {
+  VM vm;
+  define(vm, "double"sv, {Cell::from_int(2), word(vm, "*")});
+  define(vm, "quad"sv, {word(vm, "double"), word(vm, "double")});
+
+  vm.push(Cell::from_int(3));
+  vm.call(word(vm, "quad"));
+  REQUIRE(vm.pop() == Cell::from_int(12));
+
+  define(vm, "double"sv, {Cell::from_int(3), word(vm, "*")});
+  vm.push(Cell::from_int(3));
+  vm.call(word(vm, "quad"));
+  REQUIRE(vm.pop() == Cell::from_int(27));
+
+  // Primitive calls are resolved when the quote is compiled, so make sure we
+  // notice when a primitive is replaced
+  define(vm, "inc"sv, {Cell::from_int(1), word(vm, "+")});
+  vm.push(Cell::from_int(5));
+  vm.call(word(vm, "inc"));
+  REQUIRE(vm.pop() == Cell::from_int(6));
+
+  define(vm, "+"sv, {word(vm, "-")});
+  vm.push(Cell::from_int(5));
+  vm.call(word(vm, "inc"));
+  REQUIRE(vm.pop() == Cell::from_int(4));
+}
+
+TEST_CASE("Redefining a word changes it in place", "[function]") {
+  VM vm;
+  define(vm, "twice"sv, {Cell::from_int(2), word(vm, "*")});
+  Word* twice = cast<Word>(word(vm, "twice"));
+  const Cell version = twice->version;
+  CHECK(!twice->is_parse_word);
+
+  // Parsed before the redefinition, and still interpreted
+  auto caller = vm.make_handle(make_quote(vm, {word(vm, "twice")}));
+  vm.push(Cell::from_int(5));
+  vm.call(caller.cell());
+  REQUIRE(vm.pop() == Cell::from_int(10));
+
+  // defp makes the same word a parse word
+  auto definition =
+      vm.make_handle(make_quote(vm, {Cell::from_int(3), word(vm, "*")}));
+  vm.push(allocate_string(vm, "twice"sv));
+  vm.push(definition.cell());
+  vm.call(word(vm, "defp"));
+  twice = cast<Word>(word(vm, "twice"));
+  CHECK(twice == cast<Word>(caller->definition->begin()[0]));
+  CHECK((Quotation*)twice->definition == (Quotation*)definition);
+  CHECK(twice->is_parse_word);
+  CHECK(twice->version != version);
+
+  vm.push(Cell::from_int(5));
+  vm.call(caller.cell());
+  REQUIRE(vm.pop() == Cell::from_int(15));
+
+  // and def makes it an ordinary word again
+  define(vm, "twice"sv, {Cell::from_int(4), word(vm, "*")});
+  CHECK(cast<Word>(word(vm, "twice")) == twice);
+  CHECK(!twice->is_parse_word);
+  vm.push(Cell::from_int(5));
+  vm.call(caller.cell());
+  REQUIRE(vm.pop() == Cell::from_int(20));
+}
+
+TEST_CASE("Call sites are specialised after their first call", "[function]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+  define(vm, "double"sv, {Cell::from_int(2), word(vm, "*")});
+  auto quote = vm.make_handle(make_quote(
+      vm, {word(vm, "double"), word(vm, "double"), Cell::from_int(1)}));
+
+  vm.push(Cell::from_int(3));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(1));
+  REQUIRE(vm.pop() == Cell::from_int(12));
+
+  Quotation* definition = cast<Word>(word(vm, "double"))->definition;
+  Array* code = quote->code;
+  CHECK(std::count(code->begin(), code->end(), Cell(definition)) == 2);
+  CHECK(count_opcode(code, OP_CALL_QUOTE) == 2);
+
+  // Redefining a word which isn't a primitive doesn't throw away code
+  const intptr_t epoch = vm.code_epoch_;
+  define(vm, "double"sv, {Cell::from_int(3), word(vm, "*")});
+  CHECK(vm.code_epoch_ == epoch);
+  vm.push(Cell::from_int(3));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(1));
+  REQUIRE(vm.pop() == Cell::from_int(27));
+  CHECK((Array*)quote->code == code);
+  definition = cast<Word>(word(vm, "double"))->definition;
+  CHECK(std::count(code->begin(), code->end(), Cell(definition)) == 2);
+}
+
+TEST_CASE("Leaf primitives are called without a frame", "[function]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+  CHECK(cast<Word>(word(vm, "+"))->definition->is_leaf);
+  CHECK_FALSE(cast<Word>(word(vm, "def"))->definition->is_leaf);
+
+  auto quote = vm.make_handle(make_quote(
+      vm, {Cell::from_int(20), Cell::from_int(10), word(vm, "*"),
+           Cell::from_int(40), word(vm, "/"), word(vm, "debug-break")}));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(5));
+
+  Array* code = quote->code;
+  CHECK(count_opcode(code, OP_CALL_LEAF) == 2);
+  CHECK(count_opcode(code, OP_TAIL_CALL_PRIMITIVE) == 1);
+}
+
+TEST_CASE("Control flow runs in the interpreter loop", "[function]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+
+  // { 100 + } { 200 + } ? call
+  auto if_true = vm.make_handle(
+      make_quote(vm, {Cell::from_int(100), word(vm, "+")}));
+  auto if_false = vm.make_handle(
+      make_quote(vm, {Cell::from_int(200), word(vm, "+")}));
+  auto branch = vm.make_handle(
+      make_quote(vm, {if_true.cell(), if_false.cell(), word(vm, "?"),
+                      word(vm, "call"), Cell::from_int(50)}));
+  vm.push(Cell::from_int(1));
+  vm.push(vm.globals.True);
+  vm.call(branch.cell());
+  REQUIRE(vm.pop() == Cell::from_int(50));
+  REQUIRE(vm.pop() == Cell::from_int(101));
+  vm.push(Cell::from_int(1));
+  vm.push(vm.globals.False);
+  vm.call(branch.cell());
+  REQUIRE(vm.pop() == Cell::from_int(50));
+  REQUIRE(vm.pop() == Cell::from_int(201));
+  CHECK(count_opcode(branch->code, OP_BRANCH_FALSE) == 1);
+  CHECK(count_opcode(branch->code, OP_CALL_DYNAMIC) == 0);
+
+  // 0 { dup 100 < } { 1 + } while
+  auto condition = vm.make_handle(make_quote(
+      vm, {word(vm, "dup"), Cell::from_int(100), word(vm, "<")}));
+  auto body = vm.make_handle(
+      make_quote(vm, {Cell::from_int(1), word(vm, "+")}));
+  auto loop = vm.make_handle(
+      make_quote(vm, {Cell::from_int(0), condition.cell(), body.cell(),
+                      word(vm, "while")}));
+  vm.call(loop.cell());
+  REQUIRE(vm.pop() == Cell::from_int(100));
+  CHECK(count_opcode(loop->code, OP_JUMP) == 1);
+
+  // The same loop, with quotations which aren't known until it runs
+  auto dynamic_loop = vm.make_handle(make_quote(vm, {word(vm, "while")}));
+  vm.push(Cell::from_int(0));
+  vm.push(condition.cell());
+  vm.push(body.cell());
+  vm.call(dynamic_loop.cell());
+  REQUIRE(vm.pop() == Cell::from_int(100));
+  CHECK(count_opcode(dynamic_loop->code, OP_WHILE) == 1);
+
+  // The value set aside by dip survives a GC while the quotation runs
+  auto name = vm.allocate_handle<String>("foo", 3);
+  auto inner = vm.make_handle(make_quote(vm, {Cell::from_int(10)}));
+  auto dip = vm.make_handle(
+      make_quote(vm, {name.cell(), inner.cell(), word(vm, "dip")}));
+  vm.heap_.debug_alloc = true;
+  vm.heap_.debug_alloc_major = GENERATE(false, true);
+  vm.call(dip.cell());
+  vm.heap_.debug_alloc = false;
+  REQUIRE(std::string_view(*vm.pop().cast<String>()) == "foo"sv);
+  REQUIRE(vm.pop() == Cell::from_int(10));
+  CHECK(count_opcode(dip->code, OP_DIP) == 1);
+}
+
+TEST_CASE("Runs with a known stack effect are checked once", "[function]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+  auto quote = vm.make_handle(
+      make_quote(vm, {word(vm, "dup"), Cell::from_int(10), word(vm, "+"),
+                      word(vm, "swap")}));
+  StackEffect effect = infer_effect(vm, quote);
+  CHECK(effect.in == 1);
+  CHECK(effect.out == 2);
+  CHECK(effect.growth == 2);
+
+  vm.push(Cell::from_int(5));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(5));
+  REQUIRE(vm.pop() == Cell::from_int(15));
+  CHECK(count_opcode(quote->code, OP_CHECK_STACK) == 1);
+  CHECK(count_opcode(quote->code, OP_PUSH) == 0);
+  CHECK(count_opcode(quote->code, OP_CALL_LEAF) == 0);
+
+  // 0 { dup 100 < } { 1 + } while
+  auto condition = vm.make_handle(make_quote(
+      vm, {word(vm, "dup"), Cell::from_int(100), word(vm, "<")}));
+  auto body = vm.make_handle(
+      make_quote(vm, {Cell::from_int(1), word(vm, "+")}));
+  auto loop = vm.make_handle(
+      make_quote(vm, {Cell::from_int(0), condition.cell(), body.cell(),
+                      word(vm, "while")}));
+  effect = infer_effect(vm, loop);
+  CHECK(effect.in == 0);
+  CHECK(effect.out == 1);
+  vm.call(loop.cell());
+  REQUIRE(vm.pop() == Cell::from_int(100));
+  CHECK(count_opcode(loop->code, OP_CHECK_STACK) == 1);
+
+  // Branches which leave different amounts on the stack
+  auto if_true = vm.make_handle(make_quote(vm, {word(vm, "drop")}));
+  auto if_false = vm.make_handle(make_quote(vm, {}));
+  auto branch = vm.make_handle(make_quote(
+      vm, {if_true.cell(), if_false.cell(), word(vm, "?"), word(vm, "call")}));
+  CHECK_FALSE(infer_effect(vm, branch).known());
+
+  // Words other than primitives can be redefined
+  define(vm, "double"sv, {Cell::from_int(2), word(vm, "*")});
+  auto caller = vm.make_handle(make_quote(vm, {word(vm, "double")}));
+  CHECK_FALSE(infer_effect(vm, caller).known());
+
+  // A run which would underflow fails before any of it runs
+  REQUIRE_THROWS_AS(vm.call(quote.cell()), Exception);
+  CHECK(vm.stack_.depth() == 0);
+}
+
+TEST_CASE("Common sequences are fused into superinstructions", "[function]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+  auto quote = vm.make_handle(make_quote(
+      vm, {word(vm, "swap"), word(vm, "drop"), Cell::from_int(1),
+           word(vm, "+")}));
+
+  vm.push(Cell::from_int(3));
+  vm.push(Cell::from_int(4));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(5));
+
+  Array* code = quote->code;
+  CHECK(std::count(code->begin(), code->end(), super_word(vm, "swap drop")) ==
+        1);
+  CHECK(std::count(code->begin(), code->end(), super_word(vm, "1 +")) == 1);
+  CHECK(std::count(code->begin(), code->end(), word(vm, "drop")) == 0);
+
+  // Redefining part of a pattern stops it from being fused
+  define(vm, "drop"sv, {word(vm, "dup")});
+  vm.push(Cell::from_int(3));
+  vm.push(Cell::from_int(4));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(4));
+  REQUIRE(vm.pop() == Cell::from_int(3));
+  REQUIRE(vm.pop() == Cell::from_int(4));
+  code = quote->code;
+  CHECK(std::count(code->begin(), code->end(), super_word(vm, "swap drop")) ==
+        0);
+
+  // Fused words can't be named
+  CHECK(vm.symbol_table_.count("swap drop") == 0);
+  CHECK(cast<Word>(super_word(vm, "1 +"))->definition->is_leaf);
+}
+
+TEST_CASE("Sequence statistics are collected", "[function]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+  vm.sequence_stats_ = std::make_unique<SequenceStats>();
+  auto quote = vm.make_handle(make_quote(vm, {Cell::from_int(1), word(vm, "+"),
+                                              Cell::from_int(1),
+                                              word(vm, "+")}));
+  vm.push(Cell::from_int(1));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(3));
+
+  auto& pairs = vm.sequence_stats_->pairs();
+  CHECK(pairs.at("1 +") == 2);
+  CHECK(pairs.at("+ 1") == 1);
+  auto& triples = vm.sequence_stats_->triples();
+  CHECK(triples.at("1 + 1") == 1);
+  CHECK(triples.at("+ 1 +") == 1);
+}
+
+TEST_CASE("Quotations record when they move up a tier", "[function]") {
+  VM vm;
+  define(vm, "add2"sv, {Cell::from_int(2), word(vm, "+")});
+  Quotation* definition = cast<Word>(word(vm, "add2"))->definition;
+  auto caller = vm.make_handle(make_quote(vm, {word(vm, "add2")}));
+
+  vm.push(Cell::from_int(1));
+  vm.call(caller.cell());
+  REQUIRE(vm.pop() == Cell::from_int(3));
+  CHECK(vm.tier_events_.empty());
+
+  vm.push(Cell::from_int(1));
+  vm.call(caller.cell());
+  REQUIRE(vm.pop() == Cell::from_int(3));
+  REQUIRE(vm.tier_events_.size() == 2);
+  CHECK(vm.tier_events_[0].callable == caller.cell());
+  CHECK(vm.tier_events_[0].tier == TIER_BYTECODE);
+  CHECK(vm.tier_events_[1].callable == word(vm, "add2"));
+  CHECK(vm.tier_events_[1].tier == TIER_BYTECODE);
+  CHECK(definition->code != nullptr);
+}
+
+TEST_CASE("Backward jumps are counted", "[function]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+  // 0 { dup 10 < } { 1 + } while
+  auto condition = vm.make_handle(make_quote(
+      vm, {word(vm, "dup"), Cell::from_int(10), word(vm, "<")}));
+  auto body =
+      vm.make_handle(make_quote(vm, {Cell::from_int(1), word(vm, "+")}));
+  auto loop = vm.make_handle(
+      make_quote(vm, {Cell::from_int(0), condition.cell(), body.cell(),
+                      word(vm, "while")}));
+  vm.call(loop.cell());
+  REQUIRE(vm.pop() == Cell::from_int(10));
+  CHECK(loop->invocations == 1);
+  CHECK(loop->back_edges == 10);
+}
+
+static int listener_calls = 0;
+static void count_listener_calls() { ++listener_calls; }
+
+TEST_CASE("Interpreter runs with a debug listener", "[function]") {
+  VM vm;
+  listener_calls = 0;
+  REQUIRE(vm.set_debug_listener(count_listener_calls) == nullptr);
+
+  auto quote = vm.make_handle(make_quote(
+      vm, {Cell::from_int(2), word(vm, "debug-break"), Cell::from_int(3),
+           word(vm, "+")}));
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(5));
+  CHECK(listener_calls == 1);
+
+  REQUIRE(vm.set_debug_listener(nullptr) == count_listener_calls);
+  vm.call(quote.cell());
+  REQUIRE(vm.pop() == Cell::from_int(5));
+  CHECK(listener_calls == 1);
+}
+
+TEST_CASE("Frames are updated when their code moves", "[function]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+  // inner: mark-stack 1 2 mark>array drop
+  define(vm, "inner",
+         {word(vm, "mark-stack"), Cell::from_int(1), Cell::from_int(2),
+          word(vm, "mark>array"), word(vm, "drop")});
+  auto quote = vm.make_handle(make_quote(
+      vm, {Cell::from_int(5), word(vm, "inner"), Cell::from_int(3),
+           word(vm, "+")}));
+
+  // Collect on every allocation, so the allocations made by inner move the
+  // code of both frames until it is promoted
+  vm.heap_.debug_alloc = true;
+  vm.heap_.debug_alloc_major = GENERATE(false, true);
+  vm.call(quote.cell());
+  vm.call(quote.cell());
+  vm.heap_.debug_alloc = false;
+  CHECK(vm.heap_.is_old((Array*)quote->code));
+  REQUIRE(vm.pop() == Cell::from_int(8));
+  REQUIRE(vm.pop() == Cell::from_int(8));
+  CHECK(vm.call_stack_.begin() == vm.call_stack_.end());
+}
+
+TEST_CASE("Cold code runs in the interpreter loop", "[function]") {
+  VMOptions options;
+  options.call_depth = 256;
+  VM vm(options);
+  vm.bytecode_threshold = std::numeric_limits<uint32_t>::max();
+  define(vm, "countdown", {});
+  define(vm, "deep", {});
+  // countdown: dup 0 > { 1 - countdown } { } ? call
+  auto next = vm.make_handle(make_quote(
+      vm, {Cell::from_int(1), word(vm, "-"), word(vm, "countdown")}));
+  auto done = vm.make_handle(make_quote(vm, {}));
+  define(vm, "countdown",
+         {word(vm, "dup"), Cell::from_int(0), word(vm, ">"), next.cell(),
+          done.cell(), word(vm, "?"), word(vm, "call")});
+  // deep: dup 0 > { 1 - deep 1 + } { } ? call
+  auto recurse = vm.make_handle(
+      make_quote(vm, {Cell::from_int(1), word(vm, "-"), word(vm, "deep"),
+                      Cell::from_int(1), word(vm, "+")}));
+  define(vm, "deep",
+         {word(vm, "dup"), Cell::from_int(0), word(vm, ">"), recurse.cell(),
+          done.cell(), word(vm, "?"), word(vm, "call")});
+
+  SECTION("with calls in tail position reusing their frame") {
+    vm.push(Cell::from_int(100000));
+    vm.call(word(vm, "countdown"));
+    REQUIRE(vm.pop() == Cell::from_int(0));
+  }
+
+  SECTION("with one frame for each call") {
+    vm.push(Cell::from_int(250));
+    vm.call(word(vm, "deep"));
+    REQUIRE(vm.pop() == Cell::from_int(250));
+    CHECK(cast<Word>(word(vm, "deep"))->definition->code == nullptr);
+
+    CallStack::State entry = vm.call_stack_.get_state();
+    vm.push(Cell::from_int(300));
+    CHECK_THROWS_WITH(vm.call(word(vm, "deep")), "Stack overflow");
+    vm.call_stack_.restore_state(entry);
+    vm.stack_.clear();
+  }
+
+  SECTION("while its definition moves") {
+    // 3 { "foo" mark-stack 1 mark>array drop } dip deep
+    auto name = vm.allocate_handle<String>("foo", 3);
+    auto inner = vm.make_handle(
+        make_quote(vm, {name.cell(), word(vm, "mark-stack"), Cell::from_int(1),
+                        word(vm, "mark>array"), word(vm, "drop")}));
+    auto quote = vm.make_handle(
+        make_quote(vm, {Cell::from_int(3), inner.cell(), word(vm, "dip"),
+                        word(vm, "deep")}));
+    vm.heap_.debug_alloc = true;
+    vm.heap_.debug_alloc_major = GENERATE(false, true);
+    vm.call(quote.cell());
+    vm.heap_.debug_alloc = false;
+    REQUIRE(vm.pop() == Cell::from_int(3));
+    REQUIRE(std::string_view(*vm.pop().cast<String>()) == "foo"sv);
+  }
+  CHECK(vm.call_stack_.begin() == vm.call_stack_.end());
+}
+
+TEST_CASE("Stack overflows leave the VM usable", "[function]") {
+  // Both stacks start smaller than their limits, so they grow first
+  VMOptions options;
+  options.stack_size = 4 * VM::STACK_SIZE;
+  options.call_depth = 4096;
+  VM vm(options);
+  // Placeholders, so the definitions below can refer to themselves
+  define(vm, "fill", {});
+  define(vm, "deep", {});
+  // fill: 1 fill
+  define(vm, "fill", {Cell::from_int(1), word(vm, "fill")});
+  // deep: deep 1
+  define(vm, "deep", {word(vm, "deep"), Cell::from_int(1)});
+
+  // Errors leave the frames of the failed call for debugging, so unwind them
+  // as an embedder would
+  CallStack::State entry = vm.call_stack_.get_state();
+  for (int i = 0; i < 2; i++) {
+    CHECK_THROWS_WITH(vm.call(word(vm, "fill")), "Stack overflow");
+    CHECK(vm.stack_.depth() == options.stack_size);
+    vm.call_stack_.restore_state(entry);
+    vm.stack_.clear();
+    CHECK_THROWS_WITH(vm.call(word(vm, "deep")), "Stack overflow");
+    vm.call_stack_.restore_state(entry);
+    vm.stack_.clear();
+
+    vm.push(Cell::from_int(2));
+    vm.push(Cell::from_int(3));
+    vm.call(word(vm, "+"));
+    CHECK(vm.pop() == Cell::from_int(5));
+  }
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <catch2/catch.hpp>
+#include <hustle/VM.hpp>
+#include <hustle/VM/IR.hpp>
+
+#include <sstream>
+
+using namespace hustle;
+
+static Cell word(VM& vm, const char* name) {
+  return Cell::from_raw(vm.lookup_symbol(name));
+}
+
+static Quotation* make_quote(VM& vm, std::initializer_list<Cell> cells) {
+  auto definition = vm.allocate_handle<Array>(cells.size());
+  std::copy(cells.begin(), cells.end(), definition->begin());
+  Quotation* quote = vm.allocate<Quotation>();
+  quote->definition = definition;
+  quote->entry = nullptr;
+  return quote;
+}
+
+static size_t count_opcode(Array* code, Opcode op) {
+  size_t count = 0;
+  for (Cell* ip = code->begin(); ip != code->end();) {
+    Opcode current = decode_opcode(*ip);
+    count += (current == op);
+    ip += OPCODE_SIZE[current];
+  }
+  return count;
+}
+
+/// Build the IR for cells, optimize it if asked, and print it
+static std::string ir_for(VM& vm, std::vector<Cell> cells,
+                          bool optimize = true) {
+  IRFunction ir;
+  const Cell* end = build_ir(vm, cells.data(), cells.data() + cells.size(), ir);
+  REQUIRE(end == cells.data() + cells.size());
+  if (optimize) {
+    optimize_ir(ir);
+  }
+  std::ostringstream out;
+  dump_ir(out, ir);
+  return out.str();
+}
+
+TEST_CASE("Shuffles disappear in the IR", "[ir]") {
+  VM vm;
+  CHECK(ir_for(vm, {word(vm, "swap"), word(vm, "over"), word(vm, "-")},
+               false) == "v0 = input 0\n"
+                         "v1 = input 1\n"
+                         "v2 = sub v1 v0 (checked)\n"
+                         "outputs: v0 v2\n");
+
+  // Runs stop at anything which isn't straight line code
+  IRFunction ir;
+  Cell cells[] = {Cell::from_int(1), word(vm, "call")};
+  CHECK(build_ir(vm, std::begin(cells), std::end(cells), ir) == cells + 1);
+  CHECK(ir.inputs == 0);
+}
+
+TEST_CASE("Identical values are computed once", "[ir]") {
+  VM vm;
+  CHECK(ir_for(vm, {word(vm, "dup"), Cell::from_int(1), word(vm, "+"),
+                    word(vm, "swap"), Cell::from_int(1), word(vm, "+"),
+                    word(vm, "+")}) == "v0 = input 0\n"
+                                       "v1 = const 1\n"
+                                       "v2 = add v0 v1 (checked)\n"
+                                       "v5 = add v2 v2\n"
+                                       "outputs: v5\n");
+}
+
+TEST_CASE("Unused values are removed", "[ir]") {
+  VM vm;
+  CHECK(ir_for(vm, {Cell::from_int(1), Cell::from_int(2), word(vm, "+"),
+                    word(vm, "drop")}) == "outputs:\n");
+
+  // Calls which aren't pure stay
+  CHECK(ir_for(vm, {Cell::from_int(1), word(vm, "drop"),
+                    word(vm, "tier-events")}) == "= call tier-events\n"
+                                                 "outputs:\n");
+}
+
+TEST_CASE("Fixnum checks are only made once", "[ir]") {
+  VM vm;
+  CHECK(ir_for(vm, {word(vm, "dup"), Cell::from_int(1), word(vm, "+"),
+                    word(vm, "<")}) == "v0 = input 0\n"
+                                       "v1 = const 1\n"
+                                       "v2 = add v0 v1 (checked)\n"
+                                       "v3 = lt v0 v2\n"
+                                       "outputs: v3\n");
+  CHECK(ir_for(vm, {Cell::from_int(1), Cell::from_int(2), word(vm, "<")}) ==
+        "v0 = const 1\n"
+        "v1 = const 2\n"
+        "v2 = lt v0 v1\n"
+        "outputs: v2\n");
+}
+
+TEST_CASE("Reads of a local are merged until it is written", "[ir]") {
+  VM vm;
+  Cell zero = Cell::from_int(0);
+  CHECK(ir_for(vm, {zero, word(vm, "local@"), zero, word(vm, "local@"),
+                    word(vm, "+"), zero, word(vm, "local!"), zero,
+                    word(vm, "local@")}) == "v0 = local@ 0\n"
+                                            "v2 = add v0 v0 (checked)\n"
+                                            "= local! 0 v2\n"
+                                            "v3 = local@ 0\n"
+                                            "outputs: v3\n");
+}
+
+TEST_CASE("Straight line code is lowered through the IR", "[ir]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+
+  SECTION("shuffles around arithmetic") {
+    auto quote = vm.make_handle(make_quote(
+        vm, {word(vm, "over"), word(vm, "over"), word(vm, "+"),
+             word(vm, "swap"), word(vm, "drop"), word(vm, "swap"),
+             word(vm, "drop")}));
+    vm.push(Cell::from_int(3));
+    vm.push(Cell::from_int(4));
+    vm.call(quote.cell());
+    CHECK(vm.pop() == Cell::from_int(7));
+    CHECK(vm.stack_.depth() == 0);
+    CHECK(count_opcode(quote->code, OP_ADD) == 1);
+    CHECK(count_opcode(quote->code, OP_CALL_LEAF) == 0);
+  }
+
+  SECTION("shuffles alone") {
+    auto quote = vm.make_handle(make_quote(
+        vm, {word(vm, "rot"), word(vm, "rot"), word(vm, "swap")}));
+    for (int i = 1; i <= 3; ++i) {
+      vm.push(Cell::from_int(i));
+    }
+    vm.call(quote.cell());
+    CHECK(vm.pop() == Cell::from_int(3));
+    CHECK(vm.pop() == Cell::from_int(1));
+    CHECK(vm.pop() == Cell::from_int(2));
+    CHECK(count_opcode(quote->code, OP_SHUFFLE) == 1);
+  }
+
+  SECTION("known fixnums") {
+    auto quote = vm.make_handle(make_quote(
+        vm, {word(vm, "dup"), Cell::from_int(1), word(vm, "+"),
+             word(vm, "swap"), Cell::from_int(1), word(vm, "+"),
+             word(vm, "+")}));
+    vm.push(Cell::from_int(3));
+    vm.call(quote.cell());
+    CHECK(vm.pop() == Cell::from_int(8));
+    CHECK(count_opcode(quote->code, OP_ADD) == 1);
+    CHECK(count_opcode(quote->code, OP_ADD_FIXNUM) == 1);
+  }
+
+  SECTION("unless it would not be any shorter") {
+    auto quote = vm.make_handle(
+        make_quote(vm, {word(vm, "swap"), word(vm, "drop"), Cell::from_int(1),
+                        word(vm, "+")}));
+    vm.push(Cell::from_int(3));
+    vm.push(Cell::from_int(4));
+    vm.call(quote.cell());
+    CHECK(vm.pop() == Cell::from_int(5));
+    CHECK(count_opcode(quote->code, OP_SHUFFLE) == 0);
+  }
+
+  SECTION("checking the stack first") {
+    auto quote = vm.make_handle(make_quote(
+        vm, {word(vm, "rot"), word(vm, "rot"), word(vm, "swap")}));
+    vm.push(Cell::from_int(1));
+    REQUIRE_THROWS_AS(vm.call(quote.cell()), Exception);
+    CHECK(vm.stack_.depth() == 1);
+  }
+}
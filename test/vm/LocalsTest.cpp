@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <catch2/catch.hpp>
+#include <hustle/VM.hpp>
+
+#include <sstream>
+
+using namespace hustle;
+using namespace std::literals;
+
+static void evaluate(VM& vm, const char* source) {
+  vm.lexer_.add_stream(std::make_unique<std::istringstream>(source));
+  vm.run();
+}
+
+static Word* word(VM& vm, const char* name) {
+  return cast<Word>(Cell::from_raw(vm.lookup_symbol(name)));
+}
+
+static size_t count_opcode(Array* code, Opcode op) {
+  size_t count = 0;
+  for (Cell* ip = code->begin(); ip != code->end();) {
+    Opcode current = decode_opcode(*ip);
+    count += (current == op);
+    ip += OPCODE_SIZE[current];
+  }
+  return count;
+}
+
+TEST_CASE("Words can be defined with locals", "[locals]") {
+  VM vm;
+  evaluate(vm, ":: hypot2 ( a b -- c ) a a * b b * + ;");
+  vm.push(Cell::from_int(3));
+  vm.push(Cell::from_int(4));
+  vm.call(word(vm, "hypot2"));
+  CHECK(vm.pop() == Cell::from_int(25));
+  CHECK(vm.stack_.depth() == 0);
+  CHECK(vm.locals_.depth() == 0);
+  CHECK(vm.parse_locals_.empty());
+
+  SECTION("and written") {
+    evaluate(vm, ":: bump ( a b -- a ) a b + a! a ;");
+    vm.push(Cell::from_int(3));
+    vm.push(Cell::from_int(4));
+    vm.call(word(vm, "bump"));
+    CHECK(vm.pop() == Cell::from_int(7));
+  }
+
+  SECTION("from nested quotations") {
+    evaluate(vm, ":: count-up ( n -- ... ) 0 { dup n < } { dup 1 + } while ;");
+    vm.push(Cell::from_int(3));
+    vm.call(word(vm, "count-up"));
+    REQUIRE(vm.stack_.depth() == 4);
+    CHECK(vm.pop() == Cell::from_int(3));
+    CHECK(vm.locals_.depth() == 0);
+  }
+
+  SECTION("calling other words with locals") {
+    evaluate(vm, ":: twice ( x -- y ) x x + ; "
+                 ":: quad ( x -- y ) x twice twice x drop ;");
+    vm.push(Cell::from_int(5));
+    vm.call(word(vm, "quad"));
+    CHECK(vm.pop() == Cell::from_int(20));
+    CHECK(vm.locals_.depth() == 0);
+  }
+}
+
+TEST_CASE("Quotations find the locals of the word they are in", "[locals]") {
+  VM vm;
+  evaluate(vm, ":: with-10 ( q -- ) 10 q call ; "
+               ":: add-to ( n -- r ) { n + } with-10 ; "
+               ":: set-to-10 ( n -- r ) { n! } with-10 n ;");
+
+  // Cold, then lowered
+  for (int i = 0; i < 3; ++i) {
+    vm.push(Cell::from_int(5));
+    vm.call(word(vm, "add-to"));
+    CHECK(vm.pop() == Cell::from_int(15));
+    vm.push(Cell::from_int(5));
+    vm.call(word(vm, "set-to-10"));
+    CHECK(vm.pop() == Cell::from_int(10));
+    CHECK(vm.stack_.depth() == 0);
+    CHECK(vm.locals_.depth() == 0);
+  }
+}
+
+TEST_CASE("Locals are dropped when an error unwinds their word", "[locals]") {
+  VM vm;
+  evaluate(vm, ":: fails ( a b -- ) a drop drop ; "
+               ":: sub ( a b -- c ) a b - ;");
+  CallStack::State entry = vm.call_stack_.get_state();
+  for (int i = 0; i < 3; ++i) {
+    vm.push(Cell::from_int(1));
+    vm.push(Cell::from_int(2));
+    CHECK_THROWS_AS(vm.call(word(vm, "fails")), Exception);
+    CHECK(vm.locals_.depth() == 0);
+    vm.call_stack_.restore_state(entry);
+    vm.stack_.clear();
+
+    vm.push(Cell::from_int(7));
+    vm.push(Cell::from_int(2));
+    vm.call(word(vm, "sub"));
+    CHECK(vm.pop() == Cell::from_int(5));
+  }
+}
+
+TEST_CASE("Locals are lowered to frame slots", "[locals]") {
+  VM vm;
+  vm.bytecode_threshold = 1;
+  evaluate(vm, ":: swap2 ( a b -- b a ) b a ;");
+
+  // Cells on the locals stack are moved by the GC
+  vm.heap_.debug_alloc = true;
+  vm.heap_.debug_alloc_major = GENERATE(false, true);
+  vm.push(vm.allocate<String>("first", 5));
+  vm.push(vm.allocate<String>("second", 6));
+  vm.call(word(vm, "swap2"));
+  CHECK(*cast<String>(vm.pop()) == "first"sv);
+  CHECK(*cast<String>(vm.pop()) == "second"sv);
+
+  Array* code = word(vm, "swap2")->definition->code;
+  REQUIRE(code != nullptr);
+  CHECK(count_opcode(code, OP_ENTER_LOCALS) == 1);
+  CHECK(count_opcode(code, OP_LOCAL_GET) == 2);
+  CHECK(count_opcode(code, OP_LEAVE_LOCALS) == 1);
+  CHECK(count_opcode(code, OP_CALL_LEAF) == 0);
+}
+
+TEST_CASE("Locals are checked like the stack", "[locals]") {
+  VM vm;
+  evaluate(vm, ":: add3 ( a b c -- d ) a b c + + ;");
+  vm.push(Cell::from_int(1));
+  vm.push(Cell::from_int(2));
+  CHECK_THROWS_AS(vm.call(word(vm, "add3")), Exception);
+  CHECK(vm.stack_.depth() == 2);
+}
+
+TEST_CASE("Definitions with locals need a stack effect", "[locals]") {
+  VM vm;
+  CHECK_THROWS_AS(evaluate(vm, ":: broken a b ;"), Exception);
+  CHECK(vm.parse_locals_.empty());
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <catch2/catch.hpp>
+#include <hustle/VM.hpp>
+
+#include <sstream>
+
+using namespace hustle;
+using namespace std::literals;
+
+static Cell word(VM& vm, const char* name) {
+  return Cell::from_raw(vm.lookup_symbol(name));
+}
+
+static Quotation* make_quote(VM& vm, std::initializer_list<Cell> cells) {
+  auto definition = vm.allocate_handle<Array>(cells.size());
+  std::copy(cells.begin(), cells.end(), definition->begin());
+  Quotation* quote = vm.allocate<Quotation>();
+  quote->definition = definition;
+  quote->entry = nullptr;
+  return quote;
+}
+
+// Define a word with def, returning its definition
+static Quotation* define(VM& vm, std::string_view name,
+                         std::initializer_list<Cell> cells) {
+  auto quote = vm.make_handle(make_quote(vm, cells));
+  vm.push(vm.allocate<String>(name.data(), name.size()));
+  vm.push(quote.cell());
+  vm.call(word(vm, "def"));
+  return quote;
+}
+
+static std::vector<Cell> cells_of(Array* array) {
+  return std::vector<Cell>(array->begin(), array->end());
+}
+
+static Cell run(VM& vm, const char* name) {
+  vm.call(word(vm, name));
+  REQUIRE(vm.stack_.depth() == 1);
+  return vm.pop();
+}
+
+TEST_CASE("Pure primitives on literals are folded", "[optimizer]") {
+  VM vm;
+  Quotation* quote =
+      define(vm, "five",
+             {Cell::from_int(2), Cell::from_int(3), word(vm, "+"),
+              word(vm, "dup"), word(vm, "drop")});
+  CHECK(cells_of(quote->definition) ==
+        std::vector<Cell>{Cell::from_int(5)});
+  CHECK(run(vm, "five") == Cell::from_int(5));
+
+  SECTION("through shuffles") {
+    quote = define(vm, "nine",
+                   {Cell::from_int(3), word(vm, "dup"), word(vm, "*")});
+    CHECK(cells_of(quote->definition) ==
+          std::vector<Cell>{Cell::from_int(9)});
+
+    quote = define(vm, "one", {Cell::from_int(1), Cell::from_int(2),
+                               word(vm, "swap"), word(vm, "-")});
+    CHECK(cells_of(quote->definition) ==
+          std::vector<Cell>{Cell::from_int(1)});
+  }
+
+  SECTION("to booleans") {
+    define(vm, "less", {Cell::from_int(1), Cell::from_int(2), word(vm, "<")});
+    CHECK(run(vm, "less") == vm.globals.True);
+  }
+
+  SECTION("but not when they would fail") {
+    quote = define(vm, "oops",
+                   {Cell::from_int(1), Cell::from_int(0), word(vm, "/")});
+    CHECK(quote->definition->count() == 3);
+  }
+
+  SECTION("but not when an input is unknown") {
+    quote = define(vm, "add2", {Cell::from_int(2), word(vm, "+")});
+    CHECK(cells_of(quote->definition) ==
+          std::vector<Cell>{Cell::from_int(2), word(vm, "+")});
+    vm.push(Cell::from_int(40));
+    CHECK(run(vm, "add2") == Cell::from_int(42));
+  }
+}
+
+TEST_CASE("Shuffles are simplified", "[optimizer]") {
+  VM vm;
+  Cell x = word(vm, "length");
+  Quotation* quote = define(
+      vm, "shuffle", {word(vm, "swap"), word(vm, "swap"), word(vm, "over"),
+                      word(vm, "drop"), Cell::from_int(7), word(vm, "drop")});
+  CHECK(quote->definition->count() == 0);
+
+  quote = define(vm, "literals", {Cell::from_int(1), Cell::from_int(2),
+                                  word(vm, "over"), x});
+  CHECK(cells_of(quote->definition) ==
+        std::vector<Cell>{Cell::from_int(1), Cell::from_int(2),
+                          Cell::from_int(1), x});
+}
+
+TEST_CASE("The original definition is kept", "[optimizer]") {
+  VM vm;
+  auto inner = vm.make_handle(
+      make_quote(vm, {Cell::from_int(4), word(vm, "drop")}));
+  auto quote =
+      vm.make_handle(define(vm, "outer", {inner.cell(), word(vm, "call")}));
+  CHECK(inner->definition->count() == 0);
+  CHECK(quote->source != nullptr);
+
+  // Sources must survive collections
+  vm.heap_.debug_alloc = true;
+  vm.heap_.debug_alloc_major = GENERATE(false, true);
+  vm.call(word(vm, "outer"));
+  CHECK(vm.stack_.depth() == 0);
+  REQUIRE(inner->source != nullptr);
+  CHECK(cells_of(inner->source) ==
+        std::vector<Cell>{Cell::from_int(4), word(vm, "drop")});
+}
+
+TEST_CASE("Optimized definitions can be dumped", "[optimizer]") {
+  VM vm;
+  std::ostringstream out;
+  vm.optimizer_.dump = &out;
+  define(vm, "six", {Cell::from_int(2), Cell::from_int(3), word(vm, "*")});
+  CHECK(out.str() == "six:\n"
+                     "  before: 2 3 * \n"
+                     "  after:  6 (constant-folding)\n");
+}
+
+TEST_CASE("Short words are inlined", "[optimizer]") {
+  VM vm;
+  define(vm, "my-nip", {word(vm, "swap"), word(vm, "drop")});
+  Quotation* quote = define(vm, "use", {Cell::from_int(1), Cell::from_int(2),
+                                        word(vm, "my-nip")});
+  CHECK(cells_of(quote->definition) == std::vector<Cell>{Cell::from_int(2)});
+
+  SECTION("and rebuilt when they are redefined") {
+    auto use = vm.make_handle(quote);
+    define(vm, "my-nip", {word(vm, "drop")});
+    CHECK(cells_of(use->definition) == std::vector<Cell>{Cell::from_int(1)});
+    CHECK(run(vm, "use") == Cell::from_int(1));
+  }
+
+  SECTION("through words which inlined them") {
+    define(vm, "one", {Cell::from_int(1)});
+    define(vm, "two", {word(vm, "one"), word(vm, "one"), word(vm, "+")});
+    auto four = vm.make_handle(define(vm, "four", {word(vm, "two"),
+                                                   word(vm, "two"),
+                                                   word(vm, "+")}));
+    CHECK(cells_of(four->definition) == std::vector<Cell>{Cell::from_int(4)});
+
+    define(vm, "one", {Cell::from_int(5)});
+    CHECK(cells_of(four->definition) ==
+          std::vector<Cell>{Cell::from_int(20)});
+    CHECK(run(vm, "four") == Cell::from_int(20));
+  }
+
+  SECTION("however deep the chain of words which inlined them") {
+    // w0 is 0, and each w<i> is w<i-1> 1 +, which folds to i
+    const int depth = 3 * Optimizer::MAX_ROUNDS;
+    define(vm, "w0", {Cell::from_int(0)});
+    std::string name;
+    for (int i = 1; i <= depth; ++i) {
+      std::string previous = "w" + std::to_string(i - 1);
+      name = "w" + std::to_string(i);
+      define(vm, name, {word(vm, previous.c_str()), Cell::from_int(1),
+                        word(vm, "+")});
+    }
+    auto last = [&] { return cast<Word>(word(vm, name.c_str()))->definition; };
+    CHECK(cells_of(last()->definition) ==
+          std::vector<Cell>{Cell::from_int(depth)});
+
+    define(vm, "w0", {Cell::from_int(100)});
+    CHECK(cells_of(last()->definition) ==
+          std::vector<Cell>{Cell::from_int(100 + depth)});
+    CHECK(run(vm, name.c_str()) == Cell::from_int(100 + depth));
+  }
+
+  SECTION("unless they are long") {
+    std::vector<Cell> cells(Optimizer::INLINE_LIMIT + 1, word(vm, "length"));
+    auto definition = vm.make_handle(vm.allocate<Array>(cells.size()));
+    std::copy(cells.begin(), cells.end(), definition->begin());
+    auto long_word = vm.make_handle(vm.allocate<Quotation>());
+    long_word->definition = definition;
+    long_word->entry = nullptr;
+    vm.push(vm.allocate<String>("long", 4));
+    vm.push(long_word.cell());
+    vm.call(word(vm, "def"));
+
+    quote = define(vm, "call-long", {word(vm, "long")});
+    CHECK(cells_of(quote->definition) ==
+          std::vector<Cell>{word(vm, "long")});
+  }
+}
+
+TEST_CASE("Recursive words are not inlined", "[optimizer]") {
+  VM vm;
+  define(vm, "b", {});
+  Quotation* quote = define(vm, "a", {word(vm, "b")});
+  CHECK(quote->definition->count() == 0);
+
+  // a now relies on b, so inlining it into b would lose the recursion
+  quote = define(vm, "b", {word(vm, "a")});
+  CHECK(cells_of(quote->definition) == std::vector<Cell>{word(vm, "a")});
+  quote = cast<Word>(word(vm, "a"))->definition;
+  CHECK(cells_of(quote->definition) == std::vector<Cell>{word(vm, "b")});
+
+  define(vm, "c", {});
+  quote = define(vm, "c", {word(vm, "c")});
+  CHECK(cells_of(quote->definition) == std::vector<Cell>{word(vm, "c")});
+}
+
+namespace {
+struct CountingPass : public OptimizerPass {
+  const char* name() const override { return "counting"; }
+  bool run(VM&, std::vector<Cell>& cells) override {
+    ++runs;
+    return false;
+  }
+  int runs = 0;
+};
+} // namespace
+
+TEST_CASE("Passes can be added", "[optimizer]") {
+  VM vm;
+  auto pass = std::make_unique<CountingPass>();
+  CountingPass* counter = pass.get();
+  vm.optimizer_.add_pass(std::move(pass));
+  define(vm, "nothing", {});
+  CHECK(counter->runs == 1);
+}
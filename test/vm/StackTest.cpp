@@ -33,6 +33,47 @@ TEST_CASE("Stack throws on overflow", "[Stack]") {
   CHECK_THROWS(stk.push(c));
   stk.pop();
   CHECK_NOTHROW(stk.push(c));
+
+  // Overflowing must leave the stack usable, however it is detected
+  for (int i = 0; i < 2; i++) {
+    CHECK_THROWS_WITH(stk.push(Cell::from_int(i)), "Stack overflow");
+    CHECK(stk.depth() == 3);
+    CHECK(stk.peek() == c);
+  }
+}
+
+TEST_CASE("Stack grows up to its limit", "[Stack]") {
+  Stack stack(4, 10000);
+  CHECK(stack.capacity() >= 4);
+  CHECK(stack.capacity() < 10000);
+  CHECK(stack.limit() == 10000);
+
+  for (int i = 0; i < 10000; i++) {
+    stack.push(Cell::from_int(i));
+  }
+  CHECK(stack.capacity() == 10000);
+  CHECK_THROWS_WITH(stack.push(Cell::from_int(0)), "Stack overflow");
+  CHECK(stack.depth() == 10000);
+  CHECK(stack.peek() == Cell::from_int(9999));
+  CHECK(stack[9999] == Cell::from_int(0));
+
+  Stack reserved(4, 10000);
+  CHECK_NOTHROW(reserved.reserve(5000));
+  CHECK(reserved.capacity() >= 5000);
+  CHECK_THROWS(reserved.reserve(10001));
+}
+
+TEST_CASE("CallStack throws on overflow", "[Stack]") {
+  CallStack stack(2);
+  StackFrame frame;
+  frame.retain = Cell::from_int(1);
+
+  CHECK_NOTHROW(stack.push(frame));
+  CHECK_NOTHROW(stack.push(frame));
+  CHECK_THROWS_WITH(stack.push(frame), "Stack overflow");
+  CHECK(stack.pop().retain == Cell::from_int(1));
+  CHECK_NOTHROW(stack.push(frame));
+  CHECK_THROWS(stack.push(frame));
 }
 
 TEST_CASE("Stack::operator[]", "[Stack]") {
@@ -111,3 +152,47 @@ TEST_CASE("Stack begin() and end()", "[Stack]") {
   CHECK(stack.begin() == stack.cbegin());
   CHECK(stack.end() == stack.cend());
 }
+
+TEST_CASE("Stack::require() guards unchecked access", "[Stack]") {
+  Stack stack(4);
+  CHECK_THROWS(stack.require(1));
+
+  stack.push(Cell::from_int(1));
+  stack.push(Cell::from_int(2));
+  CHECK_NOTHROW(stack.require(2));
+  CHECK_THROWS(stack.require(3));
+
+  CHECK(stack.top() == Cell::from_int(2));
+  CHECK(stack.top(1) == Cell::from_int(1));
+  stack.top(1) = Cell::from_int(3);
+  stack.drop(1);
+  CHECK(stack.depth() == 1);
+  CHECK(stack.pop() == Cell::from_int(3));
+}
+
+TEST_CASE("Stack::reserve() guards unchecked pushes", "[Stack]") {
+  Stack stack(4);
+  CHECK_NOTHROW(stack.reserve(4));
+  CHECK_THROWS(stack.reserve(5));
+
+  stack.push(Cell::from_int(1));
+  CHECK_NOTHROW(stack.reserve(3));
+  CHECK_THROWS(stack.reserve(4));
+
+  stack.push_unchecked(Cell::from_int(2));
+  CHECK(stack.depth() == 2);
+  CHECK(stack.pop() == Cell::from_int(2));
+}
+
+TEST_CASE("CallStack grows up to its limit", "[Stack]") {
+  CallStack stack(2, 1000);
+  StackFrame frame;
+  for (int i = 0; i < 1000; i++) {
+    frame.retain = Cell::from_int(i);
+    stack.push(frame);
+  }
+  CHECK_THROWS_WITH(stack.push(frame), "Stack overflow");
+  for (int i = 999; i >= 0; i--) {
+    REQUIRE(stack.pop().retain == Cell::from_int(i));
+  }
+}
@@ -35,12 +35,12 @@ void BackTraceCommand::exec(VM* vm) {
   const auto* end = vm->call_stack_.end();
   for (auto* frame = vm->call_stack_.begin(); frame < end; ++frame) {
     std::string_view word_name;
-    if (frame->word.is_a<Word>()) {
-      word_name = *cast<Word>(frame->word)->name;
+    if (frame->word != nullptr) {
+      word_name = *frame->word->name;
     } else {
       word_name = "<Anonymous>"sv;
     }
-    fmt::print("{}+{}\n", word_name, cast<intptr_t>(frame->offset));
+    fmt::print("{}+{}\n", word_name, frame->offset());
   }
 }
 
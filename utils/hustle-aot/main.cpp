@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2021, Devin Nakamura
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * \file
+ * Ahead of time compiler from .hsl word definitions to C++.
+ *
+ * The inputs are run in a VM, exactly as hustle would run them, and each word
+ * they define is translated from its optimized definition. Words are only
+ * translated if everything they do has a direct C++ equivalent: pushing
+ * fixnums and booleans, calling leaf primitives or other translated words, and
+ * literal quotations given straight to call, dip, ? call or while. Anything
+ * else (strings, quotations used as values, calls to words which need a
+ * frame) leaves the word to the interpreter. Recursive words are also left
+ * alone, as they would recurse on the native stack rather than the VM's call
+ * stack.
+ *
+ * The output is a translation unit defining `void hustle::register_<name>(VM&)`
+ * which installs the translated words. See hustle/VM/AOT.hpp.
+ */
+
+#include "hustle/Object.hpp"
+#include "hustle/Support/Error.hpp"
+#include "hustle/Support/Utility.hpp"
+#include "hustle/VM.hpp"
+#include "hustle/VM/Bytecode.hpp"
+
+#include <CLI/App.hpp>
+#include <CLI/Config.hpp>
+#include <CLI/Formatter.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <fmt/core.h>
+#include <fstream>
+#include <hustle/config.h>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace hustle;
+using namespace std::literals;
+namespace fs = std::filesystem;
+using std::string;
+
+static string word_name(Word* word) {
+  String* name = word->name;
+  return string(name->data(), name->data() + name->length());
+}
+
+/// Quote str as a C++ string literal
+static string escape(const string& str) {
+  string result = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c < ' ' || c > '~') {
+      result += fmt::format("\\{:03o}", (unsigned char)c);
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+static Quotation::FuncType entry_of(VM& vm, const char* name) {
+  return cast<Word>(Cell::from_raw(vm.lookup_symbol(name)))->definition->entry;
+}
+
+namespace {
+/// Translates definitions to the statements of a C++ function body
+class Translator {
+public:
+  explicit Translator(VM& vm)
+      : vm_(vm), call_(entry_of(vm, "call")), dip_(entry_of(vm, "dip")),
+        ternary_(entry_of(vm, "?")), while_(entry_of(vm, "while")) {}
+
+  /**
+   * Append the statements for definition to out.
+   *
+   * \returns false if something in it can not be translated
+   */
+  bool translate(Array* definition, int indent, string& out);
+
+  /// Translated words which may be called directly, with their index
+  std::map<string, size_t> words;
+
+  /// Leaf primitives called so far, in order of first use
+  std::vector<string> primitives;
+
+  /// Words from words called by the last translated definitions
+  std::set<string> callees;
+
+private:
+  bool calls(Cell cell, Quotation::FuncType entry) const {
+    if (!cell.is_a<Word>()) {
+      return false;
+    }
+    Quotation* definition = cast<Word>(cell)->definition;
+    return definition != nullptr && definition->entry == entry;
+  }
+
+  bool translate_literal(Cell cell, int indent, string& out);
+  bool translate_word(Word* word, int indent, string& out);
+  size_t primitive_index(const string& name);
+
+  VM& vm_;
+  Quotation::FuncType call_;
+  Quotation::FuncType dip_;
+  Quotation::FuncType ternary_;
+  Quotation::FuncType while_;
+  unsigned saved_ = 0;
+};
+} // namespace
+
+size_t Translator::primitive_index(const string& name) {
+  auto it = std::find(primitives.begin(), primitives.end(), name);
+  if (it == primitives.end()) {
+    primitives.push_back(name);
+    return primitives.size() - 1;
+  }
+  return it - primitives.begin();
+}
+
+bool Translator::translate_literal(Cell cell, int indent, string& out) {
+  if (cell.is_a<Wrapper>()) {
+    cell = cast<Wrapper>(cell)->wrapped;
+  }
+  string pad(indent, ' ');
+  if (cell.is_a<intptr_t>()) {
+    out += fmt::format("{}vm->push(Cell::from_int({}));\n", pad,
+                       cast<intptr_t>(cell));
+  } else if (cell == vm_.globals.True) {
+    out += pad + "vm->push(vm->globals.True);\n";
+  } else if (cell == vm_.globals.False) {
+    out += pad + "vm->push(vm->globals.False);\n";
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool Translator::translate_word(Word* word, int indent, string& out) {
+  string pad(indent, ' ');
+  string name = word_name(word);
+  auto compiled = words.find(name);
+  if (compiled != words.end()) {
+    callees.insert(name);
+    out += fmt::format("{}aot_{}(vm, nullptr); // {}\n", pad, compiled->second,
+                       name);
+    return true;
+  }
+  Quotation* definition = word->definition;
+  if (definition == nullptr || !definition->is_leaf ||
+      definition->entry == nullptr) {
+    return false;
+  }
+  out += fmt::format("{}primitives[{}](vm, nullptr); // {}\n", pad,
+                     primitive_index(name), name);
+  return true;
+}
+
+bool Translator::translate(Array* definition, int indent, string& out) {
+  string pad(indent, ' ');
+  Cell* cells = definition->begin();
+  size_t count = definition->count();
+  auto next_calls = [&](size_t i, size_t offset, Quotation::FuncType entry) {
+    return i + offset < count && calls(cells[i + offset], entry);
+  };
+  auto body_of = [&](Cell cell) -> Array* {
+    return cell.is_a<Quotation>() ? (Array*)cast<Quotation>(cell)->definition
+                                  : nullptr;
+  };
+
+  for (size_t i = 0; i < count; ++i) {
+    Cell cell = cells[i];
+    // Compiled words run without a frame, which locals belong to
+    if (match_local_word(vm_, cells + i, cells + count) != LOCAL_MAX) {
+      return false;
+    }
+    if (cell.is_a<Quotation>()) {
+      Array* body = body_of(cell);
+      Array* second = i + 1 < count ? body_of(cells[i + 1]) : nullptr;
+      if (body == nullptr) {
+        return false;
+      }
+      if (next_calls(i, 1, call_)) {
+        if (!translate(body, indent, out)) {
+          return false;
+        }
+        i += 1;
+      } else if (next_calls(i, 1, dip_)) {
+        unsigned saved = saved_++;
+        out += fmt::format("{}{{\n{}  auto saved{} = vm->make_handle(vm->pop());"
+                           "\n",
+                           pad, pad, saved);
+        if (!translate(body, indent + 2, out)) {
+          return false;
+        }
+        out += fmt::format("{}  vm->push(saved{}.cell());\n{}}}\n", pad, saved,
+                           pad);
+        i += 1;
+      } else if (second != nullptr && next_calls(i, 2, ternary_) &&
+                 next_calls(i, 3, call_)) {
+        out += pad + "if (vm->pop() == vm->globals.False) {\n";
+        if (!translate(second, indent + 2, out)) {
+          return false;
+        }
+        out += pad + "} else {\n";
+        if (!translate(body, indent + 2, out)) {
+          return false;
+        }
+        out += pad + "}\n";
+        i += 3;
+      } else if (second != nullptr && next_calls(i, 2, while_)) {
+        out += pad + "for (;;) {\n";
+        if (!translate(body, indent + 2, out)) {
+          return false;
+        }
+        out += pad + "  if (vm->pop() == vm->globals.False) {\n";
+        out += pad + "    break;\n";
+        out += pad + "  }\n";
+        if (!translate(second, indent + 2, out)) {
+          return false;
+        }
+        out += pad + "}\n";
+        i += 2;
+      } else {
+        return false;
+      }
+    } else if (translate_literal(cell, indent, out)) {
+      continue;
+    } else if (!cell.is_a<Word>() ||
+               !translate_word(cast<Word>(cell), indent, out)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Check if name can reach itself through the calls in graph
+static bool is_recursive(const std::map<string, std::set<string>>& graph,
+                         const string& name) {
+  std::set<string> seen;
+  std::vector<string> work(graph.at(name).begin(), graph.at(name).end());
+  while (!work.empty()) {
+    string next = work.back();
+    work.pop_back();
+    if (next == name) {
+      return true;
+    }
+    if (!seen.insert(next).second) {
+      continue;
+    }
+    auto it = graph.find(next);
+    if (it != graph.end()) {
+      work.insert(work.end(), it->second.begin(), it->second.end());
+    }
+  }
+  return false;
+}
+
+static Array* definition_of(VM& vm, const string& name) {
+  return cast<Word>(Cell::from_raw(vm.lookup_symbol(name)))
+      ->definition->definition;
+}
+
+/**
+ * Narrow candidates down to the words which can be translated.
+ *
+ * Dropping a word can make the words calling it untranslatable, so this is
+ * repeated until nothing changes.
+ */
+static std::vector<string> select_words(VM& vm, std::vector<string> names) {
+  while (true) {
+    Translator translator(vm);
+    for (size_t i = 0; i < names.size(); ++i) {
+      translator.words[names[i]] = i;
+    }
+    std::vector<string> kept;
+    std::map<string, std::set<string>> graph;
+    for (const string& name : names) {
+      string body;
+      translator.callees.clear();
+      if (translator.translate(definition_of(vm, name), 2, body)) {
+        kept.push_back(name);
+        graph[name] = translator.callees;
+      }
+    }
+    std::vector<string> result;
+    for (const string& name : kept) {
+      if (!is_recursive(graph, name)) {
+        result.push_back(name);
+      }
+    }
+    if (result.size() == names.size()) {
+      return result;
+    }
+    names = std::move(result);
+  }
+}
+
+static string generate(VM& vm, const std::vector<string>& names,
+                       const string& module_name,
+                       const std::vector<string>& inputs) {
+  Translator translator(vm);
+  for (size_t i = 0; i < names.size(); ++i) {
+    translator.words[names[i]] = i;
+  }
+  string functions;
+  for (size_t i = 0; i < names.size(); ++i) {
+    functions += fmt::format("// {}\nstatic void aot_{}(VM* vm, Quotation*) {{\n",
+                             names[i], i);
+    bool ok = translator.translate(definition_of(vm, names[i]), 2, functions);
+    HSTL_ASSERT(ok);
+    functions += "}\n\n";
+  }
+
+  string out;
+  out += "// Generated by hustle-aot from:\n";
+  for (const string& input : inputs) {
+    out += fmt::format("//   {}\n", fs::path(input).filename().string());
+  }
+  out += "// Do not edit.\n\n";
+  out += "#include \"hustle/VM.hpp\"\n";
+  out += "#include \"hustle/VM/AOT.hpp\"\n\n";
+  out += "#include <iterator>\n\n";
+  out += "using namespace hustle;\n\n";
+  out += fmt::format("namespace hustle {{\nvoid register_{}(VM& vm);\n}}\n\n",
+                     module_name);
+
+  const auto& primitives = translator.primitives;
+  if (!primitives.empty()) {
+    out += "static const char* const primitive_names[] = {\n";
+    for (const string& name : primitives) {
+      out += fmt::format("  {},\n", escape(name));
+    }
+    out += "};\n\n";
+    out += fmt::format("static VM::CallType primitives[{}];\n\n",
+                       primitives.size());
+  }
+
+  if (!names.empty()) {
+    for (size_t i = 0; i < names.size(); ++i) {
+      out += fmt::format("static void aot_{}(VM* vm, Quotation*);\n", i);
+    }
+    out += "\n" + functions;
+    out += "static const AOTWord words[] = {\n";
+    for (size_t i = 0; i < names.size(); ++i) {
+      Word* word = cast<Word>(Cell::from_raw(vm.lookup_symbol(names[i])));
+      StackEffect effect = infer_effect(vm, word->definition);
+      out += fmt::format("  {{{}, &aot_{}, StackEffect{{{}, {}, {}}}}},\n",
+                         escape(names[i]), i, effect.in, effect.out,
+                         effect.growth);
+    }
+    out += "};\n\n";
+  }
+
+  out += fmt::format("void hustle::register_{}(VM& vm) {{\n", module_name);
+  out += "  AOTModule module{";
+  out += names.empty() ? "nullptr, 0, " : "words, std::size(words), ";
+  out += primitives.empty()
+             ? "nullptr, nullptr, 0"
+             : "primitive_names, primitives, std::size(primitives)";
+  out += "};\n";
+  out += "  register_aot_words(vm, module);\n";
+  out += "}\n";
+  return out;
+}
+
+static bool file_eq(const fs::path& path, const string& str) {
+  std::ifstream input(path);
+  std::stringstream buff;
+  buff << input.rdbuf();
+  return buff.str() == str;
+}
+
+int main(int argc, char** argv) {
+  hustle::save_argv0(argv[0]);
+  string output_file = "-";
+  string module_name = "aot_words";
+  std::vector<string> inputs;
+  bool no_kernel = false;
+  CLI::App app{"hustle-aot"};
+  app.set_version_flag("-v,--version", HUSTLE_VERSION);
+
+  app.add_option("-o", output_file, "Output file");
+  app.add_option("--name", module_name,
+                 "Name of the module. The words are installed by "
+                 "hustle::register_<name>(VM&)");
+  app.add_flag("--no-kernel", no_kernel,
+               "Do not load the kernel before the inputs");
+  app.add_option("input_files", inputs, "Hustle files defining the words")
+      ->required()
+      ->check(CLI::ExistingFile);
+
+  CLI11_PARSE(app, argc, argv);
+
+  VM vm;
+  if (!no_kernel) {
+    vm.load_kernel();
+  }
+
+  // Words which are new or redefined after running the inputs are candidates
+  std::map<string, intptr_t> versions;
+  for (const auto& [name, cell] : vm.symbol_table_) {
+    if (is_a<Word>(cell)) {
+      versions[name] = cast<intptr_t>(cast<Word>(cell)->version);
+    }
+  }
+  for (const string& input : inputs) {
+    vm.lexer_.add_stream(std::make_unique<std::ifstream>(input));
+    vm.run();
+  }
+  std::vector<string> candidates;
+  for (const auto& [name, raw] : vm.symbol_table_) {
+    if (!is_a<Word>(raw)) {
+      continue;
+    }
+    Word* word = cast<Word>(raw);
+    Quotation* definition = word->definition;
+    if (word->is_parse_word || definition == nullptr ||
+        definition->definition == nullptr) {
+      continue;
+    }
+    auto old = versions.find(name);
+    if (old == versions.end() || old->second != cast<intptr_t>(word->version)) {
+      candidates.push_back(name);
+    }
+  }
+
+  std::vector<string> names = select_words(vm, candidates);
+  for (const string& name : candidates) {
+    if (std::find(names.begin(), names.end(), name) == names.end()) {
+      std::cerr << "hustle-aot: leaving '" << name << "' to the interpreter\n";
+    }
+  }
+
+  string content = generate(vm, names, module_name, inputs);
+  if (output_file == "-") {
+    std::cout << content;
+  } else if (!fs::exists(output_file) || !file_eq(output_file, content)) {
+    std::ofstream(output_file) << content;
+  }
+  return 0;
+}
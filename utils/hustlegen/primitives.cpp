@@ -28,6 +28,8 @@
 
 #include "hustlegen.hpp"
 
+#include <sstream>
+#include <stdexcept>
 #include <string>
 using std::string;
 
@@ -42,6 +44,11 @@ static void write_forward_decls(IndentingStream& out, const YAML::Node& data) {
   for (const auto [prim_name, func_name] : kv_node(data["parse_words"])) {
     out.writeln("static void {}(VM *vm, Quotation*);", func_name.as<string>());
   }
+
+  out.nl().writeln("// Superinstructions");
+  for (const auto [pattern, func_name] : kv_node(data["superinstructions"])) {
+    out.writeln("static void {}(VM *vm, Quotation*);", func_name.as<string>());
+  }
   out.nl();
 }
 
@@ -58,6 +65,53 @@ static void write_function_table(IndentingStream& out, const YAML::Node& data,
   out.outdent().writeln("}};").nl();
 }
 
+static void write_function_list(IndentingStream& out, const YAML::Node& data,
+                                const string& name) {
+  out.writeln("static constexpr VM::CallType {}[] = {{", name);
+  out.indent();
+  for (const auto& func_name : data) {
+    out.writeln("&{},", func_name.as<string>());
+  }
+  out.outdent().writeln("}};").nl();
+}
+
+/// Count the inputs and outputs of an effect written as "a b -- c"
+static std::pair<int, int> parse_effect(const string& effect) {
+  std::istringstream tokens(effect);
+  std::string token;
+  int counts[2] = {0, 0};
+  int side = 0;
+  while (tokens >> token) {
+    if (token == "--") {
+      if (side != 0) {
+        throw std::runtime_error("Stack effect has more than one '--': " +
+                                 effect);
+      }
+      side = 1;
+    } else {
+      ++counts[side];
+    }
+  }
+  if (side == 0) {
+    throw std::runtime_error("Stack effect is missing '--': " + effect);
+  }
+  return {counts[0], counts[1]};
+}
+
+static void write_effect_table(IndentingStream& out, const YAML::Node& data,
+                               const string& name) {
+  out.writeln("static constexpr std::pair<VM::CallType, StackEffect> "
+              "{}[] = {{",
+              name);
+  out.indent();
+  for (auto [func_name, effect] : kv_node(data)) {
+    auto [in, out_count] = parse_effect(effect.as<string>());
+    out.writeln("{{&{}, StackEffect::of({}, {})}},", func_name.as<string>(),
+                in, out_count);
+  }
+  out.outdent().writeln("}};").nl();
+}
+
 void write_primitives(IndentingStream& out, ParseType data) {
 
   write_forward_decls(out, data);
@@ -66,6 +120,10 @@ void write_primitives(IndentingStream& out, ParseType data) {
 
   write_function_table(out, data["words"], "primitives");
   write_function_table(out, data["parse_words"], "parse_primitives");
+  write_function_table(out, data["superinstructions"], "superinstructions");
+  write_function_list(out, data["leaf"], "leaf_primitives");
+  write_function_list(out, data["pure"], "pure_primitives");
+  write_effect_table(out, data["effects"], "primitive_effects");
 }
 
 void write_primitive_test_cases(IndentingStream& out, ParseType data) {